@@ -47,7 +47,15 @@
 *
 */
 
+#include <stdlib.h>			//malloc, abs
+#include <string.h>			//memcpy
+#include <time.h>			//clock_gettime
+
+#include <algorithm>
+
 #include "Adafruit_ILI9341.h"
+#include "color_convert.h"
+#include "blend.h"
 
 
 #define MADCTL_MY  0x80     ///< Bottom to top
@@ -58,8 +66,7 @@
 #define MADCTL_BGR 0x08     ///< Blue-Green-Red pixel order
 #define MADCTL_MH  0x04     ///< LCD refresh right to left
 
-#define digitalWrite(pin,state) bcm2835_gpio_write(pin,state);
-#define delay(ms) 				bcm2835_delay(ms);
+#define delay(ms) 				busDelay(ms);
 
 /*
  *	SPI transaction framing
@@ -71,12 +78,30 @@
 /*
  * Control Pins
  * */
-#define RESET_HIGH()			digitalWrite(RESET,HIGH);
-#define RESET_LOW()				digitalWrite(RESET,LOW);
-#define DC_HIGH()           	digitalWrite(DC,HIGH); 
-#define DC_LOW()            	digitalWrite(DC,LOW);
-#define SPI_CS_HIGH()			digitalWrite(CS,HIGH); 
-#define SPI_CS_LOW()			digitalWrite(CS,LOW);
+#define RESET_HIGH()			busReset(true);
+#define RESET_LOW()				busReset(false);
+#define DC_HIGH()           	busDC(true);
+#define DC_LOW()            	busDC(false);
+#define SPI_CS_HIGH()			busCS(true);
+#define SPI_CS_LOW()			busCS(false);
+
+/*
+ * Instrumentation
+ * */
+#if ILI9341_STATS
+#define STAT_CALL(api)			_stats.calls[ILI9341_API_##api]++;
+#define STAT_ADD(field, n)		_stats.field += (n);
+#else
+#define STAT_CALL(api)
+#define STAT_ADD(field, n)
+#endif
+
+/*
+ * Thread safety. Public calls that touch driver state hold _apiLock, and a
+ * write transaction holds it from startWrite() to endWrite(). It is
+ * recursive, so public calls nest freely inside a transaction.
+ * */
+#define API_LOCK()				std::lock_guard<std::recursive_mutex> apiGuard(_apiLock);
 
 
 /**************************************************************************/
@@ -94,180 +119,161 @@ uint16_t Adafruit_ILI9341::color565(uint8_t red, uint8_t green, uint8_t blue) {
 }
 
 
+/**************************************************************************/
+/*!
+    @brief   Stop the flush thread and release the framebuffers, if any
+*/
+/**************************************************************************/
+Adafruit_ILI9341::~Adafruit_ILI9341() {
+    enableAsyncFlush(false);
+    stopFlushThread();
+    free(_fb);
+    free(_glyphs);
+    free(_polyX);
+    _pool.release(_colorbuf);
+}
+
+/*
+ * Panel initialization table. Each entry is a command byte, a parameter
+ * count, the parameter bytes and, when the count has ILI9341_INIT_DELAY
+ * set, one byte of post-command delay in milliseconds. A command byte of
+ * 0x00 ends the table.
+ *
+ * SLPOUT and DISPON are each followed by 120ms, as in the original
+ * Adafruit sequence: the sleep-out sequence and supply stabilisation take
+ * that long, not just the 5ms before the next command is accepted. The
+ * 120ms sleep-out lockout after reset is covered in begin().
+ * */
+static constexpr uint8_t ILI9341_initcmd[] = {
+    0xEF, 3, 0x03, 0x80, 0x02,
+    0xCF, 3, 0x00, 0xC1, 0x30,
+    0xED, 4, 0x64, 0x03, 0x12, 0x81,
+    0xE8, 3, 0x85, 0x00, 0x78,
+    0xCB, 5, 0x39, 0x2C, 0x00, 0x34, 0x02,
+    0xF7, 1, 0x20,
+    0xEA, 2, 0x00, 0x00,
+    ILI9341_PWCTR1  , 1, 0x23,             // Power control VRH[5:0]
+    ILI9341_PWCTR2  , 1, 0x10,             // Power control SAP[2:0];BT[3:0]
+    ILI9341_VMCTR1  , 2, 0x3e, 0x28,       // VCM control
+    ILI9341_VMCTR2  , 1, 0x86,             // VCM control2
+    ILI9341_MADCTL  , 1, 0x48,             // Memory Access Control
+    ILI9341_VSCRSADD, 2, 0x00, 0x00,       // Vertical scroll zero
+    ILI9341_PIXFMT  , 1, 0x55,
+    ILI9341_FRMCTR1 , 2, 0x00, 0x18,
+    ILI9341_DFUNCTR , 3, 0x08, 0x82, 0x27, // Display Function Control
+    0xF2, 1, 0x00,                         // 3Gamma Function Disable
+    ILI9341_GAMMASET, 1, 0x01,             // Gamma curve selected
+    ILI9341_GMCTRP1 , 15, 0x0F, 0x31, 0x2B, 0x0C, 0x0E, 0x08, // Set Gamma
+      0x4E, 0xF1, 0x37, 0x07, 0x10, 0x03, 0x0E, 0x09, 0x00,
+    ILI9341_GMCTRN1 , 15, 0x00, 0x0E, 0x14, 0x03, 0x11, 0x07, // Set Gamma
+      0x31, 0xC1, 0x48, 0x08, 0x0F, 0x0C, 0x31, 0x36, 0x0F,
+    ILI9341_SLPOUT  , ILI9341_INIT_DELAY | 0, 120, // Exit Sleep
+    ILI9341_DISPON  , ILI9341_INIT_DELAY | 0, 120, // Display on
+    0x00                                   // End of list
+};
+
+
 /**************************************************************************/
 /*!
     @brief   Initialize ILI9341 chip
-    Connects to the ILI9341 over SPI and sends initialization procedure commands
-    @param    freq  Desired SPI clock frequency
+    Connects to the ILI9341 over the transport, resets it and replays an
+    initialization table, one bus transfer per command's parameters.
+    The time taken is available from initTime() afterwards.
+    @param    initTable  Command table in ILI9341_initcmd format, or NULL
+                         for the built-in ILI9341 sequence
+    @return  True on success
 */
 /**************************************************************************/
-bool Adafruit_ILI9341::begin(void)
+bool Adafruit_ILI9341::begin(const uint8_t *initTable)
 {
-
-    //Initialize the bcm2835 library
-    if (!bcm2835_init())
+    API_LOCK();
+    STAT_CALL(begin);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    waitFlush(); // Don't reset the panel under a frame being sent
+    uint8_t from = _rotation;
+
+    //Initialize the bus and control signals
+    if (!_bus->begin())
     {
-      printf("bcm2835_init failed. Are you running as root??\n");
+      printf("Transport initialization failed\n");
       return false;
     }
-    
-    //Initialize the SPI module
-    if (!bcm2835_spi_begin())
-    {
-      printf("bcm2835_spi_begin failed. Are you running as root??\n");
-      return false;
+    // One transfer buffer per transport message
+    _pool.release(_colorbuf);
+    _colorbuf = NULL;
+    uint32_t maxTransfer = _bus->maxTransfer();
+    if (!_pool.resize(maxTransfer ? maxTransfer : ILI9341_PIXBUF_PIXELS * 2)) {
+        return false;
     }
-    bcm2835_spi_setBitOrder(BCM2835_SPI_BIT_ORDER_MSBFIRST);      // The default
-    bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);                   // The default
-    bcm2835_spi_setClockDivider(BCM2835_SPI_CLOCK_DIVIDER_65536); // The default
-    bcm2835_spi_chipSelect(BCM2835_SPI_CS0);                      // The default
-    bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);      // the default
-	
-	//Initialize the control signals
-	bcm2835_gpio_fsel(RESET,BCM2835_GPIO_FSEL_OUTP);
-	bcm2835_gpio_fsel(DC,BCM2835_GPIO_FSEL_OUTP);
-	bcm2835_gpio_fsel(CS,BCM2835_GPIO_FSEL_OUTP);
 	RESET_HIGH();
 	DC_HIGH();
 	SPI_CS_HIGH();
 	
-    // toggle RST low to reset
-	delay(100);
+    _ramwrActive = _casetValid = _pasetValid = false;
+    _tileHashValid = false;
+
+    // Toggle RST low to reset. The panel needs a 10us pulse; 1ms is the
+    // shortest delay() the transports offer. The panel then refuses SLPOUT
+    // for 120ms, which the table reaches almost at once.
     RESET_LOW();
-    delay(100);
+    delay(1);
     RESET_HIGH();
-    delay(200);
-  
-
-    startWrite();
-    
-    writeCommand(0xEF);
-    spiWrite(0x03);
-    spiWrite(0x80);
-    spiWrite(0x02);
-
-    writeCommand(0xCF);
-    spiWrite(0x00);
-    spiWrite(0XC1);
-    spiWrite(0X30);
-
-    writeCommand(0xED);
-    spiWrite(0x64);
-    spiWrite(0x03);
-    spiWrite(0X12);
-    spiWrite(0X81);
-
-    writeCommand(0xE8);
-    spiWrite(0x85);
-    spiWrite(0x00);
-    spiWrite(0x78);
-
-    writeCommand(0xCB);
-    spiWrite(0x39);
-    spiWrite(0x2C);
-    spiWrite(0x00);
-    spiWrite(0x34);
-    spiWrite(0x02);
-
-    writeCommand(0xF7);
-    spiWrite(0x20);
-
-    writeCommand(0xEA);
-    spiWrite(0x00);
-    spiWrite(0x00);
-
-    writeCommand(ILI9341_PWCTR1);    //Power control
-    spiWrite(0x23);   //VRH[5:0]
-
-    writeCommand(ILI9341_PWCTR2);    //Power control
-    spiWrite(0x10);   //SAP[2:0];BT[3:0]
-
-    writeCommand(ILI9341_VMCTR1);    //VCM control
-    spiWrite(0x3e);
-    spiWrite(0x28);
-
-    writeCommand(ILI9341_VMCTR2);    //VCM control2
-    spiWrite(0x86);  //--
-
-    writeCommand(ILI9341_MADCTL);    // Memory Access Control
-    spiWrite(0x48);
-
-    writeCommand(ILI9341_VSCRSADD); // Vertical scroll
-    spiWrite16(0);                 // Zero
-
-    writeCommand(ILI9341_PIXFMT);
-    spiWrite(0x55);
-
-    writeCommand(ILI9341_FRMCTR1);
-    spiWrite(0x00);
-    spiWrite(0x18);
-
-    writeCommand(ILI9341_DFUNCTR);    // Display Function Control
-    spiWrite(0x08);
-    spiWrite(0x82);
-    spiWrite(0x27);
-
-    writeCommand(0xF2);    // 3Gamma Function Disable
-    spiWrite(0x00);
-
-    writeCommand(ILI9341_GAMMASET);    //Gamma curve selected
-    spiWrite(0x01);
-
-    writeCommand(ILI9341_GMCTRP1);    //Set Gamma
-    spiWrite(0x0F);
-    spiWrite(0x31);
-    spiWrite(0x2B);
-    spiWrite(0x0C);
-    spiWrite(0x0E);
-    spiWrite(0x08);
-    spiWrite(0x4E);
-    spiWrite(0xF1);
-    spiWrite(0x37);
-    spiWrite(0x07);
-    spiWrite(0x10);
-    spiWrite(0x03);
-    spiWrite(0x0E);
-    spiWrite(0x09);
-    spiWrite(0x00);
-
-    writeCommand(ILI9341_GMCTRN1);    //Set Gamma
-    spiWrite(0x00);
-    spiWrite(0x0E);
-    spiWrite(0x14);
-    spiWrite(0x03);
-    spiWrite(0x11);
-    spiWrite(0x07);
-    spiWrite(0x31);
-    spiWrite(0xC1);
-    spiWrite(0x48);
-    spiWrite(0x08);
-    spiWrite(0x0F);
-    spiWrite(0x0C);
-    spiWrite(0x31);
-    spiWrite(0x36);
-    spiWrite(0x0F);
-
-    writeCommand(ILI9341_SLPOUT);    //Exit Sleep
-    delay(120);
-    writeCommand(ILI9341_DISPON);    //Display on
     delay(120);
-    
-    endWrite();
+
+    beginBus();
+    runInitTable(initTable ? initTable : ILI9341_initcmd);
+    endBus();
 
     _width  = ILI9341_TFTWIDTH;
     _height = ILI9341_TFTHEIGHT;
+    _rotation = 0;
+    if (_fb) { // The reset cleared GRAM, send the whole picture again
+        if (from) rotateFramebuffer(from);
+        _ndirty = 0;
+        markDirty(0, 0, _width, _height);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    _initMicros = (uint32_t)((t1.tv_sec - t0.tv_sec) * 1000000L +
+                             (t1.tv_nsec - t0.tv_nsec) / 1000);
     
     return true;
 }
 
+/**************************************************************************/
+/*!
+    @brief   Replay a command table, does not set up SPI transaction
+    @param   table  Command table in ILI9341_initcmd format
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::runInitTable(const uint8_t *table) {
+    uint8_t cmd;
+    while ((cmd = *table++) != 0x00) {
+        uint8_t x = *table++;
+        uint8_t numArgs = x & ~ILI9341_INIT_DELAY;
+        writeCommand(cmd);
+        if (numArgs) {
+            busWrite(table, numArgs);
+            table += numArgs;
+        }
+        if (x & ILI9341_INIT_DELAY) {
+            delay(*table++);
+        }
+    }
+}
+
 /**************************************************************************/
 /*!
     @brief   Disables the peripheral operation
 */
 /**************************************************************************/
 void Adafruit_ILI9341::end(void) {
-	bcm2835_spi_end();
-	bcm2835_close();
+    API_LOCK();
+    waitFlush();       // The flush thread must be done with the bus before it closes,
+    stopFlushThread(); // and not outlive it. present() starts it again.
+    STAT_CALL(end);
+	_bus->end();
 }
 
 /**************************************************************************/
@@ -277,7 +283,12 @@ void Adafruit_ILI9341::end(void) {
 */
 /**************************************************************************/
 void Adafruit_ILI9341::setRotation(uint8_t m) {
+    API_LOCK();
+    STAT_CALL(setRotation);
+    waitFlush(); // Don't interleave with a frame being sent
     uint8_t rotation = m % 4; // can't be higher than 3
+    uint8_t from = _rotation;
+    flush(); // Pending changes go out in the old layout
     switch (rotation) {
         case 0:
             m = (MADCTL_MX | MADCTL_BGR);
@@ -301,10 +312,17 @@ void Adafruit_ILI9341::setRotation(uint8_t m) {
             break;
     }
 
-    startWrite();
+    _rotation = rotation;
+
+    beginBus();
     writeCommand(ILI9341_MADCTL);
     spiWrite(m);
-    endWrite();
+    endBus();
+
+    _tileHashValid = false; // Tile grid follows _width as well
+    if (_fb && (rotation != from)) {
+        rotateFramebuffer(from);
+    }
 }
 
 /**************************************************************************/
@@ -314,9 +332,12 @@ void Adafruit_ILI9341::setRotation(uint8_t m) {
 */
 /**************************************************************************/
 void Adafruit_ILI9341::invertDisplay(bool invert) {
-    startWrite();
+    API_LOCK();
+    STAT_CALL(invertDisplay);
+    waitFlush();
+    beginBus();
     writeCommand(invert ? ILI9341_INVON : ILI9341_INVOFF);
-    endWrite();
+    endBus();
 }
 
 /**************************************************************************/
@@ -326,10 +347,62 @@ void Adafruit_ILI9341::invertDisplay(bool invert) {
 */
 /**************************************************************************/
 void Adafruit_ILI9341::scrollTo(uint16_t y) {
-    startWrite();
+    API_LOCK();
+    STAT_CALL(scrollTo);
+    waitFlush();
+    beginBus();
     writeCommand(ILI9341_VSCRSADD);
     spiWrite16(y);
-    endWrite();
+    endBus();
+    _scrollPos = y;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Define fixed areas at the top and bottom of GRAM that do not
+             scroll (VSCRDEF), e.g. a header and a status bar. Rows are in
+             panel memory order, which is screen order in rotation 0.
+             Resets the scroll position to the top of the scroll area.
+    @param   top     Rows in the fixed top area
+    @param   bottom  Rows in the fixed bottom area
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::setScrollMargins(uint16_t top, uint16_t bottom) {
+    API_LOCK();
+    STAT_CALL(setScrollMargins);
+    if (top + bottom >= ILI9341_TFTHEIGHT) return; // Nothing left to scroll
+    _scrollTop    = top;
+    _scrollHeight = ILI9341_TFTHEIGHT - top - bottom;
+
+    waitFlush();
+    beginBus();
+    writeCommand(ILI9341_VSCRDEF);
+    spiWrite16(top);
+    spiWrite16(_scrollHeight);
+    spiWrite16(bottom);
+    endBus();
+    scrollTo(top);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Scroll the scroll area up by some rows. The rows that leave the
+             top reappear at the bottom, so the caller only has to redraw
+             that band: rows [start, start + lines) of the scroll area,
+             wrapping from its last row back to its first.
+    @param   lines  Rows to scroll by, less than the scroll area height
+    @return  GRAM row where the newly exposed band starts
+*/
+/**************************************************************************/
+uint16_t Adafruit_ILI9341::scrollAdvance(uint16_t lines) {
+    API_LOCK();
+    STAT_CALL(scrollAdvance);
+    uint16_t start = _scrollPos;
+    if (start < _scrollTop || start >= _scrollTop + _scrollHeight) {
+        start = _scrollTop; // Position set outside the area by scrollTo()
+    }
+    scrollTo(_scrollTop + (start - _scrollTop + lines) % _scrollHeight);
+    return start;
 }
 
 /**************************************************************************/
@@ -342,13 +415,78 @@ void Adafruit_ILI9341::scrollTo(uint16_t y) {
 */
 /**************************************************************************/
 void Adafruit_ILI9341::setAddrWindow(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+    STAT_CALL(setAddrWindow);
+    if (_fb) {
+        _fbWin.x = x;
+        _fbWin.y = y;
+        _fbWin.w = w;
+        _fbWin.h = h;
+        _fbPos = 0;
+        markDirty(x, y, w, h);
+        return;
+    }
+    writeAddrWindow(x, y, w, h);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Send CASET/PASET/RAMWR for a window straight to the panel,
+             bypassing the shadow framebuffer
+    @param   x  TFT memory 'x' origin
+    @param   y  TFT memory 'y' origin
+    @param   w  Width of rectangle
+    @param   h  Height of rectangle
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::writeAddrWindow(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+    if (_ramwrActive && ((_caset >> 16) <= (_caset & 0xFFFF)) &&
+                        ((_paset >> 16) <= (_paset & 0xFFFF))) {
+        // Skip everything if the panel's write pointer is already at (x,y)
+        // and the new window is the next stretch of the current one
+        uint16_t wx0 = _caset >> 16, wx1 = _caset;
+        uint16_t wy0 = _paset >> 16, wy1 = _paset;
+        uint32_t ww  = wx1 - wx0 + 1;
+        uint32_t pos = _ramwrPos % (ww * (wy1 - wy0 + 1));
+        uint16_t cx  = wx0 + pos % ww, cy = wy0 + pos / ww;
+        if ((x == cx) && (y == cy)) {
+            if ((h == 1) && (x + w - 1 <= wx1)) return;          // Rest of this row
+            if ((x == wx0) && (x + w - 1 == wx1) &&
+                (y + h - 1 <= wy1)) return;                      // Whole rows
+        }
+    }
+
+    writeWindowRegs(x, y, w, h);
+    writeCommand(ILI9341_RAMWR); // write to RAM
+    _ramwrActive = true;
+    _ramwrPos = 0;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Send CASET and PASET for a window, skipping any that the panel
+             already has. DOES NOT set up SPI transaction.
+    @param   x  TFT memory 'x' origin
+    @param   y  TFT memory 'y' origin
+    @param   w  Width of rectangle
+    @param   h  Height of rectangle
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::writeWindowRegs(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
     uint32_t xa = ((uint32_t)x << 16) | (x+w-1);
     uint32_t ya = ((uint32_t)y << 16) | (y+h-1);
-    writeCommand(ILI9341_CASET); // Column addr set
-    spiWrite32(xa);
-    writeCommand(ILI9341_PASET); // Row addr set
-    spiWrite32(ya);
-    writeCommand(ILI9341_RAMWR); // write to RAM
+
+    if (!_casetValid || (xa != _caset)) {
+        writeCommand(ILI9341_CASET); // Column addr set
+        spiWrite32(xa);
+        _caset = xa;
+        _casetValid = true;
+    }
+    if (!_pasetValid || (ya != _paset)) {
+        writeCommand(ILI9341_PASET); // Row addr set
+        spiWrite32(ya);
+        _paset = ya;
+        _pasetValid = true;
+    }
 }
 
 /**************************************************************************/
@@ -358,7 +496,8 @@ void Adafruit_ILI9341::setAddrWindow(uint16_t x, uint16_t y, uint16_t w, uint16_
 */
 /**************************************************************************/
 void Adafruit_ILI9341::pushColor(uint16_t color) {
-    spiWrite16(color);
+    STAT_CALL(pushColor);
+    writePixel(color);
 }
 
 /**************************************************************************/
@@ -368,6 +507,11 @@ void Adafruit_ILI9341::pushColor(uint16_t color) {
 */
 /**************************************************************************/
 void Adafruit_ILI9341::writePixel(uint16_t color){
+    STAT_CALL(writePixel);
+    if (_fb) {
+        fbWrite(&color, 1, true);
+        return;
+    }
     spiWrite16(color);
 }
 
@@ -379,6 +523,11 @@ void Adafruit_ILI9341::writePixel(uint16_t color){
 */
 /**************************************************************************/
 void Adafruit_ILI9341::writePixels(uint16_t * colors, uint32_t len){
+    STAT_CALL(writePixels);
+    if (_fb) {
+        fbWrite(colors, len, false);
+        return;
+    }
     spiWritePixels(colors , len);
 }
 
@@ -390,9 +539,12 @@ void Adafruit_ILI9341::writePixels(uint16_t * colors, uint32_t len){
 */
 /**************************************************************************/
 void Adafruit_ILI9341::writeColor(uint16_t color, uint32_t len){
-	for (uint32_t t=0; t<len; t++){
-		writePixel(color);
+    STAT_CALL(writeColor);
+    if (_fb) {
+        fbWrite(&color, len, true);
+        return;
     }
+    spiWriteColor(color, len);
 }
 
 /**************************************************************************/
@@ -404,8 +556,20 @@ void Adafruit_ILI9341::writeColor(uint16_t color, uint32_t len){
 */
 /**************************************************************************/
 void Adafruit_ILI9341::writePixel(int16_t x, int16_t y, uint16_t color) {
+    STAT_CALL(writePixel);
     if((x < 0) ||(x >= _width) || (y < 0) || (y >= _height)) return;
-    setAddrWindow(x,y,1,1);
+    if (_record) {
+        _record->fill(x, y, 1, 1, color);
+        return;
+    }
+    if (_fb) {
+        _fb[(int32_t)y * _width + x] = color;
+        markDirty(x, y, 1, 1);
+        return;
+    }
+    // Open the window to the end of the row so a pixel at x+1 continues
+    // the same RAMWR without any window commands
+    setAddrWindow(x,y,_width - x,1);
     writePixel(color);
 }
 
@@ -420,6 +584,8 @@ void Adafruit_ILI9341::writePixel(int16_t x, int16_t y, uint16_t color) {
 */
 /**************************************************************************/
 void Adafruit_ILI9341::writeFillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color){
+    STAT_CALL(writeFillRect);
+    if((w <= 0) || (h <= 0)) return;
     if((x >= _width) || (y >= _height)) return;
     int16_t x2 = x + w - 1, y2 = y + h - 1;
     if((x2 < 0) || (y2 < 0)) return;
@@ -438,7 +604,21 @@ void Adafruit_ILI9341::writeFillRect(int16_t x, int16_t y, int16_t w, int16_t h,
     if(x2 >= _width)  w = _width  - x;
     if(y2 >= _height) h = _height - y;
 
+    if (_record) {
+        _record->fill(x, y, w, h, color);
+        return;
+    }
     int32_t len = (int32_t)w * h;
+    if (_fb) {
+        for (int16_t row=0; row<h; row++) {
+            uint16_t *p = _fb + (int32_t)(y + row) * _width + x;
+            for (int16_t col=0; col<w; col++) {
+                p[col] = color;
+            }
+        }
+        markDirty(x, y, w, h);
+        return;
+    }
     setAddrWindow(x, y, w, h);
     writeColor(color, len);
 }
@@ -454,6 +634,7 @@ void Adafruit_ILI9341::writeFillRect(int16_t x, int16_t y, int16_t w, int16_t h,
 */
 /**************************************************************************/
 void Adafruit_ILI9341::writeFastVLine(int16_t x, int16_t y, int16_t l, uint16_t color){
+    STAT_CALL(writeFastVLine);
     writeFillRect(x, y, 1, l, color);
 }
 
@@ -468,6 +649,7 @@ void Adafruit_ILI9341::writeFastVLine(int16_t x, int16_t y, int16_t l, uint16_t
 */
 /**************************************************************************/
 void Adafruit_ILI9341::writeFastHLine(int16_t x, int16_t y, int16_t l, uint16_t color){
+    STAT_CALL(writeFastHLine);
     writeFillRect(x, y, l, 1, color);
 }
 
@@ -480,9 +662,11 @@ void Adafruit_ILI9341::writeFastHLine(int16_t x, int16_t y, int16_t l, uint16_t
 */
 /**************************************************************************/
 void Adafruit_ILI9341::drawPixel(int16_t x, int16_t y, uint16_t color){
-    startWrite();
+    API_LOCK();
+    STAT_CALL(drawPixel);
+    startDraw();
     writePixel(x, y, color);
-    endWrite();
+    endDraw();
 }
 
 /**************************************************************************/
@@ -496,9 +680,11 @@ void Adafruit_ILI9341::drawPixel(int16_t x, int16_t y, uint16_t color){
 /**************************************************************************/
 void Adafruit_ILI9341::drawFastVLine(int16_t x, int16_t y,
         int16_t l, uint16_t color) {
-    startWrite();
+    API_LOCK();
+    STAT_CALL(drawFastVLine);
+    startDraw();
     writeFastVLine(x, y, l, color);
-    endWrite();
+    endDraw();
 }
 
 /**************************************************************************/
@@ -512,9 +698,11 @@ void Adafruit_ILI9341::drawFastVLine(int16_t x, int16_t y,
 /**************************************************************************/
 void Adafruit_ILI9341::drawFastHLine(int16_t x, int16_t y,
         int16_t l, uint16_t color) {
-    startWrite();
+    API_LOCK();
+    STAT_CALL(drawFastHLine);
+    startDraw();
     writeFastHLine(x, y, l, color);
-    endWrite();
+    endDraw();
 }
 
 /**************************************************************************/
@@ -529,171 +717,2295 @@ void Adafruit_ILI9341::drawFastHLine(int16_t x, int16_t y,
 /**************************************************************************/
 void Adafruit_ILI9341::fillRect(int16_t x, int16_t y, int16_t w, int16_t h,
         uint16_t color) {
-    startWrite();
+    API_LOCK();
+    STAT_CALL(fillRect);
+    startDraw();
     writeFillRect(x,y,w,h,color);
-    endWrite();
+    endDraw();
 }
 
 /**************************************************************************/
 /*!
-   @brief  Draw RGB rectangle of data from RAM to a location on screen
-   Adapted from https://github.com/PaulStoffregen/ILI9341_t3
-   by Marc MERLIN. See examples/pictureEmbed to use this.
-   5/6/2017: function name and arguments have changed for compatibility
-   with current GFX library and to avoid naming problems in prior
-   implementation.  Formerly drawBitmap() with arguments in different order.
-    @param    x  TFT X location begin
-    @param    y  TFT Y location begin
-    @param    pcolors Pointer to 16-bit color data
-    @param    w  Width of pcolors rectangle
-    @param    h  Height of pcolors rectangle
+   @brief  Queue a horizontal span. Spans with the same columns and color
+           on consecutive rows are joined into one rectangle, so the flat
+           parts of a shape go out as a single address window. Call
+           flushSpans() when the shape is done. DOES NOT set up SPI
+           transaction.
+    @param    x0  First column
+    @param    x1  Last column, inclusive
+    @param    y  Row
+    @param    color 16-bit 5-6-5 Color to fill with
 */
 /**************************************************************************/
-void Adafruit_ILI9341::drawRGBBitmap(int16_t x, int16_t y,
-  uint16_t *pcolors, int16_t w, int16_t h) {
+void Adafruit_ILI9341::writeSpan(int16_t x0, int16_t x1, int16_t y, uint16_t color) {
+    if (_span.h && (_spanColor == color) && (_span.x == x0) &&
+            (_span.w == x1 - x0 + 1) && (_span.y + _span.h == y)) {
+        _span.h++;
+        return;
+    }
+    flushSpans();
+    _span.x = x0;
+    _span.y = y;
+    _span.w = x1 - x0 + 1;
+    _span.h = 1;
+    _spanColor = color;
+}
 
-    int16_t x2, y2; // Lower-right coord
-    if(( x             >= _width ) ||      // Off-edge right
-       ( y             >= _height) ||      // " top
-       ((x2 = (x+w-1)) <  0      ) ||      // " left
-       ((y2 = (y+h-1)) <  0)     ) return; // " bottom
+/**************************************************************************/
+/*!
+   @brief  Draw the spans queued by writeSpan()
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::flushSpans(void) {
+    if (!_span.h) return;
+    writeFillRect(_span.x, _span.y, _span.w, _span.h, _spanColor);
+    _span.h = 0;
+}
 
-    int16_t bx1=0, by1=0, // Clipped top-left within bitmap
-            saveW=w;      // Save original bitmap width value
-    if(x < 0) { // Clip left
-        w  +=  x;
-        bx1 = -x;
-        x   =  0;
+/**************************************************************************/
+/*!
+   @brief  Draw a line, DOES NOT set up SPI transaction. Each run of
+           pixels Bresenham puts on one row (or one column, for steep
+           lines) goes out as one rectangle instead of pixel by pixel.
+    @param    x0  Start column
+    @param    y0  Start row
+    @param    x1  End column
+    @param    y1  End row
+    @param    color 16-bit 5-6-5 Color to draw with
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::writeLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint16_t color) {
+    if (x0 == x1) {
+        writeFillRect(x0, (y0 < y1) ? y0 : y1, 1, abs(y1 - y0) + 1, color);
+        return;
     }
-    if(y < 0) { // Clip top
-        h  +=  y;
-        by1 = -y;
-        y   =  0;
+    if (y0 == y1) {
+        writeFillRect((x0 < x1) ? x0 : x1, y0, abs(x1 - x0) + 1, 1, color);
+        return;
     }
-    if(x2 >= _width ) w = _width  - x; // Clip right
-    if(y2 >= _height) h = _height - y; // Clip bottom
 
-    pcolors += by1 * saveW + bx1; // Offset bitmap ptr to clipped top-left
-    startWrite();
-    setAddrWindow(x, y, w, h); // Clipped area
-    while(h--) { // For each (clipped) scanline...
-      writePixels(pcolors, w); // Push one (clipped) row
-      pcolors += saveW; // Advance pointer by one full (unclipped) line
+    bool steep = abs(y1 - y0) > abs(x1 - x0);
+    if (steep) {
+        std::swap(x0, y0);
+        std::swap(x1, y1);
+    }
+    if (x0 > x1) {
+        std::swap(x0, x1);
+        std::swap(y0, y1);
+    }
+
+    int16_t dx = x1 - x0, dy = abs(y1 - y0);
+    int16_t err = dx / 2, ystep = (y0 < y1) ? 1 : -1;
+    int16_t run = x0;   // First pixel of the current run
+    for (int16_t x=x0; x<=x1; x++) {
+        err -= dy;
+        if ((err < 0) || (x == x1)) { // Run ends here
+            if (steep) {
+                writeFillRect(y0, run, 1, x - run + 1, color);
+            } else {
+                writeFillRect(run, y0, x - run + 1, 1, color);
+            }
+            y0  += ystep;
+            err += dx;
+            run  = x + 1;
+        }
     }
-    endWrite();
 }
 
+/**************************************************************************/
+/*!
+   @brief  Draw a line between two points
+    @param    x0  Start column
+    @param    y0  Start row
+    @param    x1  End column
+    @param    y1  End row
+    @param    color 16-bit 5-6-5 Color to draw with
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::drawLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint16_t color) {
+    API_LOCK();
+    STAT_CALL(drawLine);
+    startDraw();
+    writeLine(x0, y0, x1, y1, color);
+    endDraw();
+}
 
 /**************************************************************************/
 /*!
-   @brief  Read 8 bits of data from ILI9341 configuration memory. NOT from RAM!
-           This is highly undocumented/supported, it's really a hack but kinda works?
-    @param    command  The command register to read data from
-    @param    index  The byte index into the command to read from
-    @return   Unsigned 8-bit data read from ILI9341 register
+   @brief  Find the row offsets d in 0..r for which row yTop - d or row
+           yBot + d is on screen. For a circle or the corners of a rounded
+           rectangle they form one run, at most one screen height long.
+    @param    yTop  Center row of the upper half
+    @param    yBot  Center row of the lower half, at least yTop
+    @param    r  Radius
+    @param    height  Screen height
+    @param    dlo  Set to the first visible offset
+    @param    dhi  Set to the last visible offset
+    @return   False if no row is on screen
 */
 /**************************************************************************/
-uint8_t Adafruit_ILI9341::readcommand8(uint8_t command, uint8_t index) {
-    startWrite();
-    writeCommand(0xD9);  // woo sekret command?
-    spiWrite(0x10 + index);
-    writeCommand(command);
-    uint8_t r = spiRead();
-    endWrite();
-    return r;
+static bool visibleOffsets(int16_t yTop, int16_t yBot, int16_t r, int16_t height,
+        int16_t &dlo, int16_t &dhi) {
+    int32_t lo1 = std::max<int32_t>(0, (int32_t)yTop - height + 1), hi1 = std::min<int32_t>(r, yTop);
+    int32_t lo2 = std::max<int32_t>(0, -(int32_t)yBot), hi2 = std::min<int32_t>(r, (int32_t)height - 1 - yBot);
+    if (lo1 > hi1) { lo1 = lo2; hi1 = hi2; }
+    if (lo2 > hi2) { lo2 = lo1; hi2 = hi1; }
+    if (lo1 > hi1) return false;
+    dlo = std::min(lo1, lo2);
+    dhi = std::min<int32_t>(std::max(hi1, hi2), dlo + ILI9341_TFTHEIGHT);
+    return true;
 }
 
+/**************************************************************************/
+/*!
+   @brief  Widen the extents of one outline row, if it is being kept
+*/
+/**************************************************************************/
+static inline void circlePoint(int16_t *inner, int16_t *outer, int16_t dlo, int16_t dhi,
+        int16_t row, int16_t col) {
+    if ((row < dlo) || (row > dhi)) return;
+    if (col < inner[row - dlo]) inner[row - dlo] = col;
+    if (col > outer[row - dlo]) outer[row - dlo] = col;
+}
 
 /**************************************************************************/
 /*!
-   @brief  Begin SPI transaction, for software or hardware SPI
+   @brief  Rasterize a midpoint circle outline into per-row extents, for
+           rows dlo..dhi below the center. Rows the outline does not touch
+           get inner > outer.
+    @param    r  Radius
+    @param    axes  Include the four points on the axes, which the rounded
+                    rectangle corners leave to the straight edges
+    @param    dlo  First row kept
+    @param    dhi  Last row kept, at most dlo + ILI9341_TFTHEIGHT
+    @param    inner  Set to the first outline column right of the center
+                     on each row, row dlo first
+    @param    outer  Set to the last outline column on the same rows
 */
 /**************************************************************************/
-void Adafruit_ILI9341::startWrite(void){
-    SPI_BEGIN_TRANSACTION();
-    SPI_CS_LOW();
+static void circleExtents(int16_t r, bool axes, int16_t dlo, int16_t dhi,
+        int16_t *inner, int16_t *outer) {
+    for (int16_t d=dlo; d<=dhi; d++) {
+        inner[d - dlo] = r + 1;
+        outer[d - dlo] = -1;
+    }
+    if (axes) {
+        circlePoint(inner, outer, dlo, dhi, r, 0);
+        circlePoint(inner, outer, dlo, dhi, 0, r);
+    }
+    int16_t f = 1 - r, ddx = 1, ddy = -2 * r, x = 0, y = r;
+    while (x < y) {
+        if (f >= 0) {
+            y--;
+            ddy += 2;
+            f   += ddy;
+        }
+        x++;
+        ddx += 2;
+        f   += ddx;
+        circlePoint(inner, outer, dlo, dhi, y, x);
+        circlePoint(inner, outer, dlo, dhi, x, y);
+    }
 }
 
 /**************************************************************************/
 /*!
-   @brief  End SPI transaction, for software or hardware SPI
+   @brief  Draw a circle outline. The left and right halves go out as
+           separate passes so that their steep parts join into vertical
+           runs. Only rows on screen are rasterized.
+    @param    x0  Center column
+    @param    y0  Center row
+    @param    r  Radius
+    @param    color 16-bit 5-6-5 Color to draw with
 */
 /**************************************************************************/
-void Adafruit_ILI9341::endWrite(void){
-    SPI_CS_HIGH();
-    SPI_END_TRANSACTION();
+void Adafruit_ILI9341::drawCircle(int16_t x0, int16_t y0, int16_t r, uint16_t color) {
+    API_LOCK();
+    STAT_CALL(drawCircle);
+    int16_t dlo, dhi;
+    if ((r < 0) || !visibleOffsets(y0, y0, r, _height, dlo, dhi)) return;
+    int16_t inner[ILI9341_TFTHEIGHT + 1], outer[ILI9341_TFTHEIGHT + 1];
+    circleExtents(r, true, dlo, dhi, inner, outer);
+
+    int16_t first = std::max<int32_t>(-r, -(int32_t)y0);      // Rows on screen
+    int16_t last  = std::min<int32_t>(r, (int32_t)_height - 1 - y0);
+    startDraw();
+    for (int16_t dy=first; dy<=last; dy++) { // Left half, and rows crossing the center
+        int16_t d = abs(dy) - dlo;
+        writeSpan(x0 - outer[d], inner[d] ? x0 - inner[d] : x0 + outer[d], y0 + dy, color);
+    }
+    for (int16_t dy=first; dy<=last; dy++) { // Right half
+        int16_t d = abs(dy) - dlo;
+        if (inner[d]) writeSpan(x0 + inner[d], x0 + outer[d], y0 + dy, color);
+    }
+    flushSpans();
+    endDraw();
 }
 
 /**************************************************************************/
 /*!
-   @brief  Write 8-bit data to command/register (DataCommand line low).
-   Does not set up SPI transaction.
-   @param  cmd The command/register to transmit
+   @brief  Draw a filled circle, one span per row on screen
+    @param    x0  Center column
+    @param    y0  Center row
+    @param    r  Radius
+    @param    color 16-bit 5-6-5 Color to fill with
 */
 /**************************************************************************/
-void Adafruit_ILI9341::writeCommand(uint8_t cmd){
-    DC_LOW();
-    spiWrite(cmd);
-    DC_HIGH();
+void Adafruit_ILI9341::fillCircle(int16_t x0, int16_t y0, int16_t r, uint16_t color) {
+    API_LOCK();
+    STAT_CALL(fillCircle);
+    int16_t dlo, dhi;
+    if ((r < 0) || !visibleOffsets(y0, y0, r, _height, dlo, dhi)) return;
+    int16_t inner[ILI9341_TFTHEIGHT + 1], outer[ILI9341_TFTHEIGHT + 1];
+    circleExtents(r, true, dlo, dhi, inner, outer);
+
+    int16_t first = std::max<int32_t>(-r, -(int32_t)y0);
+    int16_t last  = std::min<int32_t>(r, (int32_t)_height - 1 - y0);
+    startDraw();
+    for (int16_t dy=first; dy<=last; dy++) {
+        int16_t d = abs(dy) - dlo;
+        writeSpan(x0 - outer[d], x0 + outer[d], y0 + dy, color);
+    }
+    flushSpans();
+    endDraw();
 }
 
 /**************************************************************************/
 /*!
-   @brief  Read 8-bit data via SPI. 
-   @returns One byte of data from SPI
+   @brief  Draw a rectangle outline with rounded corners
+    @param    x  Left column
+    @param    y  Top row
+    @param    w  Width
+    @param    h  Height
+    @param    r  Corner radius, at most half the shorter side
+    @param    color 16-bit 5-6-5 Color to draw with
 */
 /**************************************************************************/
-uint8_t Adafruit_ILI9341::spiRead() {
-    return bcm2835_spi_transfer(0);
+void Adafruit_ILI9341::drawRoundRect(int16_t x, int16_t y, int16_t w, int16_t h,
+        int16_t r, uint16_t color) {
+    API_LOCK();
+    STAT_CALL(drawRoundRect);
+    if ((w <= 0) || (h <= 0)) return;
+    int16_t max = ((w < h) ? w : h) / 2;
+    if (r > max) r = max;
+    if (r < 0)   r = 0;
+
+    int16_t xl = x + r, xr = x + w - 1 - r;     // Corner centers
+    int16_t yt = y + r, yb = y + h - 1 - r;
+    startDraw();
+    writeFillRect(xl, y, w - 2 * r, 1, color);          // Edges
+    writeFillRect(xl, y + h - 1, w - 2 * r, 1, color);
+    writeFillRect(x, yt, 1, h - 2 * r, color);
+    writeFillRect(x + w - 1, yt, 1, h - 2 * r, color);
+    int16_t dlo, dhi;
+    if (visibleOffsets(yt, yb, r, _height, dlo, dhi)) { // Corners
+        int16_t inner[ILI9341_TFTHEIGHT + 1], outer[ILI9341_TFTHEIGHT + 1];
+        circleExtents(r, false, dlo, dhi, inner, outer);
+        for (int16_t d=dlo; d<=dhi; d++) {
+            int16_t len = outer[d - dlo] - inner[d - dlo] + 1;
+            if (len <= 0) continue;
+            writeFillRect(xl - outer[d - dlo], yt - d, len, 1, color);
+            writeFillRect(xr + inner[d - dlo], yt - d, len, 1, color);
+            writeFillRect(xl - outer[d - dlo], yb + d, len, 1, color);
+            writeFillRect(xr + inner[d - dlo], yb + d, len, 1, color);
+        }
+    }
+    endDraw();
 }
 
 /**************************************************************************/
 /*!
-   @brief  Write 8-bit data via SPI. 
-   @param  b Byte of data to write over SPI
+   @brief  Draw a filled rectangle with rounded corners, one span per
+           corner row and a single rectangle between the corners
+    @param    x  Left column
+    @param    y  Top row
+    @param    w  Width
+    @param    h  Height
+    @param    r  Corner radius, at most half the shorter side
+    @param    color 16-bit 5-6-5 Color to fill with
 */
 /**************************************************************************/
-void Adafruit_ILI9341::spiWrite(uint8_t b) {
-    bcm2835_spi_transfer(b);
+void Adafruit_ILI9341::fillRoundRect(int16_t x, int16_t y, int16_t w, int16_t h,
+        int16_t r, uint16_t color) {
+    API_LOCK();
+    STAT_CALL(fillRoundRect);
+    if ((w <= 0) || (h <= 0)) return;
+    int16_t max = ((w < h) ? w : h) / 2;
+    if (r > max) r = max;
+    if (r < 0)   r = 0;
+
+    int16_t xl = x + r, xr = x + w - 1 - r;     // Corner centers
+    int16_t yt = y + r, yb = y + h - 1 - r;
+    int16_t dlo = 1, dhi = 0, inner[ILI9341_TFTHEIGHT + 1], outer[ILI9341_TFTHEIGHT + 1];
+    if (visibleOffsets(yt, yb, r, _height, dlo, dhi)) {
+        circleExtents(r, true, dlo, dhi, inner, outer);
+    }
+    int16_t first = (dlo < 1) ? 1 : dlo; // Row 0 of the corners is part of the middle
+    startDraw();
+    for (int16_t d=dhi; d>=first; d--) {
+        writeSpan(xl - outer[d - dlo], xr + outer[d - dlo], yt - d, color);
+    }
+    for (int16_t row=std::max<int16_t>(yt, 0); row<=std::min<int16_t>(yb, _height - 1); row++) {
+        writeSpan(x, x + w - 1, row, color);
+    }
+    for (int16_t d=first; d<=dhi; d++) {
+        writeSpan(xl - outer[d - dlo], xr + outer[d - dlo], yb + d, color);
+    }
+    flushSpans();
+    endDraw();
 }
 
 /**************************************************************************/
 /*!
-   @brief  Write 16-bit data via SPI. 
-   @param  s Half word of data to write over SPI
+   @brief  Draw a triangle outline
+    @param    x0  First corner column
+    @param    y0  First corner row
+    @param    x1  Second corner column
+    @param    y1  Second corner row
+    @param    x2  Third corner column
+    @param    y2  Third corner row
+    @param    color 16-bit 5-6-5 Color to draw with
 */
 /**************************************************************************/
-void Adafruit_ILI9341::spiWrite16(uint16_t s) {
-    uint8_t bytes[2];
-    bytes[0] = s >> 8;
-    bytes[1] = s;
-    bcm2835_spi_transfern((char*)bytes,2);
+void Adafruit_ILI9341::drawTriangle(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
+        int16_t x2, int16_t y2, uint16_t color) {
+    API_LOCK();
+    STAT_CALL(drawTriangle);
+    startDraw();
+    writeLine(x0, y0, x1, y1, color);
+    writeLine(x1, y1, x2, y2, color);
+    writeLine(x2, y2, x0, y0, color);
+    endDraw();
 }
 
 /**************************************************************************/
 /*!
-   @brief  Write 32-bit data via SPI. 
-   @param  w Word of data to write over SPI
+   @brief  Draw a filled triangle, one span per row. Covers the same
+           pixels as Adafruit_GFX::fillTriangle().
+    @param    x0  First corner column
+    @param    y0  First corner row
+    @param    x1  Second corner column
+    @param    y1  Second corner row
+    @param    x2  Third corner column
+    @param    y2  Third corner row
+    @param    color 16-bit 5-6-5 Color to fill with
 */
 /**************************************************************************/
-void Adafruit_ILI9341::spiWrite32(uint32_t w) {
-    uint8_t bytes[4];
-    bytes[0] = w >> 24;
-    bytes[1] = w >> 16;
-    bytes[2] = w >> 8;
-    bytes[3] = w;
-    bcm2835_spi_transfern((char*)bytes,4);
+void Adafruit_ILI9341::fillTriangle(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
+        int16_t x2, int16_t y2, uint16_t color) {
+    API_LOCK();
+    STAT_CALL(fillTriangle);
+
+    // Sort corners by row (y2 >= y1 >= y0)
+    if (y0 > y1) { std::swap(y0, y1); std::swap(x0, x1); }
+    if (y1 > y2) { std::swap(y2, y1); std::swap(x2, x1); }
+    if (y0 > y1) { std::swap(y0, y1); std::swap(x0, x1); }
+
+    startDraw();
+    if (y0 == y2) { // All on one row
+        int16_t a = x0, b = x0;
+        if (x1 < a) a = x1; else if (x1 > b) b = x1;
+        if (x2 < a) a = x2; else if (x2 > b) b = x2;
+        writeFillRect(a, y0, b - a + 1, 1, color);
+        endDraw();
+        return;
+    }
+
+    int16_t dx01 = x1 - x0, dy01 = y1 - y0, dx02 = x2 - x0, dy02 = y2 - y0,
+            dx12 = x2 - x1, dy12 = y2 - y1;
+    int32_t sa = 0, sb = 0;
+
+    // Upper part, from y0 to y1 (skipping y1 when the lower part draws it)
+    int16_t y, last = (y1 == y2) ? y1 : y1 - 1;
+    for (y=y0; y<=last; y++) {
+        int16_t a = x0 + sa / dy01, b = x0 + sb / dy02;
+        sa += dx01;
+        sb += dx02;
+        if (a > b) std::swap(a, b);
+        writeSpan(a, b, y, color);
+    }
+
+    // Lower part, from y1 to y2
+    sa = (int32_t)dx12 * (y - y1);
+    sb = (int32_t)dx02 * (y - y0);
+    for (; y<=y2; y++) {
+        int16_t a = x1 + sa / dy12, b = x0 + sb / dy02;
+        sa += dx12;
+        sb += dx02;
+        if (a > b) std::swap(a, b);
+        writeSpan(a, b, y, color);
+    }
+    flushSpans();
+    endDraw();
 }
 
 /**************************************************************************/
 /*!
-   @brief  Write a buffer of color values via SPI
-   @param  c Buffer of color values
-   @param  l Length of the buffer
+   @brief  Draw a closed polygon outline
+    @param    pts  Corners in drawing order
+    @param    n  Number of corners
+    @param    color 16-bit 5-6-5 Color to draw with
 */
 /**************************************************************************/
-void Adafruit_ILI9341::spiWritePixels(uint16_t *c, uint32_t l) {
-	for (uint32_t i=0; i<l; i++) {
-		spiWrite16(c[i]);	
-	}
+void Adafruit_ILI9341::drawPolygon(const ILI9341_Point *pts, uint16_t n, uint16_t color) {
+    API_LOCK();
+    STAT_CALL(drawPolygon);
+    if (!n) return;
+    startDraw();
+    for (uint16_t i=0; i<n; i++) {
+        const ILI9341_Point &a = pts[i], &b = pts[(i + 1) % n];
+        writeLine(a.x, a.y, b.x, b.y, color);
+    }
+    endDraw();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Draw a filled polygon with the even-odd rule. Each row is cut
+           by the polygon edges into spans, which go out as rectangles.
+           Works for concave and self-intersecting polygons.
+    @param    pts  Corners in drawing order
+    @param    n  Number of corners
+    @param    color 16-bit 5-6-5 Color to fill with
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::fillPolygon(const ILI9341_Point *pts, uint16_t n, uint16_t color) {
+    API_LOCK();
+    STAT_CALL(fillPolygon);
+    if (n < 3) return;
+    int16_t ymin = pts[0].y, ymax = pts[0].y;
+    for (uint16_t i=1; i<n; i++) {
+        if (pts[i].y < ymin) ymin = pts[i].y;
+        if (pts[i].y > ymax) ymax = pts[i].y;
+    }
+    int16_t top = (ymin < 0) ? 0 : ymin, bottom = (ymax >= _height) ? _height - 1 : ymax;
+
+    if (n > _polyXSize) { // A row crosses at most n edges
+        int16_t *xs = (int16_t *)realloc(_polyX, n * sizeof(int16_t));
+        if (!xs) {
+            printf("Polygon buffer allocation failed\n");
+            return;
+        }
+        _polyX     = xs;
+        _polyXSize = n;
+    }
+
+    startDraw();
+    for (int16_t y=top; y<=bottom; y++) {
+        uint16_t count = 0;
+        for (uint16_t i=0; i<n; i++) {
+            const ILI9341_Point *a = &pts[i], *b = &pts[(i + 1) % n];
+            if (a->y == b->y) continue; // Rows of flat edges come from their neighbours
+            if (a->y > b->y) std::swap(a, b);
+            // Edges own their top row but not their bottom one, except on the last row
+            if ((y < a->y) || (y > b->y) || ((y == b->y) && (y != ymax))) continue;
+            _polyX[count++] = a->x + (int32_t)(y - a->y) * (b->x - a->x) / (b->y - a->y);
+        }
+        std::sort(_polyX, _polyX + count);
+        for (uint16_t k=0; k+1<count; k+=2) {
+            writeSpan(_polyX[k], _polyX[k + 1], y, color);
+        }
+    }
+    flushSpans();
+    endDraw();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Draw RGB rectangle of data from RAM to a location on screen
+   Adapted from https://github.com/PaulStoffregen/ILI9341_t3
+   by Marc MERLIN. See examples/pictureEmbed to use this.
+   5/6/2017: function name and arguments have changed for compatibility
+   with current GFX library and to avoid naming problems in prior
+   implementation.  Formerly drawBitmap() with arguments in different order.
+    @param    x  TFT X location begin
+    @param    y  TFT Y location begin
+    @param    pcolors Pointer to 16-bit color data
+    @param    w  Width of pcolors rectangle
+    @param    h  Height of pcolors rectangle
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::drawRGBBitmap(int16_t x, int16_t y,
+  uint16_t *pcolors, int16_t w, int16_t h) {
+    API_LOCK();
+    STAT_CALL(drawRGBBitmap);
+
+    if (_frameDiff && !_record && !x && !y && (w == _width) && (h == _height)) {
+        drawFrame(pcolors);
+        return;
+    }
+
+    int16_t bx1, by1,     // Clipped top-left within bitmap
+            saveW=w;      // Save original bitmap width value
+    if(!clipBitmap(x, y, w, h, bx1, by1)) return;
+
+    pcolors += by1 * saveW + bx1; // Offset bitmap ptr to clipped top-left
+    if (_record) {
+        _record->bitmap(x, y, w, h, pcolors, saveW);
+        return;
+    }
+    startWrite();
+    blitRect(pcolors, saveW, x, y, w, h);
+    endWrite();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Copy an already clipped rectangle of RGB565 pixels to the screen
+           or framebuffer. DOES NOT set up SPI transaction.
+    @param    src  Top-left pixel of the rectangle
+    @param    stride  Pixels between the starts of two rows of src
+    @param    x  TFT X location begin
+    @param    y  TFT Y location begin
+    @param    w  Width of rectangle
+    @param    h  Height of rectangle
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::blitRect(const uint16_t *src, int32_t stride,
+        int16_t x, int16_t y, int16_t w, int16_t h) {
+    setAddrWindow(x, y, w, h); // Clipped area
+    if(!_fb) { // Pack clipped rows straight into bulk transfers
+        spiWriteRect(src, w, h, stride);
+        return;
+    }
+    while(h--) { // For each (clipped) scanline...
+      fbWrite(src, w, false); // Push one (clipped) row
+      src += stride; // Advance pointer by one full (unclipped) line
+    }
+}
+
+/**************************************************************************/
+/*!
+   @brief  Draw a 24/32-bit or grayscale image, converting it to RGB565 on
+           the way out. Rows are converted straight into the transfer buffer
+           with the SIMD kernels in color_convert.h, so no intermediate
+           RGB565 copy of the image is needed.
+    @param    x  TFT X location begin
+    @param    y  TFT Y location begin
+    @param    src  Pointer to the source pixels, rows packed without padding
+    @param    fmt  Source pixel format
+    @param    w  Width of src rectangle
+    @param    h  Height of src rectangle
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::drawRGBBitmap(int16_t x, int16_t y, const uint8_t *src,
+  ILI9341_PixelFormat fmt, int16_t w, int16_t h) {
+    API_LOCK();
+    STAT_CALL(drawRGBBitmap);
+
+    int16_t bx1, by1, saveW=w;
+    if(!clipBitmap(x, y, w, h, bx1, by1)) return;
+
+    uint8_t bpp = ILI9341_bytesPerPixel(fmt);
+    src += ((int32_t)by1 * saveW + bx1) * bpp;
+    startWrite();
+    setAddrWindow(x, y, w, h);
+
+    ILI9341_PoolBuffer buf(_pool);
+    uint8_t *p   = buf.data();
+    uint8_t *end = buf.data() + buf.size();
+    while(h--) {
+        const uint8_t *s = src;
+        uint32_t left = w;
+        while (left) {
+            uint32_t n = (end - p) / 2;
+            if (n > left) n = left;
+            ILI9341_convert(fmt, s, p, n);
+            p    += n * 2;
+            s    += n * bpp;
+            left -= n;
+            if (p == end) {
+                writeWire(buf.data(), p - buf.data());
+                p = buf.data();
+            }
+        }
+        src += (int32_t)saveW * bpp;
+    }
+    if (p != buf.data()) {
+        writeWire(buf.data(), p - buf.data());
+    }
+    endWrite();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Start recording into a display list. Until endRecording(),
+           rectangles, lines, pixels and RGB565 bitmaps are clipped and
+           appended to the list instead of being drawn; other calls still
+           draw immediately. Bitmaps are recorded by pointer.
+    @param    list  List to append to, usually cleared first
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::beginRecording(ILI9341_DisplayList *list) {
+    API_LOCK();
+    _record = list;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Stop recording, later calls draw again
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::endRecording(void) {
+    API_LOCK();
+    _record = NULL;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Replay a display list in one transaction. Run
+           ILI9341_DisplayList::optimize() on it first to cut overdraw and
+           window changes. Operations are clipped again in case the
+           rotation changed since recording.
+    @param    list  Recorded operations
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::drawList(const ILI9341_DisplayList &list) {
+    API_LOCK();
+    STAT_CALL(drawList);
+    ILI9341_DisplayList *record = _record;
+    _record = NULL; // Replaying into the list being recorded would never end
+    startWrite();
+    for (uint32_t i=0; i<list.size(); i++) {
+        const ILI9341_DisplayOp &op = list[i];
+        if (op.kind == ILI9341_DL_FILL) {
+            writeFillRect(op.x, op.y, op.w, op.h, op.color);
+            continue;
+        }
+        int16_t x = op.x, y = op.y, w = op.w, h = op.h, bx, by;
+        if (!clipBitmap(x, y, w, h, bx, by)) continue;
+        blitRect(op.pixels + (int32_t)by * op.stride + bx, op.stride, x, y, w, h);
+    }
+    endWrite();
+    _record = record;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Draw an image whose pixels are already in wire order (big endian
+           RGB565), such as an ILI9341_Asset mapping. Rows are handed to the
+           transport straight from src with no byte swap or copy; an
+           unclipped image goes out as a single bulk write.
+    @param    x  TFT X location begin
+    @param    y  TFT Y location begin
+    @param    wire  Wire-order pixel bytes, 2 * w per row
+    @param    w  Width of wire rectangle
+    @param    h  Height of wire rectangle
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::drawWireBitmap(int16_t x, int16_t y, const uint8_t *wire,
+  int16_t w, int16_t h) {
+    API_LOCK();
+    STAT_CALL(drawWireBitmap);
+
+    int16_t bx1, by1, saveW=w;
+    if(!clipBitmap(x, y, w, h, bx1, by1)) return;
+
+    wire += ((int32_t)by1 * saveW + bx1) * 2;
+    startWrite();
+    setAddrWindow(x, y, w, h);
+    if (_fb) { // Byte swap into the framebuffer through the staging buffer
+        ILI9341_PoolBuffer buf(_pool);
+        while(h--) {
+            const uint8_t *s = wire;
+            uint32_t left = (uint32_t)w * 2;
+            while (left) {
+                uint32_t n = (left > buf.size()) ? buf.size() : left;
+                memcpy(buf.data(), s, n);
+                writeWire(buf.data(), n);
+                s    += n;
+                left -= n;
+            }
+            wire += (int32_t)saveW * 2;
+        }
+    } else if (w == saveW) { // Rows are contiguous
+        busWrite(wire, (uint32_t)w * h * 2);
+        _ramwrPos += (uint32_t)w * h;
+    } else {
+        while(h--) {
+            busWrite(wire, (uint32_t)w * 2);
+            _ramwrPos += w;
+            wire += (int32_t)saveW * 2;
+        }
+    }
+    endWrite();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Draw a packed image, such as an ILI9341_PackedAsset mapping. The
+           opcodes are decoded row by row straight into a transfer buffer;
+           clipped pixels are skipped without being produced, and decoding
+           stops after the last visible row.
+    @param    x  TFT X location begin
+    @param    y  TFT Y location begin
+    @param    data  Opcodes in the packed asset format, see asset.h
+    @param    len  Number of opcode bytes
+    @param    w  Width of the image
+    @param    h  Height of the image
+    @return   False if the data ends before the last visible pixel. Rows
+              decoded up to that point have been drawn.
+*/
+/**************************************************************************/
+bool Adafruit_ILI9341::drawPackedBitmap(int16_t x, int16_t y, const uint8_t *data,
+  uint32_t len, int16_t w, int16_t h) {
+    API_LOCK();
+    STAT_CALL(drawPackedBitmap);
+
+    int16_t bx1, by1, saveW=w;
+    if(!clipBitmap(x, y, w, h, bx1, by1)) return true;
+
+    ILI9341_AssetDecoder dec(data, len);
+    if (!dec.skip((uint32_t)by1 * saveW + bx1)) return false;
+    bool ok = true;
+    startWrite();
+    setAddrWindow(x, y, w, h);
+
+    ILI9341_PoolBuffer buf(_pool);
+    uint8_t *p   = buf.data();
+    uint8_t *end = buf.data() + buf.size();
+    while(ok && h--) {
+        uint32_t left = w;
+        while (left) {
+            uint32_t n = (end - p) / 2;
+            if (n > left) n = left;
+            if (!(ok = dec.decode(p, n))) break;
+            p    += n * 2;
+            left -= n;
+            if (p == end) {
+                writeWire(buf.data(), p - buf.data());
+                p = buf.data();
+            }
+        }
+        if (ok && h) { // Right edge of this row and left edge of the next
+            ok = dec.skip(saveW - w);
+        }
+    }
+    if (p != buf.data()) {
+        writeWire(buf.data(), p - buf.data());
+    }
+    endWrite();
+    return ok;
+}
+
+// Kernels blendArea() runs on each row
+enum { BLEND_FILL, BLEND_MASK, BLEND_RGBA };
+
+static void blendRow(uint8_t mode, uint16_t *pixels, int16_t w, uint16_t color,
+        uint8_t alpha, const uint8_t *src) {
+    switch (mode) {
+        case BLEND_FILL: ILI9341_blendFill(pixels, color, alpha, w); break;
+        case BLEND_MASK: ILI9341_blendMask(pixels, color, src, w);   break;
+        default:         ILI9341_blendRGBA(pixels, src, w);          break;
+    }
+}
+
+/**************************************************************************/
+/*!
+   @brief  Blend a clipped rectangle in place. Works on the shadow
+           framebuffer; without one the area is read back from the panel,
+           blended and written out again a pool buffer of rows at a time.
+    @param    x  Left column
+    @param    y  Top row
+    @param    w  Width
+    @param    h  Height
+    @param    mode  BLEND_FILL, BLEND_MASK or BLEND_RGBA
+    @param    color 16-bit 5-6-5 Color to blend in, unused for BLEND_RGBA
+    @param    alpha  Opacity of color for BLEND_FILL
+    @param    src  Mask or RGBA bytes for the top row, NULL for BLEND_FILL
+    @param    srcStride  Bytes from one src row to the next
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::blendArea(int16_t x, int16_t y, int16_t w, int16_t h, uint8_t mode,
+        uint16_t color, uint8_t alpha, const uint8_t *src, int32_t srcStride) {
+    if (_fb) {
+        for (int16_t row=0; row<h; row++) {
+            blendRow(mode, _fb + (int32_t)(y + row) * _width + x, w, color, alpha,
+                     src + row * srcStride);
+        }
+        markDirty(x, y, w, h);
+        return;
+    }
+
+    // Whole rows per chunk, as many as fit in a pool buffer
+    ILI9341_PoolBuffer buf(_pool);
+    uint16_t *chunk = (uint16_t *)buf.data();
+    int16_t rows = buf.size() / (w * sizeof(uint16_t));
+    for (int16_t row=0; row<h; row+=rows) {
+        int16_t n = (h - row < rows) ? h - row : rows;
+        readRect(x, y + row, w, n, chunk);
+        for (int16_t r=0; r<n; r++) {
+            blendRow(mode, chunk + (int32_t)r * w, w, color, alpha,
+                     src + (row + r) * srcStride);
+        }
+        startWrite();
+        blitRect(chunk, w, x, y + row, w, n);
+        endWrite();
+    }
+}
+
+/**************************************************************************/
+/*!
+   @brief  Blend a color over a rectangle with constant alpha, e.g. for a
+           translucent banner. Works on the shadow framebuffer; without
+           one the area is read back from the panel first.
+    @param    x  TFT X location begin
+    @param    y  TFT Y location begin
+    @param    w  Width of rectangle
+    @param    h  Height of rectangle
+    @param    color 16-bit 5-6-5 Color to blend in
+    @param    alpha  Opacity of color, 0..255
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::blendRect(int16_t x, int16_t y, int16_t w, int16_t h,
+        uint16_t color, uint8_t alpha) {
+    API_LOCK();
+    STAT_CALL(blendRect);
+    int16_t bx, by;
+    if (!alpha || !clipBitmap(x, y, w, h, bx, by)) return;
+
+    blendArea(x, y, w, h, BLEND_FILL, color, alpha, NULL, 0);
+}
+
+/**************************************************************************/
+/*!
+   @brief  Blend a color through an 8-bit coverage mask, e.g. for an
+           anti-aliased glyph. Works on the shadow framebuffer; without
+           one the area is read back from the panel first.
+    @param    x  TFT X location of the mask's top-left
+    @param    y  TFT Y location of the mask's top-left
+    @param    mask  Opacity of color per pixel, rows packed without padding
+    @param    w  Width of mask
+    @param    h  Height of mask
+    @param    color 16-bit 5-6-5 Color to blend in
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::blendMask(int16_t x, int16_t y, const uint8_t *mask,
+        int16_t w, int16_t h, uint16_t color) {
+    API_LOCK();
+    STAT_CALL(blendMask);
+    int16_t bx, by, saveW = w;
+    if (!clipBitmap(x, y, w, h, bx, by)) return;
+    mask += (int32_t)by * saveW + bx;
+
+    blendArea(x, y, w, h, BLEND_MASK, color, 0, mask, saveW);
+}
+
+/**************************************************************************/
+/*!
+   @brief  Composite an RGBA8888 image over the screen. Works on the shadow
+           framebuffer; without one the area is read back from the panel
+           first.
+    @param    x  TFT X location of the image's top-left
+    @param    y  TFT Y location of the image's top-left
+    @param    rgba  R G B A bytes, not premultiplied, rows packed without padding
+    @param    w  Width of image
+    @param    h  Height of image
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::blendRGBA(int16_t x, int16_t y, const uint8_t *rgba,
+        int16_t w, int16_t h) {
+    API_LOCK();
+    STAT_CALL(blendRGBA);
+    int16_t bx, by, saveW = w;
+    if (!clipBitmap(x, y, w, h, bx, by)) return;
+    rgba += ((int32_t)by * saveW + bx) * 4;
+
+    blendArea(x, y, w, h, BLEND_RGBA, 0, 0, rgba, (int32_t)saveW * 4);
+}
+
+/**************************************************************************/
+/*!
+   @brief  Turn full-frame differencing on or off. While it is on,
+           drawFrame() and full-screen drawRGBBitmap() calls only send the
+           tiles that changed since the previous frame. Anything drawn
+           by other calls in between is not seen by the diff, so call
+           this again to force a full frame after mixing the two.
+    @param    enable  True to diff full frames
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::enableFrameDiff(bool enable) {
+    API_LOCK();
+    _frameDiff     = enable;
+    _tileHashValid = false; // First frame after enabling is sent in full
+}
+
+/**************************************************************************/
+/*!
+   @brief  Hash one tile of a frame
+    @param    p  Top-left pixel of the tile
+    @param    stride  Pixels per frame row
+    @param    w  Tile width
+    @param    h  Tile height
+    @return   64-bit hash of the tile pixels
+*/
+/**************************************************************************/
+static uint64_t tileHash(const uint16_t *p, int32_t stride, int16_t w, int16_t h) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int16_t row=0; row<h; row++, p+=stride) {
+        int16_t i = 0;
+        for (; i + 4 <= w; i += 4) { // Four pixels per step
+            uint64_t v;
+            memcpy(&v, p + i, sizeof(v));
+            hash = (hash ^ v) * 0x100000001b3ULL;
+            hash ^= hash >> 29;
+        }
+        for (; i < w; i++) {
+            hash = (hash ^ p[i]) * 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Draw a complete _width x _height frame. With frame differencing
+           on, the frame is split into ILI9341_TILE_SIZE tiles, each tile is
+           hashed against the previous frame, and only changed tiles are
+           sent. Changed tiles next to each other in a row are merged, and
+           identical runs on consecutive tile rows are merged into one
+           address window.
+    @param    frame  Pixels, _width per row, _height rows
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::drawFrame(const uint16_t *frame) {
+    API_LOCK();
+    STAT_CALL(drawFrame);
+    startWrite();
+    if (!_frameDiff) {
+        blitRect(frame, _width, 0, 0, _width, _height);
+        endWrite();
+        return;
+    }
+
+    int16_t cols = (_width  + ILI9341_TILE_SIZE - 1) / ILI9341_TILE_SIZE;
+    int16_t rows = (_height + ILI9341_TILE_SIZE - 1) / ILI9341_TILE_SIZE;
+
+    // Runs of changed tiles on the previous tile row, still open for merging
+    struct Run { int16_t c0, c1, r0; };
+    Run open[ILI9341_TFTHEIGHT / ILI9341_TILE_SIZE + 1], next[ILI9341_TFTHEIGHT / ILI9341_TILE_SIZE + 1];
+    int nopen = 0;
+
+    for (int16_t tr=0; tr<=rows; tr++) {
+        int nnext = 0;
+        if (tr < rows) {
+            int16_t ty = tr * ILI9341_TILE_SIZE;
+            int16_t th = (ty + ILI9341_TILE_SIZE > _height) ? _height - ty : ILI9341_TILE_SIZE;
+            int16_t runStart = -1;
+            for (int16_t tc=0; tc<=cols; tc++) {
+                bool changed = false;
+                if (tc < cols) {
+                    int16_t tx = tc * ILI9341_TILE_SIZE;
+                    int16_t tw = (tx + ILI9341_TILE_SIZE > _width) ? _width - tx : ILI9341_TILE_SIZE;
+                    uint64_t hash = tileHash(frame + (int32_t)ty * _width + tx, _width, tw, th);
+                    uint64_t &old = _tileHash[tr * cols + tc];
+                    changed = !_tileHashValid || (hash != old);
+                    old = hash;
+                }
+                if (changed && runStart < 0) {
+                    runStart = tc;
+                } else if (!changed && runStart >= 0) {
+                    next[nnext].c0 = runStart;
+                    next[nnext].c1 = tc - 1;
+                    next[nnext].r0 = tr;
+                    nnext++;
+                    runStart = -1;
+                }
+            }
+        }
+
+        // Runs that continue with the same columns stay open, the rest go out
+        for (int i=0; i<nopen; i++) {
+            bool continued = false;
+            for (int j=0; j<nnext; j++) {
+                if ((next[j].c0 == open[i].c0) && (next[j].c1 == open[i].c1)) {
+                    next[j].r0 = open[i].r0;
+                    continued = true;
+                    break;
+                }
+            }
+            if (continued) continue;
+            int16_t x = open[i].c0 * ILI9341_TILE_SIZE;
+            int16_t y = open[i].r0 * ILI9341_TILE_SIZE;
+            int16_t x2 = (open[i].c1 + 1) * ILI9341_TILE_SIZE;
+            int16_t y2 = tr * ILI9341_TILE_SIZE;
+            if (x2 > _width)  x2 = _width;
+            if (y2 > _height) y2 = _height;
+            blitRect(frame + (int32_t)y * _width + x, _width, x, y, x2 - x, y2 - y);
+        }
+        memcpy(open, next, nnext * sizeof(Run));
+        nopen = nnext;
+    }
+    _tileHashValid = true;
+    endWrite();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Select the font used by drawText()
+    @param    font  Font to use, or NULL for ILI9341_Font5x7
+    @return   False if the font cells do not fit ILI9341_FONT_MAX_WIDTH x
+              ILI9341_FONT_MAX_HEIGHT; the current font is kept then
+*/
+/**************************************************************************/
+bool Adafruit_ILI9341::setFont(const ILI9341_Font *font) {
+    API_LOCK();
+    if (!font) font = &ILI9341_Font5x7;
+    if ((font->width + font->spacing > ILI9341_FONT_MAX_WIDTH) ||
+        (font->height > ILI9341_FONT_MAX_HEIGHT) ||
+        (font->width + font->spacing == 0) || (font->height == 0)) {
+        printf("Font cell too large\n");
+        return false;
+    }
+    _font = font;
+    return true;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Width of a string as drawText() would draw it
+    @param    str  Text
+    @param    size  Scale factor
+    @return   Width in pixels
+*/
+/**************************************************************************/
+int16_t Adafruit_ILI9341::textWidth(const char *str, uint8_t size) const {
+    return strlen(str) * (_font->width + _font->spacing) * size;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Find a glyph in the cache, rasterizing it on a miss. The cache is
+           direct mapped, so the slot returned stays valid only until the
+           next lookup.
+    @param    ch  Character
+    @param    fg  Foreground color
+    @param    bg  Background color
+    @return   Cache slot holding the glyph
+*/
+/**************************************************************************/
+ILI9341_Glyph *Adafruit_ILI9341::glyph(uint8_t ch, uint16_t fg, uint16_t bg) {
+    uint32_t key = (ch * 0x9E3779B1u) ^ (fg * 0x85EBCA77u) ^ (bg * 0xC2B2AE3Du);
+    ILI9341_Glyph *g = &_glyphs[(key >> 16) % ILI9341_GLYPH_CACHE];
+    if ((g->font == _font) && (g->ch == ch) && (g->fg == fg) && (g->bg == bg)) {
+        STAT_ADD(glyphHits, 1);
+        return g;
+    }
+    STAT_ADD(glyphMisses, 1);
+
+    g->font = _font;
+    g->ch   = ch;
+    g->fg   = fg;
+    g->bg   = bg;
+
+    uint8_t cw = _font->width + _font->spacing;
+    bool    known = (ch >= _font->first) && (ch <= _font->last);
+    const uint8_t *columns = _font->columns + (ch - _font->first) * _font->width;
+    for (uint8_t c=0; c<cw; c++) {
+        uint8_t bits = (known && (c < _font->width)) ? columns[c] : 0; // Unknown characters draw blank
+        for (uint8_t r=0; r<_font->height; r++) {
+            uint16_t color = ((bits >> r) & 1) ? fg : bg;
+            uint8_t *p = g->pixels + (r * cw + c) * 2;
+            p[0] = color >> 8;
+            p[1] = color;
+        }
+    }
+    return g;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Draw a line of text with solid background. The visible part of
+           the whole string goes out as one address window and one pixel
+           stream, built from glyphs cached per foreground/background pair.
+    @param    x  TFT X location of the top-left of the first character
+    @param    y  TFT Y location of the top-left of the first character
+    @param    str  Text, drawn on one line
+    @param    fg  Text color
+    @param    bg  Background color
+    @param    size  Scale factor, 1 for the font's native size
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::drawText(int16_t x, int16_t y, const char *str,
+  uint16_t fg, uint16_t bg, uint8_t size) {
+    API_LOCK();
+    STAT_CALL(drawText);
+    if (!size) return;
+
+    if (!_glyphs) {
+        _glyphs = (ILI9341_Glyph *)calloc(ILI9341_GLYPH_CACHE, sizeof(ILI9341_Glyph));
+        if (!_glyphs) {
+            printf("Glyph cache allocation failed\n");
+            return;
+        }
+    }
+
+    int32_t cw = (_font->width + _font->spacing) * size; // Screen pixels per character
+    int32_t x0 = x, x1 = x + (int32_t)strlen(str) * cw;
+    int32_t y0 = y, y1 = y + _font->height * size;
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > _width)  x1 = _width;
+    if (y1 > _height) y1 = _height;
+    if ((x0 >= x1) || (y0 >= y1)) return;
+
+    // Visible characters, looked up once and checked again on later rows
+    // in case two of them share a cache slot
+    int32_t first = (x0 - x) / cw, count = (x1 - x - 1) / cw - first + 1;
+    ILI9341_Glyph *cells[ILI9341_TFTHEIGHT + 2];
+    for (int32_t i=0; i<count; i++) {
+        cells[i] = glyph(str[first + i], fg, bg);
+    }
+
+    uint32_t rowBytes = (_font->width + _font->spacing) * 2;
+    startWrite();
+    setAddrWindow(x0, y0, x1 - x0, y1 - y0);
+    ILI9341_PoolBuffer buf(_pool);
+    uint8_t *p   = buf.data();
+    uint8_t *end = buf.data() + buf.size();
+    for (int32_t row=y0; row<y1; row++) {
+        uint32_t glyphRow = (row - y) / size;
+        for (int32_t i=0; i<count; i++) {
+            uint8_t ch = str[first + i];
+            ILI9341_Glyph *g = cells[i];
+            if ((g->font != _font) || (g->ch != ch) || (g->fg != fg) || (g->bg != bg)) {
+                g = cells[i] = glyph(ch, fg, bg);
+            }
+            const uint8_t *src = g->pixels + glyphRow * rowBytes;
+
+            // Columns of this character cell that are on screen
+            int32_t cx = x + (first + i) * cw;
+            int32_t c0 = (x0 > cx) ? x0 - cx : 0;
+            int32_t c1 = (x1 < cx + cw) ? x1 - cx : cw;
+            if ((end - p) < (c1 - c0) * 2) {
+                writeWire(buf.data(), p - buf.data());
+                p = buf.data();
+            }
+            if (size == 1) {
+                memcpy(p, src + c0 * 2, (c1 - c0) * 2);
+                p += (c1 - c0) * 2;
+            } else {
+                for (int32_t c=c0; c<c1; c++) {
+                    const uint8_t *s = src + (c / size) * 2;
+                    *p++ = s[0];
+                    *p++ = s[1];
+                }
+            }
+        }
+    }
+    if (p != buf.data()) {
+        writeWire(buf.data(), p - buf.data());
+    }
+    endWrite();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Clip a bitmap against the screen
+    @param    x  TFT X location, updated to the clipped origin
+    @param    y  TFT Y location, updated to the clipped origin
+    @param    w  Bitmap width, updated to the clipped width
+    @param    h  Bitmap height, updated to the clipped height
+    @param    bx Set to the first visible column within the bitmap
+    @param    by Set to the first visible row within the bitmap
+    @return   False if nothing is visible
+*/
+/**************************************************************************/
+bool Adafruit_ILI9341::clipBitmap(int16_t &x, int16_t &y, int16_t &w, int16_t &h,
+        int16_t &bx, int16_t &by) {
+    int16_t x2, y2; // Lower-right coord
+    if(( w             <= 0      ) ||
+       ( h             <= 0      ) ||
+       ( x             >= _width ) ||      // Off-edge right
+       ( y             >= _height) ||      // " top
+       ((x2 = (x+w-1)) <  0      ) ||      // " left
+       ((y2 = (y+h-1)) <  0)     ) return false; // " bottom
+
+    bx = by = 0;
+    if(x < 0) { // Clip left
+        w  +=  x;
+        bx  = -x;
+        x   =  0;
+    }
+    if(y < 0) { // Clip top
+        h  +=  y;
+        by  = -y;
+        y   =  0;
+    }
+    if(x2 >= _width ) w = _width  - x; // Clip right
+    if(y2 >= _height) h = _height - y; // Clip bottom
+    return true;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Write pixels that are already in wire order (big endian RGB565)
+           at the current address window. Goes to the framebuffer when it
+           is enabled. DOES NOT set up SPI transaction.
+    @param    buf  Wire-order pixel bytes; converted in place in framebuffer
+                   mode, so it must be writable scratch memory there
+    @param    len  Number of bytes, two per pixel
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::writeWire(uint8_t *buf, uint32_t len) {
+    if (_fb) {
+        uint16_t *px = (uint16_t *)buf;
+        for (uint32_t i=0; i<len/2; i++) {
+            px[i] = ((uint16_t)buf[i*2] << 8) | buf[i*2+1];
+        }
+        fbWrite(px, len/2, false);
+        return;
+    }
+    busWrite(buf, len);
+    _ramwrPos += len / 2;
+}
+
+
+/**************************************************************************/
+/*!
+   @brief  Turn the off-screen RGB565 framebuffer on or off. While it is on,
+           all write and draw calls render into memory and flush() sends the
+           changed regions to the panel. The buffer starts out black and
+           fully dirty. Disabling it flushes any pending changes first.
+    @param    enable  True to allocate the framebuffer, false to free it
+    @return   False if the framebuffer could not be allocated
+*/
+/**************************************************************************/
+bool Adafruit_ILI9341::enableFramebuffer(bool enable) {
+    API_LOCK();
+    if (!enable) {
+        enableAsyncFlush(false);
+        flush();
+        free(_fb);
+        _fb = NULL;
+        return true;
+    }
+    if (_fb) return true;
+
+    // Sized for the larger orientation so rotation never reallocates
+    _fb = (uint16_t *)calloc((uint32_t)ILI9341_TFTWIDTH * ILI9341_TFTHEIGHT, sizeof(uint16_t));
+    if (!_fb) {
+        printf("Framebuffer allocation failed\n");
+        return false;
+    }
+    _fbWin.x = _fbWin.y = 0;
+    _fbWin.w = _width;
+    _fbWin.h = _height;
+    _fbPos   = 0;
+    _ndirty  = 0;
+    markDirty(0, 0, _width, _height);
+    return true;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Write pixels at the framebuffer address window cursor, wrapping
+           rows the same way the panel does
+    @param    colors  Pixel data, or a single color when repeat is set
+    @param    len     Number of pixels to write
+    @param    repeat  True to write colors[0] len times
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::fbWrite(const uint16_t *colors, uint32_t len, bool repeat) {
+    uint32_t area = (uint32_t)_fbWin.w * _fbWin.h;
+    if (!area) return;
+
+    while (len) {
+        int32_t col = _fbPos % _fbWin.w;
+        int32_t row = _fbPos / _fbWin.w;
+        uint32_t run = _fbWin.w - col;
+        if (run > len) run = len;
+
+        // Clip the run against the screen
+        int32_t x = _fbWin.x + col, y = _fbWin.y + row;
+        int32_t x0 = x, x1 = x + (int32_t)run;
+        if (x0 < 0) x0 = 0;
+        if (x1 > _width) x1 = _width;
+        if ((y >= 0) && (y < _height) && (x0 < x1)) {
+            uint16_t *dst = _fb + y * _width + x0;
+            if (repeat) {
+                for (int32_t i=x0; i<x1; i++) {
+                    *dst++ = colors[0];
+                }
+            } else {
+                memcpy(dst, colors + (x0 - x), (x1 - x0) * sizeof(uint16_t));
+            }
+        }
+
+        if (!repeat) colors += run;
+        len -= run;
+        _fbPos += run;
+        if (_fbPos >= area) _fbPos = 0;
+    }
+}
+
+/// Portrait panel position of pixel (x, y) in the given rotation
+static void portraitPoint(uint8_t rotation, int16_t x, int16_t y, int16_t &px, int16_t &py) {
+    switch (rotation) {
+        case 0:  px = x;                         py = y;                          break;
+        case 1:  px = ILI9341_TFTWIDTH - 1 - y;  py = x;                          break;
+        case 2:  px = ILI9341_TFTWIDTH - 1 - x;  py = ILI9341_TFTHEIGHT - 1 - y;  break;
+        default: px = y;                         py = ILI9341_TFTHEIGHT - 1 - x;  break;
+    }
+}
+
+/// Pixel in the given rotation shown at portrait panel position (px, py)
+static void rotatedPoint(uint8_t rotation, int16_t px, int16_t py, int16_t &x, int16_t &y) {
+    switch (rotation) {
+        case 0:  x = px;                          y = py;                         break;
+        case 1:  x = py;                          y = ILI9341_TFTWIDTH - 1 - px;  break;
+        case 2:  x = ILI9341_TFTWIDTH - 1 - px;   y = ILI9341_TFTHEIGHT - 1 - py; break;
+        default: x = ILI9341_TFTHEIGHT - 1 - py;  y = px;                         break;
+    }
+}
+
+/**************************************************************************/
+/*!
+   @brief  Re-lay-out the framebuffer for the current rotation. MADCTL
+           leaves the GRAM alone, so the panel keeps its picture and the
+           framebuffer must keep the same one to stay in step with it.
+    @param    from  Rotation the framebuffer is laid out for
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::rotateFramebuffer(uint8_t from) {
+    uint32_t bytes = (uint32_t)ILI9341_TFTWIDTH * ILI9341_TFTHEIGHT * sizeof(uint16_t);
+    uint16_t *old = (uint16_t *)malloc(bytes);
+    if (!old) { // Can't keep the picture, clear the panel instead
+        printf("Framebuffer rotation failed\n");
+        memset(_fb, 0, bytes);
+        _ndirty = 0;
+        markDirty(0, 0, _width, _height);
+        return;
+    }
+    memcpy(old, _fb, bytes);
+
+    // Map every pixel to the panel and back into the old layout
+    int16_t oldWidth = (from & 1) ? ILI9341_TFTHEIGHT : ILI9341_TFTWIDTH;
+    uint16_t *dst = _fb;
+    for (int16_t y=0; y<_height; y++) {
+        for (int16_t x=0; x<_width; x++) {
+            int16_t px, py, ox, oy;
+            portraitPoint(_rotation, x, y, px, py);
+            rotatedPoint(from, px, py, ox, oy);
+            *dst++ = old[(int32_t)oy * oldWidth + ox];
+        }
+    }
+    free(old);
+    if (_front) { // The flush thread is idle after flush(), keep both buffers alike
+        memcpy(_front, _fb, bytes);
+    }
+}
+
+static int32_t rectArea(const ILI9341_Rect &r) {
+    return (int32_t)r.w * r.h;
+}
+
+static ILI9341_Rect rectUnion(const ILI9341_Rect &a, const ILI9341_Rect &b) {
+    ILI9341_Rect u;
+    int16_t x2 = (a.x + a.w > b.x + b.w) ? a.x + a.w : b.x + b.w;
+    int16_t y2 = (a.y + a.h > b.y + b.h) ? a.y + a.h : b.y + b.h;
+    u.x = (a.x < b.x) ? a.x : b.x;
+    u.y = (a.y < b.y) ? a.y : b.y;
+    u.w = x2 - u.x;
+    u.h = y2 - u.y;
+    return u;
+}
+
+static int32_t rectOverlap(const ILI9341_Rect &a, const ILI9341_Rect &b) {
+    int32_t w = ((a.x + a.w < b.x + b.w) ? a.x + a.w : b.x + b.w) - ((a.x > b.x) ? a.x : b.x);
+    int32_t h = ((a.y + a.h < b.y + b.h) ? a.y + a.h : b.y + b.h) - ((a.y > b.y) ? a.y : b.y);
+    return (w > 0 && h > 0) ? w * h : 0;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Record a region of the framebuffer as changed. Rectangles that
+           overlap or sit close together are merged when the union adds no
+           more than ILI9341_DIRTY_SLACK pixels that did not change.
+    @param    x  TFT X location begin
+    @param    y  TFT Y location begin
+    @param    w  Width of rectangle
+    @param    h  Height of rectangle
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::markDirty(int16_t x, int16_t y, int16_t w, int16_t h) {
+    API_LOCK();
+    if (!_fb) return;
+
+    // Clip to the screen
+    int32_t x2 = (int32_t)x + w, y2 = (int32_t)y + h;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x2 > _width)  x2 = _width;
+    if (y2 > _height) y2 = _height;
+    if ((x2 <= x) || (y2 <= y)) return;
+
+    ILI9341_Rect r;
+    r.x = x;
+    r.y = y;
+    r.w = x2 - x;
+    r.h = y2 - y;
+
+    for (;;) {
+        int best = -1;
+        int32_t bestWaste = 0;
+        for (int i=0; i<_ndirty; i++) {
+            ILI9341_Rect u = rectUnion(_dirty[i], r);
+            int32_t waste = rectArea(u) - rectArea(_dirty[i]) - rectArea(r)
+                          + rectOverlap(_dirty[i], r);
+            if ((best < 0) || (waste < bestWaste)) {
+                best = i;
+                bestWaste = waste;
+            }
+        }
+        // Merge when cheap, or when there is no room left for another rect
+        if ((best < 0) ||
+            ((bestWaste > ILI9341_DIRTY_SLACK) && (_ndirty < ILI9341_MAX_DIRTY))) {
+            break;
+        }
+        r = rectUnion(_dirty[best], r);
+        _dirty[best] = _dirty[--_ndirty];
+    }
+    _dirty[_ndirty++] = r;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Send every dirty region of the framebuffer to the panel, one
+           address window and one bulk pixel stream per region
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::flush(void) {
+    API_LOCK();
+    STAT_CALL(flush);
+    if (_front) { // Double buffered, hand over and wait for it to go out
+        present();
+        waitFlush();
+        return;
+    }
+    if (!_fb || !_ndirty) return;
+
+    sendRects(_fb, _width, _dirty, _ndirty);
+    _ndirty = 0;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Send regions of a framebuffer to the panel, one address window
+           and one packed pixel stream per region
+    @param    buf     Framebuffer to read pixels from
+    @param    stride  Pixels per framebuffer row
+    @param    rects   Regions to send
+    @param    n       Number of regions
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::sendRects(const uint16_t *buf, int16_t stride,
+        const ILI9341_Rect *rects, uint8_t n) {
+    beginBus();
+    for (int i=0; i<n; i++) {
+        const ILI9341_Rect &r = rects[i];
+        writeAddrWindow(r.x, r.y, r.w, r.h);
+        spiWriteRect(buf + (int32_t)r.y * stride + r.x, r.w, r.h, stride);
+    }
+    endBus();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Turn double buffering with a background flush thread on or off.
+           Drawing goes to a back buffer and present() hands it to the
+           thread, so rendering the next frame overlaps sending this one.
+           Enables the framebuffer if needed. The back buffer changes on
+           every present(), so re-read framebuffer() afterwards.
+    @param    enable  True to start the flush thread, false to go back to
+                      synchronous flushes
+    @return   False if the front buffer could not be allocated
+*/
+/**************************************************************************/
+bool Adafruit_ILI9341::enableAsyncFlush(bool enable) {
+    API_LOCK();
+    if (!enable) {
+        if (!_front) return true;
+        waitFlush(); // The thread stays, idle, for flushAll()
+        free(_front);
+        _front = NULL;
+        return true;
+    }
+    if (_front) return true;
+    if (!enableFramebuffer()) return false;
+
+    _front = (uint16_t *)malloc((uint32_t)ILI9341_TFTWIDTH * ILI9341_TFTHEIGHT * sizeof(uint16_t));
+    if (!_front) {
+        printf("Front buffer allocation failed\n");
+        return false;
+    }
+    memcpy(_front, _fb, (uint32_t)ILI9341_TFTWIDTH * ILI9341_TFTHEIGHT * sizeof(uint16_t));
+    _nfrontDirty  = 0;
+    startFlushThread();
+    return true;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Start the flush thread if it isn't running. It runs until end()
+           or the destructor stops it.
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::startFlushThread(void) {
+    if (_flushThread.joinable()) return;
+    _flushPending = false;
+    _flushStop    = false;
+    _flushThread  = std::thread(&Adafruit_ILI9341::flushThread, this);
+}
+
+/**************************************************************************/
+/*!
+   @brief  Stop the flush thread after any frame in flight
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::stopFlushThread(void) {
+    if (!_flushThread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(_flushLock);
+        _flushStop = true;
+    }
+    _flushCond.notify_all();
+    _flushThread.join();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Flush several panels at once, each on its own flush thread.
+           Panels with async flushing enabled are handed their frame with
+           present(); the others get a flush thread on first use, which
+           sends straight from their framebuffer. Returns once every panel
+           is up to date, so the frame latency is that of the slowest
+           panel rather than the sum. Panels on a shared controller still
+           take turns on it.
+
+           Every panel is locked for the duration, in address order so
+           concurrent calls on overlapping sets can't deadlock.
+    @param    panels  Panels to flush
+    @param    n       Number of panels
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::flushAll(Adafruit_ILI9341 *const *panels, uint8_t n) {
+    Adafruit_ILI9341 *locked[256];
+    std::copy(panels, panels + n, locked);
+    std::sort(locked, locked + n);
+    n = std::unique(locked, locked + n) - locked;
+    for (uint8_t i=0; i<n; i++) {
+        locked[i]->_apiLock.lock();
+    }
+
+    for (uint8_t i=0; i<n; i++) {
+        Adafruit_ILI9341 *p = locked[i];
+        if (p->_front) {
+            p->present();
+        } else if (p->_fb && p->_ndirty) {
+            // The caller keeps _apiLock, so _fb holds still while it goes out
+            p->startFlushThread();
+            std::lock_guard<std::mutex> lock(p->_flushLock);
+            p->_sendBuf     = p->_fb;
+            p->_frontStride = p->_width;
+            memcpy(p->_frontDirty, p->_dirty, p->_ndirty * sizeof(ILI9341_Rect));
+            p->_nfrontDirty  = p->_ndirty;
+            p->_ndirty       = 0;
+            p->_flushPending = true;
+            p->_flushCond.notify_all();
+        }
+    }
+
+    for (uint8_t i=0; i<n; i++) {
+        locked[i]->waitFlush();
+        locked[i]->_apiLock.unlock();
+    }
+}
+
+/**************************************************************************/
+/*!
+   @brief  Swap the back buffer to the front and queue its dirty regions
+           for the flush thread. Only blocks if the previous frame is still
+           being sent. Without async flush this is the same as flush().
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::present(void) {
+    API_LOCK();
+    STAT_CALL(present);
+    if (!_front) {
+        flush();
+        return;
+    }
+
+    startFlushThread(); // Stopped by end()
+    std::unique_lock<std::mutex> lock(_flushLock);
+    _flushCond.wait(lock, [this]{ return !_flushPending; });
+
+    uint16_t *t = _front;
+    _front = _fb;
+    _fb    = t;
+    _sendBuf     = _front;
+    _frontStride = _width;
+    memcpy(_frontDirty, _dirty, _ndirty * sizeof(ILI9341_Rect));
+    _nfrontDirty = _ndirty;
+    _ndirty = 0;
+    _flushPending = (_nfrontDirty != 0);
+    lock.unlock();
+    _flushCond.notify_all();
+
+    // Bring the new back buffer up to date with the frame just presented.
+    // The flush thread only reads _front, so this can run alongside it.
+    for (int i=0; i<_nfrontDirty; i++) {
+        const ILI9341_Rect &r = _frontDirty[i];
+        for (int16_t row=r.y; row<r.y+r.h; row++) {
+            int32_t off = (int32_t)row * _width + r.x;
+            memcpy(_fb + off, _front + off, r.w * sizeof(uint16_t));
+        }
+    }
+}
+
+/**************************************************************************/
+/*!
+   @brief  Block until the flush thread has sent the last presented frame
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::waitFlush(void) {
+    std::unique_lock<std::mutex> lock(_flushLock);
+    _flushCond.wait(lock, [this]{ return !_flushPending; });
+}
+
+/**************************************************************************/
+/*!
+   @brief  Flush thread body, sends each presented front buffer and each
+           framebuffer handed over by flushAll()
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::flushThread(void) {
+    std::unique_lock<std::mutex> lock(_flushLock);
+    for (;;) {
+        _flushCond.wait(lock, [this]{ return _flushPending || _flushStop; });
+        if (_flushPending) {
+            lock.unlock();
+            sendRects(_sendBuf, _frontStride, _frontDirty, _nfrontDirty);
+            lock.lock();
+            _flushPending = false;
+            _flushCond.notify_all();
+        }
+        if (_flushStop) return;
+    }
+}
+
+
+/**************************************************************************/
+/*!
+   @brief  Read 8 bits of data from ILI9341 configuration memory. NOT from RAM!
+           This is highly undocumented/supported, it's really a hack but kinda works?
+    @param    command  The command register to read data from
+    @param    index  The byte index into the command to read from
+    @return   Unsigned 8-bit data read from ILI9341 register
+*/
+/**************************************************************************/
+uint8_t Adafruit_ILI9341::readcommand8(uint8_t command, uint8_t index) {
+    API_LOCK();
+    STAT_CALL(readcommand8);
+    waitFlush();
+    beginBus();
+    writeCommand(0xD9);  // woo sekret command?
+    spiWrite(0x10 + index);
+    writeCommand(command);
+    uint8_t r = spiRead();
+    endBus();
+    return r;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Read the raw 18-bit pixel data of a window with RAMRD, three
+             bytes per pixel after the dummy byte. DOES NOT set up SPI
+             transaction.
+    @param   x  TFT memory 'x' origin
+    @param   y  TFT memory 'y' origin
+    @param   w  Width of rectangle
+    @param   h  Height of rectangle
+    @param   buf  Receives 3 * w * h bytes
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::readRaw(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *buf) {
+    writeWindowRegs(x, y, w, h);
+    writeCommand(ILI9341_RAMRD);
+    busRead();                              // Dummy byte
+    busRead(buf, (uint32_t)w * h * 3);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Read back a rectangle of pixels from the panel. GRAM is read
+             with RAMRD in chunks that fit the transfer buffer, and the
+             panel's 18-bit read format is reduced to RGB565. The bus clock
+             is lowered to the read clock (see setReadClock()) for the
+             duration. In framebuffer mode the framebuffer is read instead.
+             Pixels of the rectangle that are off screen are left as is.
+    @param   x  TFT X location begin
+    @param   y  TFT Y location begin
+    @param   w  Width of rectangle
+    @param   h  Height of rectangle
+    @param   buf  Receives w * h RGB565 pixels, row by row
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::readRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t *buf) {
+    API_LOCK();
+    STAT_CALL(readRect);
+
+    int16_t bx1, by1, saveW=w;
+    if(!clipBitmap(x, y, w, h, bx1, by1)) return;
+    buf += (int32_t)by1 * saveW + bx1;
+
+    waitFlush();
+    if (_fb) {
+        for (int16_t row=0; row<h; row++) {
+            memcpy(buf + (int32_t)row * saveW, _fb + (int32_t)(y + row) * _width + x,
+                   w * sizeof(uint16_t));
+        }
+        return;
+    }
+
+    uint32_t hz = _bus->clock();
+    if (hz > _readHz) {
+        _bus->setClock(_readHz);
+    }
+
+    // Whole rows per RAMRD, as many as fit in the staging buffer
+    ILI9341_PoolBuffer pix(_pool);
+    int16_t rows = pix.size() / (w * 3);
+    beginBus();
+    for (int16_t row=0; row<h; row+=rows) {
+        int16_t n = (h - row < rows) ? h - row : rows;
+        readRaw(x, y + row, w, n, pix.data());
+        const uint8_t *p = pix.data();
+        for (int16_t r=0; r<n; r++) {
+            uint16_t *dst = buf + (int32_t)(row + r) * saveW;
+            for (int16_t i=0; i<w; i++, p+=3) {
+                dst[i] = ((p[0] & 0xF8) << 8) | ((p[1] & 0xFC) << 3) | (p[2] >> 3);
+            }
+        }
+    }
+    endBus();
+
+    if (hz > _readHz) {
+        _bus->setClock(hz);
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief   Change the SPI clock
+    @param   hz  Clock in Hz; the transport may round it down
+    @return  False if the transport can't change its clock
+*/
+/**************************************************************************/
+bool Adafruit_ILI9341::setClock(uint32_t hz) {
+    API_LOCK();
+    STAT_CALL(setClock);
+    waitFlush();
+    return _bus->setClock(hz);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Write test patterns to the calibration area at one clock and
+             read them back at a slow one
+    @param   hz  Clock to test writes at
+    @param   readHz  Clock to read back at
+    @return  True if every pattern came back intact
+*/
+/**************************************************************************/
+bool Adafruit_ILI9341::clockPasses(uint32_t hz, uint32_t readHz) {
+    uint16_t pattern[ILI9341_CAL_W * ILI9341_CAL_H];
+    uint8_t  back[ILI9341_CAL_W * ILI9341_CAL_H * 3];
+    uint32_t n = ILI9341_CAL_W * ILI9341_CAL_H;
+    uint32_t seed = hz;
+
+    for (uint8_t pass=0; pass<ILI9341_CAL_PASSES; pass++) {
+        for (uint32_t i=0; i<n; i++) {
+            switch (pass % 3) {
+                case 0:  pattern[i] = (i & 1) ? 0xAAAA : 0x5555;  break; // Every bit toggles
+                case 1:  pattern[i] = ~(1 << (i % 16));           break; // Walking zero
+                default: seed = seed * 1103515245 + 12345;                // Pseudo random
+                         pattern[i] = seed >> 16;                 break;
+            }
+        }
+
+        _bus->setClock(hz);
+        beginBus();
+        writeAddrWindow(0, 0, ILI9341_CAL_W, ILI9341_CAL_H);
+        spiWritePixels(pattern, n);
+        endBus();
+
+        _bus->setClock(readHz);
+        _casetValid = _pasetValid = false; // Resend the window at the safe clock
+        beginBus();
+        readRaw(0, 0, ILI9341_CAL_W, ILI9341_CAL_H, back);
+        endBus();
+
+        for (uint32_t i=0; i<n; i++) {
+            uint16_t c = pattern[i];
+            if (((back[i*3]   & 0xF8) != ((c >> 8) & 0xF8)) ||
+                ((back[i*3+1] & 0xFC) != ((c >> 3) & 0xFC)) ||
+                ((back[i*3+2] & 0xF8) != ((c << 3) & 0xF8))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Find the fastest reliable SPI clock. The clock is raised in
+             ILI9341_CAL_STEP steps from minHz; at each step test patterns
+             are written to the top-left ILI9341_CAL_W x ILI9341_CAL_H
+             pixels and read back with RAMRD at minHz. The clock settles one
+             step below the highest one that passed, keeping a passing step
+             of margin above it. Those pixels are overwritten; in
+             framebuffer mode they are marked dirty so flush() restores them.
+    @param   minHz  Slowest clock tried, also used for all reads
+    @param   maxHz  Fastest clock tried
+    @return  Clock selected in Hz, or 0 if the transport can't change its
+             clock or even minHz fails
+*/
+/**************************************************************************/
+uint32_t Adafruit_ILI9341::calibrateClock(uint32_t minHz, uint32_t maxHz) {
+    API_LOCK();
+    STAT_CALL(calibrateClock);
+    waitFlush();
+    if (!_bus->setClock(minHz)) {
+        return 0;
+    }
+
+    uint32_t best = 0, last = 0; // Selected clock, highest passing clock
+    uint32_t hz = minHz;
+    bool failed = false;
+    while (true) {
+        if (!clockPasses(hz, minHz)) {
+            failed = true;
+            break;
+        }
+        best = last ? last : hz; // One step of margin below the highest pass
+        last = hz;
+        if (hz >= maxHz) break;
+        uint64_t next = (uint64_t)hz * ILI9341_CAL_STEP / 100;
+        hz = (next > maxHz) ? maxHz : (uint32_t)next;
+    }
+    if (!failed) {
+        best = last; // Never failed, nothing to keep a margin from
+    }
+
+    _bus->setClock(best ? best : minHz);
+    _casetValid = _pasetValid = false; // Failed steps may have garbled them
+    if (_fb) {
+        markDirty(0, 0, ILI9341_CAL_W, ILI9341_CAL_H);
+    }
+    return best;
+}
+
+
+/**************************************************************************/
+/*!
+   @brief  Begin SPI transaction, for software or hardware SPI. Takes the
+           driver lock until the matching endWrite(), so other threads'
+           drawing waits rather than interleaving. Transactions nest; the
+           panel stays selected until the outermost one ends. With async
+           flush enabled drawing goes to the back buffer and this does not
+           touch the bus.
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::startWrite(void){
+    _apiLock.lock();
+    if (_txDepth++ == 0) {
+        _txBus = !_front; // Drawing only touches the back buffer when async
+    }
+    if (_txBus) beginBus();
+}
+
+/**************************************************************************/
+/*!
+   @brief  End SPI transaction, for software or hardware SPI
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::endWrite(void){
+    if (_txBus) endBus();
+    _txDepth--;
+    _apiLock.unlock();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Begin a transaction for a drawing call, unless it is only being
+           recorded into a display list and never reaches the panel. The
+           caller holds the API lock.
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::startDraw(void){
+    if (!_record) startWrite();
+}
+
+/**************************************************************************/
+/*!
+   @brief  End a transaction begun by startDraw()
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::endDraw(void){
+    if (!_record) endWrite();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Select the panel for a bus transaction. Unlike startWrite() this
+           always reaches the bus, even while the flush thread is running.
+           Calls nest; only the outermost pair moves CS.
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::beginBus(void){
+    if (_busDepth++) return;
+    SPI_BEGIN_TRANSACTION();
+    SPI_CS_LOW();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Deselect the panel at the end of a bus transaction
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::endBus(void){
+    if (_busDepth > 1) {
+        _busDepth--;
+        return;
+    }
+    _busDepth = 0;
+    SPI_CS_HIGH();
+    SPI_END_TRANSACTION();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Write 8-bit data to command/register (DataCommand line low).
+   Does not set up SPI transaction.
+   @param  cmd The command/register to transmit
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::writeCommand(uint8_t cmd){
+    // Any command ends a memory write; some also change the address window
+    _ramwrActive = false;
+    switch (cmd) {
+        case ILI9341_CASET:
+            _casetValid = false;
+            break;
+        case ILI9341_PASET:
+            _pasetValid = false;
+            break;
+        case ILI9341_SWRESET:
+        case ILI9341_MADCTL:
+            _casetValid = _pasetValid = false;
+            break;
+    }
+    STAT_ADD(commands, 1);
+    DC_LOW();
+    spiWrite(cmd);
+    DC_HIGH();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Read 8-bit data via SPI. 
+   @returns One byte of data from SPI
+*/
+/**************************************************************************/
+uint8_t Adafruit_ILI9341::spiRead() {
+    return busRead();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Write 8-bit data via SPI. 
+   @param  b Byte of data to write over SPI
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::spiWrite(uint8_t b) {
+    _ramwrActive = false; // Half a pixel, the cursor is no longer known
+    busWrite(b);
+}
+
+/**************************************************************************/
+/*!
+   @brief  Write 16-bit data via SPI. 
+   @param  s Half word of data to write over SPI
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::spiWrite16(uint16_t s) {
+    _ramwrPos++;
+    uint8_t bytes[2];
+    bytes[0] = s >> 8;
+    bytes[1] = s;
+    busWrite(bytes,2);
+}
+
+/**************************************************************************/
+/*!
+   @brief  Write 32-bit data via SPI. 
+   @param  w Word of data to write over SPI
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::spiWrite32(uint32_t w) {
+    _ramwrPos += 2;
+    uint8_t bytes[4];
+    bytes[0] = w >> 24;
+    bytes[1] = w >> 16;
+    bytes[2] = w >> 8;
+    bytes[3] = w;
+    busWrite(bytes,4);
+}
+
+/**************************************************************************/
+/*!
+   @brief  Write a buffer of color values via SPI
+   @param  c Buffer of color values
+   @param  l Length of the buffer
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::spiWritePixels(uint16_t *c, uint32_t l) {
+    _ramwrPos += l;
+    ILI9341_PoolBuffer buf(_pool);
+    while (l) {
+        uint32_t n = (l > buf.size() / 2) ? buf.size() / 2 : l;
+        uint8_t *p = buf.data();
+        for (uint32_t i=0; i<n; i++) { // Swap to big endian for the wire
+            *p++ = c[i] >> 8;
+            *p++ = c[i];
+        }
+        busWrite(buf.data(), n * 2);
+        c += n;
+        l -= n;
+    }
+}
+
+/**************************************************************************/
+/*!
+   @brief  Write a rectangle of color values via SPI, packing as many rows
+           as fit into each bulk transfer
+   @param  c Color value of the top-left pixel
+   @param  w Width of the rectangle
+   @param  h Height of the rectangle
+   @param  stride Distance in pixels between the starts of two rows in c
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::spiWriteRect(const uint16_t *c, uint32_t w, uint32_t h, uint32_t stride) {
+    _ramwrPos += w * h;
+    ILI9341_PoolBuffer buf(_pool);
+    uint8_t *p = buf.data();
+    uint8_t *end = buf.data() + buf.size();
+    while (h--) {
+        for (uint32_t i=0; i<w; i++) {
+            *p++ = c[i] >> 8;
+            *p++ = c[i];
+            if (p == end) {
+                busWrite(buf.data(), p - buf.data());
+                p = buf.data();
+            }
+        }
+        c += stride;
+    }
+    if (p != buf.data()) {
+        busWrite(buf.data(), p - buf.data());
+    }
+}
+
+/**************************************************************************/
+/*!
+   @brief  Write the same color value 'l' times via SPI
+   @param  color 16-bit 5-6-5 color to repeat
+   @param  l Number of pixels to write
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::spiWriteColor(uint16_t color, uint32_t l) {
+    if (!l) return;
+    _ramwrPos += l;
+    if (!_colorbuf) { // Kept from the pool, it is reused until the color changes
+        _colorbuf = _pool.acquire();
+        _colorbufBytes = 0;
+    }
+    if (_colorbufColor != color) {
+        _colorbufColor = color;
+        _colorbufBytes = 0;
+    }
+    // Fill only as far as this write reaches
+    uint32_t bytes = (l * 2 < _pool.size()) ? l * 2 : _pool.size();
+    if (_colorbufBytes < bytes) {
+        uint8_t hi = color >> 8, lo = color;
+        for (uint32_t i=_colorbufBytes; i<bytes; i+=2) {
+            _colorbuf[i]   = hi;
+            _colorbuf[i+1] = lo;
+        }
+        _colorbufBytes = bytes;
+    }
+    while (l) {
+        uint32_t n = (l > bytes / 2) ? bytes / 2 : l;
+        busWrite(_colorbuf, n * 2);
+        l -= n;
+    }
+}
+
+/*
+ * Transport access. Every call into _bus goes through these so the
+ * counters and optional timing see all bus traffic.
+ * */
+#if ILI9341_STATS
+/// Adds the time spent in a transport call to _stats when timing is on
+class BusTimer {
+    public:
+        BusTimer(ILI9341_Stats &stats, bool enabled) : _stats(stats), _enabled(enabled) {
+            _stats.transportCalls++;
+            if (_enabled) clock_gettime(CLOCK_MONOTONIC, &_t0);
+        }
+        ~BusTimer() {
+            if (!_enabled) return;
+            struct timespec t1;
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            _stats.transportNs += (t1.tv_sec - _t0.tv_sec) * 1000000000LL +
+                                  (t1.tv_nsec - _t0.tv_nsec);
+        }
+    private:
+        ILI9341_Stats  &_stats;
+        bool            _enabled;
+        struct timespec _t0;
+};
+#define BUS_TIMER()				BusTimer timer(_stats, _statsTiming);
+#else
+#define BUS_TIMER()
+#endif
+
+void Adafruit_ILI9341::busCS(bool high) {
+    BUS_TIMER();
+    if (high != _csLevel) {
+        STAT_ADD(csToggles, 1);
+        _csLevel = high;
+    }
+    _bus->setCS(high);
+}
+
+void Adafruit_ILI9341::busDC(bool data) {
+    BUS_TIMER();
+    if (data != _dcLevel) {
+        STAT_ADD(dcToggles, 1);
+        _dcLevel = data;
+    }
+    _bus->setDC(data);
+}
+
+void Adafruit_ILI9341::busReset(bool high) {
+    BUS_TIMER();
+    _bus->setReset(high);
+}
+
+void Adafruit_ILI9341::busWrite(uint8_t b) {
+    BUS_TIMER();
+    if (_dcLevel) STAT_ADD(payloadBytes, 1);
+    _bus->write(b);
+}
+
+void Adafruit_ILI9341::busWrite(const uint8_t *buf, uint32_t len) {
+    BUS_TIMER();
+    if (_dcLevel) STAT_ADD(payloadBytes, len);
+    _bus->write(buf, len);
+}
+
+uint8_t Adafruit_ILI9341::busRead(void) {
+    BUS_TIMER();
+    STAT_ADD(readBytes, 1);
+    return _bus->read();
+}
+
+void Adafruit_ILI9341::busRead(uint8_t *buf, uint32_t len) {
+    BUS_TIMER();
+    STAT_ADD(readBytes, len);
+    _bus->read(buf, len);
+}
+
+void Adafruit_ILI9341::busDelay(uint32_t ms) {
+    (_bus->delay)(ms); // Not a bus transfer, kept out of the counters
+}
+
+/*
+ * The flush thread updates _stats while it sends a frame. The calls below
+ * wait for it first; with _apiLock held no new frame can be presented.
+ * */
+
+/**************************************************************************/
+/*!
+   @brief  Snapshot of the instrumentation counters
+   @return The counters, including any frame the flush thread was sending
+*/
+/**************************************************************************/
+ILI9341_Stats Adafruit_ILI9341::stats(void) {
+    API_LOCK();
+    waitFlush();
+    return _stats;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Zero all instrumentation counters
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::resetStats(void) {
+    API_LOCK();
+    waitFlush();
+    memset(&_stats, 0, sizeof(_stats));
+    _pool.resetStats();
+}
+
+/**************************************************************************/
+/*!
+   @brief  Time transport calls into the counters, at the cost of two
+           clock reads per call
+   @param  enable True to time
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::setStatsTiming(bool enable) {
+    API_LOCK();
+    waitFlush();
+    _statsTiming = enable;
+}
+
+/**************************************************************************/
+/*!
+   @brief  Print the instrumentation counters, one "name value" per line
+   @param  f Stream to print to
+*/
+/**************************************************************************/
+void Adafruit_ILI9341::dumpStats(FILE *f) {
+    ILI9341_Stats st = stats();
+#define ILI9341_API_NAME(name) #name,
+    static const char *names[] = { ILI9341_API_LIST(ILI9341_API_NAME) };
+    for (int i=0; i<ILI9341_API_COUNT; i++) {
+        if (st.calls[i]) {
+            fprintf(f, "calls.%s %llu\n", names[i], (unsigned long long)st.calls[i]);
+        }
+    }
+    fprintf(f, "commands %llu\n",        (unsigned long long)st.commands);
+    fprintf(f, "payload_bytes %llu\n",   (unsigned long long)st.payloadBytes);
+    fprintf(f, "read_bytes %llu\n",      (unsigned long long)st.readBytes);
+    fprintf(f, "dc_toggles %llu\n",      (unsigned long long)st.dcToggles);
+    fprintf(f, "cs_toggles %llu\n",      (unsigned long long)st.csToggles);
+    fprintf(f, "transport_calls %llu\n", (unsigned long long)st.transportCalls);
+    fprintf(f, "transport_ns %llu\n",    (unsigned long long)st.transportNs);
+    fprintf(f, "glyph_hits %llu\n",      (unsigned long long)st.glyphHits);
+    fprintf(f, "glyph_misses %llu\n",    (unsigned long long)st.glyphMisses);
+    ILI9341_PoolStats pool = _pool.stats();
+    fprintf(f, "pool.buffers %u\n",      pool.buffers);
+    fprintf(f, "pool.buffer_bytes %u\n", pool.bufferBytes);
+    fprintf(f, "pool.in_use %u\n",       pool.inUse);
+    fprintf(f, "pool.peak_in_use %u\n",  pool.peakInUse);
+    fprintf(f, "pool.acquires %llu\n",   (unsigned long long)pool.acquires);
+    fprintf(f, "pool.waits %llu\n",      (unsigned long long)pool.waits);
+    fprintf(f, "pool.wait_ns %llu\n",    (unsigned long long)pool.waitNs);
 }
@@ -37,6 +37,10 @@
 * Modified by Andrew Pentz to:
 * 	1.  Be compatible with the Raspberry Pi
 *   2.  Be compatible with the STM32f4disc board
+*   3.  Talk to the panel through an ILI9341_Transport (bcm2835, spidev
+*       or the simulated panel in transport_sim.h)
+*   4.  Drive several panels from one process, each instance with its own
+*       transport and pins
 *
 *
 */
@@ -49,17 +53,39 @@
 
 #include <stdint.h>			//uint_t
 
-#include <bcm2835.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
-//Pin Defintions
-#define CS 		RPI_GPIO_P1_11
-#define DC 		RPI_GPIO_P1_15 
-#define RESET 	RPI_GPIO_P1_22
+#include "transport.h"
+#include "color_convert.h"
+#include "font.h"
+#include "asset.h"
+#include "display_list.h"
+#include "buffer_pool.h"
 
 //Command Definitions
 #define ILI9341_TFTWIDTH   240       ///< ILI9341 max TFT width
 #define ILI9341_TFTHEIGHT  320       ///< ILI9341 max TFT height
 
+#define ILI9341_INIT_DELAY 0x80      ///< Init table: a delay byte follows the parameters
+
+#define ILI9341_PIXBUF_PIXELS 2048   ///< Pixels per transfer buffer when the transport has no limit
+#define ILI9341_MAX_DIRTY     16     ///< Dirty rectangles tracked by the framebuffer
+#define ILI9341_DIRTY_SLACK   64     ///< Extra pixels a dirty rectangle merge may add
+#define ILI9341_TILE_SIZE     16     ///< Tile edge used by frame differencing
+#define ILI9341_TILE_COUNT    (((ILI9341_TFTWIDTH + ILI9341_TILE_SIZE - 1) / ILI9341_TILE_SIZE) * \
+                               ((ILI9341_TFTHEIGHT + ILI9341_TILE_SIZE - 1) / ILI9341_TILE_SIZE))
+#define ILI9341_GLYPH_CACHE   256    ///< Rasterized glyphs kept by drawText()
+
+#define ILI9341_CAL_MIN_HZ    1000000   ///< calibrateClock() starting clock, also used for readback
+#define ILI9341_CAL_MAX_HZ    80000000  ///< calibrateClock() upper limit
+#define ILI9341_CAL_STEP      125       ///< Clock increase per calibration step, in percent
+#define ILI9341_CAL_PASSES    3         ///< Test patterns checked per calibration step
+#define ILI9341_CAL_W         32        ///< Width of the calibration area at the top-left
+#define ILI9341_CAL_H         8         ///< Height of the calibration area
+#define ILI9341_READ_HZ       6000000   ///< Default readRect() clock, RAMRD needs a 150ns cycle
+
 #define ILI9341_NOP        0x00      ///< No-op register
 #define ILI9341_SWRESET    0x01      ///< Software reset register
 #define ILI9341_RDDID      0x04      ///< Read display identification information
@@ -88,6 +114,7 @@
 #define ILI9341_RAMRD      0x2E      ///< Memory Read
 
 #define ILI9341_PTLAR      0x30      ///< Partial Area
+#define ILI9341_VSCRDEF    0x33      ///< Vertical Scrolling Definition
 #define ILI9341_MADCTL     0x36      ///< Memory Access Control
 #define ILI9341_VSCRSADD   0x37      ///< Vertical Scrolling Start Address
 #define ILI9341_PIXFMT     0x3A      ///< COLMOD: Pixel Format Set
@@ -138,16 +165,144 @@
 #define ILI9341_PINK        0xFC18      ///< 255, 128, 192
 
 
+#ifndef ILI9341_STATS
+#define ILI9341_STATS 1              ///< Set to 0 to compile the hot-path counters out
+#endif
+
+/// Public API functions counted in ILI9341_Stats::calls
+#define ILI9341_API_LIST(X) \
+    X(begin) X(end) X(setRotation) X(invertDisplay) X(scrollTo) \
+    X(setAddrWindow) X(pushColor) X(writePixel) X(writePixels) X(writeColor) \
+    X(writeFillRect) X(writeFastVLine) X(writeFastHLine) \
+    X(drawPixel) X(drawFastVLine) X(drawFastHLine) X(fillRect) X(drawRGBBitmap) \
+    X(readcommand8) X(flush) X(present) X(setScrollMargins) X(scrollAdvance) \
+    X(drawFrame) X(drawText) X(drawWireBitmap) X(setClock) X(calibrateClock) \
+    X(readRect) X(drawList) X(drawLine) X(drawCircle) X(fillCircle) \
+    X(drawRoundRect) X(fillRoundRect) X(drawTriangle) X(fillTriangle) \
+    X(drawPolygon) X(fillPolygon) X(blendRect) X(blendMask) X(blendRGBA) \
+    X(drawPackedBitmap)
+
+#define ILI9341_API_ENUM(name) ILI9341_API_##name,
+/// Index into ILI9341_Stats::calls
+enum ILI9341_Api {
+    ILI9341_API_LIST(ILI9341_API_ENUM)
+    ILI9341_API_COUNT
+};
+
+/// Driver counters, see Adafruit_ILI9341::stats()
+struct ILI9341_Stats {
+    uint64_t calls[ILI9341_API_COUNT]; ///< Calls per public API, nested calls included
+    uint64_t commands;          ///< Command bytes sent (DC low)
+    uint64_t payloadBytes;      ///< Parameter and pixel bytes sent (DC high)
+    uint64_t readBytes;         ///< Bytes read back
+    uint64_t dcToggles;         ///< Changes of the DC line
+    uint64_t csToggles;         ///< Changes of the CS line
+    uint64_t transportCalls;    ///< Calls into the ILI9341_Transport
+    uint64_t transportNs;       ///< Time inside the transport, when timing is on
+    uint64_t glyphHits;         ///< drawText() glyphs found in the cache
+    uint64_t glyphMisses;       ///< drawText() glyphs rasterized
+};
+
+/// Screen rectangle
+struct ILI9341_Rect {
+    int16_t x;  ///< Left column
+    int16_t y;  ///< Top row
+    int16_t w;  ///< Width in pixels
+    int16_t h;  ///< Height in pixels
+};
+
+/// Polygon corner
+struct ILI9341_Point {
+    int16_t x;  ///< Column
+    int16_t y;  ///< Row
+};
+
+/// Glyph rasterized to wire-order RGB565 for one foreground/background pair
+struct ILI9341_Glyph {
+    const ILI9341_Font *font;   ///< Font the glyph came from, NULL when unused
+    uint16_t fg;                ///< Foreground color
+    uint16_t bg;                ///< Background color
+    uint8_t  ch;                ///< Character
+    uint8_t  pixels[ILI9341_FONT_MAX_WIDTH * ILI9341_FONT_MAX_HEIGHT * 2]; ///< Rows of width + spacing pixels
+};
+
 /// Class to manage hardware interface with ILI9341 chipset (also seems to work with ILI9340)
 class Adafruit_ILI9341 {
     public:
-        Adafruit_ILI9341(){}
+        Adafruit_ILI9341(ILI9341_Transport *bus) : _bus(bus), _readHz(ILI9341_READ_HZ),
+                             _width(ILI9341_TFTWIDTH), _height(ILI9341_TFTHEIGHT), _rotation(0),
+                             _initMicros(0),
+                             _stats(), _statsTiming(false), _csLevel(true), _dcLevel(true),
+                             _scrollTop(0), _scrollHeight(ILI9341_TFTHEIGHT), _scrollPos(0),
+                             _frameDiff(false), _tileHashValid(false),
+                             _font(&ILI9341_Font5x7), _glyphs(NULL), _record(NULL),
+                             _span(), _spanColor(0), _polyX(NULL), _polyXSize(0),
+                             _caset(0), _paset(0), _casetValid(false), _pasetValid(false),
+                             _ramwrActive(false), _ramwrPos(0),
+                             _pool(ILI9341_POOL_BUFFERS, ILI9341_PIXBUF_PIXELS * 2),
+                             _colorbuf(NULL), _colorbufBytes(0), _colorbufColor(0),
+                             _fb(NULL), _fbPos(0), _ndirty(0),
+                             _front(NULL), _sendBuf(NULL), _frontStride(0), _nfrontDirty(0),
+                             _flushPending(false), _flushStop(false),
+                             _txDepth(0), _txBus(false), _busDepth(0) {}
+        ~Adafruit_ILI9341();
 
-		bool	begin(void);
+		bool	begin(const uint8_t *initTable = NULL);
         void	end(void);
         void	setRotation(uint8_t r);
         void	invertDisplay(bool i);
         void	scrollTo(uint16_t y);
+        void	setScrollMargins(uint16_t top, uint16_t bottom);
+        uint16_t	scrollAdvance(uint16_t lines);
+        uint16_t	scrollPosition(void) const { return _scrollPos; }
+        uint32_t	initTime(void) const { return _initMicros; }
+
+        // SPI clock
+        bool      setClock(uint32_t hz);
+        uint32_t  clock(void) const { return _bus->clock(); }
+        uint32_t  calibrateClock(uint32_t minHz = ILI9341_CAL_MIN_HZ,
+                                 uint32_t maxHz = ILI9341_CAL_MAX_HZ);
+        void      setReadClock(uint32_t hz) { _readHz = hz; }
+
+        // GRAM readback
+        void      readRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t *buf);
+
+        // Instrumentation
+        ILI9341_Stats stats(void);
+        void      resetStats(void);
+        void      setStatsTiming(bool enable);
+        void      dumpStats(FILE *f = stdout);
+        ILI9341_PoolStats poolStats(void) const { return _pool.stats(); }
+        int16_t	width(void) const  { return _width; }
+        int16_t	height(void) const { return _height; }
+
+        // Shadow framebuffer
+        bool      enableFramebuffer(bool enable = true);
+        uint16_t *framebuffer(void) { return _fb; }
+        void      markDirty(int16_t x, int16_t y, int16_t w, int16_t h);
+        void      flush(void);
+
+        // Double buffering with a background flush thread
+        bool      enableAsyncFlush(bool enable = true);
+        void      present(void);
+        void      waitFlush(void);
+        static void flushAll(Adafruit_ILI9341 *const *panels, uint8_t n);
+
+        // Full-frame differencing
+        void      enableFrameDiff(bool enable = true);
+        void      drawFrame(const uint16_t *frame);
+
+        // Text
+        bool      setFont(const ILI9341_Font *font);
+        int16_t   textWidth(const char *str, uint8_t size = 1) const;
+        void      drawText(int16_t x, int16_t y, const char *str,
+                    uint16_t fg, uint16_t bg, uint8_t size = 1);
+
+        // Display lists
+        void      beginRecording(ILI9341_DisplayList *list);
+        void      endRecording(void);
+        bool      recording(void) const { return _record != NULL; }
+        void      drawList(const ILI9341_DisplayList &list);
         
         // Transaction API
         void      setAddrWindow(uint16_t x, uint16_t y, uint16_t w, uint16_t h);
@@ -160,14 +315,50 @@ class Adafruit_ILI9341 {
         void      writeFillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color);
         void      writeFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color);
         void      writeFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color);
+        void      writeLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint16_t color);
 
         // Required Non-Transaction (Includes transaction code)
         void      drawPixel(int16_t x, int16_t y, uint16_t color);
         void      drawFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color);
         void      drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color);
         void      fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color);
+        void      drawLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint16_t color);
+        void      drawCircle(int16_t x0, int16_t y0, int16_t r, uint16_t color);
+        void      fillCircle(int16_t x0, int16_t y0, int16_t r, uint16_t color);
+        void      drawRoundRect(int16_t x, int16_t y, int16_t w, int16_t h,
+                    int16_t r, uint16_t color);
+        void      fillRoundRect(int16_t x, int16_t y, int16_t w, int16_t h,
+                    int16_t r, uint16_t color);
+        void      drawTriangle(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
+                    int16_t x2, int16_t y2, uint16_t color);
+        void      fillTriangle(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
+                    int16_t x2, int16_t y2, uint16_t color);
+        void      drawPolygon(const ILI9341_Point *pts, uint16_t n, uint16_t color);
+        void      fillPolygon(const ILI9341_Point *pts, uint16_t n, uint16_t color);
         void      drawRGBBitmap(int16_t x, int16_t y,
                     uint16_t *pcolors, int16_t w, int16_t h);
+        void      drawRGBBitmap(int16_t x, int16_t y, const uint8_t *src,
+                    ILI9341_PixelFormat fmt, int16_t w, int16_t h);
+        void      drawWireBitmap(int16_t x, int16_t y,
+                    const uint8_t *wire, int16_t w, int16_t h);
+        /// Draw a mapped asset file with its top-left corner at (x, y)
+        void      drawAsset(int16_t x, int16_t y, const ILI9341_Asset &asset) {
+                    drawWireBitmap(x, y, asset.pixels(), asset.width(), asset.height());
+                  }
+        bool      drawPackedBitmap(int16_t x, int16_t y, const uint8_t *data,
+                    uint32_t len, int16_t w, int16_t h);
+        /// Draw a mapped packed asset file with its top-left corner at (x, y), false if its data is short
+        bool      drawAsset(int16_t x, int16_t y, const ILI9341_PackedAsset &asset) {
+                    return drawPackedBitmap(x, y, asset.data(), asset.size(), asset.width(), asset.height());
+                  }
+
+        // Alpha blending
+        void      blendRect(int16_t x, int16_t y, int16_t w, int16_t h,
+                    uint16_t color, uint8_t alpha);
+        void      blendMask(int16_t x, int16_t y, const uint8_t *mask,
+                    int16_t w, int16_t h, uint16_t color);
+        void      blendRGBA(int16_t x, int16_t y, const uint8_t *rgba,
+                    int16_t w, int16_t h);
 
 
         uint16_t  color565(uint8_t r, uint8_t g, uint8_t b);
@@ -181,10 +372,119 @@ class Adafruit_ILI9341 {
         void 		spiWrite16(uint16_t s);
         void 		spiWrite32(uint32_t w);
         void 		spiWritePixels(uint16_t *c, uint32_t l);
+        void 		spiWriteColor(uint16_t color, uint32_t l);
+        void 		spiWriteRect(const uint16_t *c, uint32_t w, uint32_t h, uint32_t stride);
         
 	private:
-		uint32_t	_width;
-		uint32_t 	_height;
+		void		runInitTable(const uint8_t *table);
+		void		startDraw(void);
+		void		endDraw(void);
+		void		writeSpan(int16_t x0, int16_t x1, int16_t y, uint16_t color);
+		void		flushSpans(void);
+		void		blendArea(int16_t x, int16_t y, int16_t w, int16_t h, uint8_t mode,
+		                      uint16_t color, uint8_t alpha, const uint8_t *src, int32_t srcStride);
+		bool		clipBitmap(int16_t &x, int16_t &y, int16_t &w, int16_t &h,
+		                       int16_t &bx, int16_t &by);
+		void		writeWire(uint8_t *buf, uint32_t len);
+		ILI9341_Glyph	*glyph(uint8_t ch, uint16_t fg, uint16_t bg);
+		void		blitRect(const uint16_t *src, int32_t stride,
+		                     int16_t x, int16_t y, int16_t w, int16_t h);
+		void		writeAddrWindow(uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+		void		writeWindowRegs(uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+		void		readRaw(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *buf);
+		bool		clockPasses(uint32_t hz, uint32_t readHz);
+		void		sendRects(const uint16_t *buf, int16_t stride,
+		                      const ILI9341_Rect *rects, uint8_t n);
+		void		flushThread(void);
+		void		startFlushThread(void);
+		void		stopFlushThread(void);
+		void		beginBus(void);
+		void		endBus(void);
+		void		busCS(bool high);
+		void		busDC(bool data);
+		void		busReset(bool high);
+		void		busWrite(uint8_t b);
+		void		busWrite(const uint8_t *buf, uint32_t len);
+		uint8_t		busRead(void);
+		void		busRead(uint8_t *buf, uint32_t len);
+		void		busDelay(uint32_t ms);
+		void		fbWrite(const uint16_t *colors, uint32_t len, bool repeat);
+		void		rotateFramebuffer(uint8_t from);
+
+		ILI9341_Transport *_bus;        ///< SPI bus and control lines
+		uint32_t	_readHz;            ///< Highest clock readRect() uses
+		int16_t		_width;
+		int16_t 	_height;
+		uint8_t		_rotation;                            ///< Current setRotation() value
+		uint32_t	_initMicros;                          ///< Duration of the last begin()
+		ILI9341_Stats _stats;
+		bool		_statsTiming;                         ///< Time transport calls into _stats
+		bool		_csLevel;                             ///< Last CS level sent, for toggle counts
+		bool		_dcLevel;                             ///< Last DC level sent, for toggle counts
+		uint16_t	_scrollTop;                           ///< Fixed rows above the scroll area
+		uint16_t	_scrollHeight;                        ///< Rows in the scroll area
+		uint16_t	_scrollPos;                           ///< Last VSCRSADD value sent
+
+		bool		_frameDiff;                           ///< Full-size bitmaps go through drawFrame()
+		bool		_tileHashValid;                       ///< _tileHash describes what the panel shows
+		uint64_t	_tileHash[ILI9341_TILE_COUNT];        ///< Hash of each tile of the last frame
+
+		const ILI9341_Font	*_font;                       ///< Font used by drawText()
+		ILI9341_Glyph	*_glyphs;                         ///< ILI9341_GLYPH_CACHE slots, allocated on first use
+
+		ILI9341_DisplayList *_record;                     ///< List receiving draw calls, NULL when drawing
+
+		ILI9341_Rect _span;                               ///< Spans joined by writeSpan(), h == 0 when empty
+		uint16_t	_spanColor;
+		int16_t		*_polyX;                              ///< fillPolygon() edge crossings of one row
+		uint16_t	_polyXSize;                           ///< Entries allocated in _polyX
+
+		uint32_t	_caset;                               ///< Last CASET sent (start << 16 | end)
+		uint32_t	_paset;                               ///< Last PASET sent (start << 16 | end)
+		bool		_casetValid;                          ///< _caset matches the panel
+		bool		_pasetValid;                          ///< _paset matches the panel
+		bool		_ramwrActive;                         ///< RAMWR in progress, _ramwrPos is exact
+		uint32_t	_ramwrPos;                            ///< Pixels written since RAMWR
+
+		ILI9341_BufferPool _pool;                         ///< Staging buffers for bulk transfers
+		uint8_t		*_colorbuf;                           ///< Pool buffer kept by spiWriteColor, NULL until first use
+		uint32_t	_colorbufBytes;                       ///< Leading bytes of _colorbuf holding _colorbufColor
+		uint16_t	_colorbufColor;
+
+		uint16_t	*_fb;                                 ///< Shadow framebuffer, NULL when disabled
+		ILI9341_Rect _fbWin;                              ///< Address window for framebuffer writes
+		uint32_t	_fbPos;                               ///< Pixels written into _fbWin so far
+		ILI9341_Rect _dirty[ILI9341_MAX_DIRTY];           ///< Regions changed since the last flush
+		uint8_t		_ndirty;
+
+		uint16_t	*_front;                              ///< Buffer owned by the flush thread, NULL when synchronous
+		const uint16_t *_sendBuf;                         ///< What the thread sends: _front, or _fb for flushAll()
+		int16_t		_frontStride;                         ///< Row length of _sendBuf
+		ILI9341_Rect _frontDirty[ILI9341_MAX_DIRTY];      ///< Regions of _sendBuf still to send
+		uint8_t		_nfrontDirty;
+		bool		_flushPending;                        ///< _sendBuf has regions the thread has not sent
+		bool		_flushStop;                           ///< Asks the flush thread to exit
+		std::thread	_flushThread;
+		std::mutex	_flushLock;                           ///< Guards the _flush* and _front* members
+		std::condition_variable _flushCond;
+
+		std::recursive_mutex _apiLock;                    ///< Held by public calls and write transactions
+		uint32_t	_txDepth;                             ///< Nesting of startWrite() calls
+		bool		_txBus;                               ///< The outermost startWrite() selected the panel
+		uint32_t	_busDepth;                            ///< Nesting of beginBus() calls
+};
+
+/// Holds a write transaction on a panel for the lifetime of the object
+class ILI9341_Transaction {
+    public:
+        explicit ILI9341_Transaction(Adafruit_ILI9341 &tft) : _tft(tft) { _tft.startWrite(); }
+        ~ILI9341_Transaction() { _tft.endWrite(); }
+
+    private:
+        ILI9341_Transaction(const ILI9341_Transaction &);
+        ILI9341_Transaction &operator=(const ILI9341_Transaction &);
+
+        Adafruit_ILI9341 &_tft;
 };
 
 #endif
@@ -0,0 +1,394 @@
+/*!
+* @file asset.cpp
+*
+* Memory-mapped RGB565 image assets, see asset.h for the file formats.
+*
+*/
+
+#include <stdio.h>			//printf
+#include <string.h>			//memcmp
+#include <fcntl.h>			//open
+#include <unistd.h>			//close
+#include <sys/mman.h>		//mmap
+#include <sys/stat.h>		//fstat
+
+#include "asset.h"
+
+
+/**************************************************************************/
+/*!
+    @brief  Map a whole file read-only
+    @param  path    File to map
+    @param  header  Smallest valid file size
+    @param  size    Set to the number of bytes mapped
+    @return The mapping, or NULL if the file cannot be mapped or is too short
+*/
+/**************************************************************************/
+static const uint8_t *mapFile(const char *path, size_t header, size_t &size) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Can't open asset %s\n", path);
+        return NULL;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) < 0) || ((size_t)st.st_size < header)) {
+        printf("Asset %s too short\n", path);
+        ::close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);    //The mapping keeps the file referenced
+    if (map == MAP_FAILED) {
+        printf("Can't map asset %s\n", path);
+        return NULL;
+    }
+    size = st.st_size;
+    return (const uint8_t *)map;
+}
+
+/**************************************************************************/
+/*!
+    @brief  Map an asset file. Any file already open is closed first.
+    @param  path  File to map
+    @return False if the file cannot be mapped or its header is invalid
+*/
+/**************************************************************************/
+bool ILI9341_Asset::open(const char *path) {
+    close();
+
+    size_t size;
+    const uint8_t *p = mapFile(path, ILI9341_ASSET_HEADER_SIZE, size);
+    if (!p) return false;
+
+    int16_t w = p[4] | (p[5] << 8);
+    int16_t h = p[6] | (p[7] << 8);
+    if (memcmp(p, ILI9341_ASSET_MAGIC, 4) || (w < 0) || (h < 0) ||
+        (size < ILI9341_ASSET_HEADER_SIZE + (size_t)w * h * 2)) {
+        printf("Asset %s has a bad header\n", path);
+        munmap((void *)p, size);
+        return false;
+    }
+
+    //Start reading the pixels in now so the first draw doesn't fault them in
+    madvise((void *)p, size, MADV_WILLNEED);
+
+    _map     = p;
+    _mapSize = size;
+    _width   = w;
+    _height  = h;
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    @brief  Unmap the asset
+*/
+/**************************************************************************/
+void ILI9341_Asset::close(void) {
+    if (_map) {
+        munmap((void *)_map, _mapSize);
+    }
+    _map     = NULL;
+    _mapSize = 0;
+    _width   = _height = 0;
+}
+
+/**************************************************************************/
+/*!
+    @brief  Write RGB565 pixels out as an asset file
+    @param  path    File to create
+    @param  colors  Pixels in native RGB565, w per row
+    @param  w       Width in pixels
+    @param  h       Height in pixels
+    @return False on any I/O error
+*/
+/**************************************************************************/
+bool ILI9341_Asset::save(const char *path, const uint16_t *colors, int16_t w, int16_t h) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        printf("Can't create asset %s\n", path);
+        return false;
+    }
+    uint8_t header[ILI9341_ASSET_HEADER_SIZE];
+    memcpy(header, ILI9341_ASSET_MAGIC, 4);
+    header[4] = w;
+    header[5] = w >> 8;
+    header[6] = h;
+    header[7] = h >> 8;
+    bool ok = fwrite(header, sizeof(header), 1, f) == 1;
+
+    uint8_t row[ILI9341_ASSET_SAVE_CHUNK * 2];
+    for (int32_t y=0; ok && (y<h); y++) {
+        for (int32_t x=0; ok && (x<w); ) {
+            int32_t n = w - x;
+            if (n > ILI9341_ASSET_SAVE_CHUNK) n = ILI9341_ASSET_SAVE_CHUNK;
+            for (int32_t i=0; i<n; i++) {
+                uint16_t c = colors[(int32_t)y * w + x + i];
+                row[i*2]   = c >> 8;
+                row[i*2+1] = c;
+            }
+            ok = fwrite(row, n * 2, 1, f) == 1;
+            x += n;
+        }
+    }
+    if (fclose(f) || !ok) {
+        printf("Can't write asset %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Packed assets
+ * */
+
+/// Recent-color table slot of an RGB565 color
+static inline uint8_t packedHash(uint16_t c) {
+    return ((c >> 11) * 3 + ((c >> 5) & 0x3F) * 5 + (c & 0x1F) * 7) % ILI9341_PACKED_INDEX;
+}
+
+/**************************************************************************/
+/*!
+    @brief  Map a packed asset file. Any file already open is closed first.
+    @param  path  File to map
+    @return False if the file cannot be mapped or its header is invalid
+*/
+/**************************************************************************/
+bool ILI9341_PackedAsset::open(const char *path) {
+    close();
+
+    size_t size;
+    const uint8_t *p = mapFile(path, ILI9341_PACKED_HEADER_SIZE, size);
+    if (!p) return false;
+
+    int16_t w = p[4] | (p[5] << 8);
+    int16_t h = p[6] | (p[7] << 8);
+    uint32_t len = p[8] | (p[9] << 8) | (p[10] << 16) | ((uint32_t)p[11] << 24);
+    if (memcmp(p, ILI9341_PACKED_MAGIC, 4) || (w < 0) || (h < 0) ||
+        (size - ILI9341_PACKED_HEADER_SIZE < len)) {
+        printf("Asset %s has a bad header\n", path);
+        munmap((void *)p, size);
+        return false;
+    }
+
+    madvise((void *)p, size, MADV_WILLNEED);
+
+    _map     = p;
+    _mapSize = size;
+    _width   = w;
+    _height  = h;
+    _size    = len;
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    @brief  Unmap the asset
+*/
+/**************************************************************************/
+void ILI9341_PackedAsset::close(void) {
+    if (_map) {
+        munmap((void *)_map, _mapSize);
+    }
+    _map     = NULL;
+    _mapSize = 0;
+    _width   = _height = 0;
+    _size    = 0;
+}
+
+/**************************************************************************/
+/*!
+    @brief  Pack RGB565 pixels into the opcodes of a packed asset
+    @param  colors  Pixels in native RGB565, w per row
+    @param  w       Width in pixels
+    @param  h       Height in pixels
+    @param  out     Receives the opcodes, replacing its contents
+*/
+/**************************************************************************/
+void ILI9341_PackedAsset::encode(const uint16_t *colors, int16_t w, int16_t h,
+        std::vector<uint8_t> &out) {
+    uint16_t index[ILI9341_PACKED_INDEX] = { 0 };
+    uint16_t prev = 0;
+    uint32_t run  = 0;
+    uint32_t n    = (w > 0 && h > 0) ? (uint32_t)w * h : 0;
+    out.clear();
+
+    for (uint32_t i=0; i<=n; i++) {
+        if ((i < n) && (colors[i] == prev) && (run < 65536)) {
+            run++;
+            continue;
+        }
+        if (run > 62) {
+            out.push_back(0xFF);
+            out.push_back(run - 1);
+            out.push_back((run - 1) >> 8);
+        } else if (run) {
+            out.push_back(0xC0 | (run - 1));
+        }
+        run = 0;
+        if (i == n) break;
+
+        uint16_t c = colors[i];
+        if (c == prev) { // A run just hit 65536, start the next one
+            run = 1;
+            continue;
+        }
+        uint8_t slot = packedHash(c);
+        if (index[slot] == c) {
+            out.push_back(slot);
+        } else {
+            index[slot] = c;
+            // Channel steps, wrapped to signed
+            int dr = (((c >> 11) - (prev >> 11) + 16) & 0x1F) - 16;
+            int dg = ((((c >> 5) & 0x3F) - ((prev >> 5) & 0x3F) + 32) & 0x3F) - 32;
+            int db = (((c & 0x1F) - (prev & 0x1F) + 16) & 0x1F) - 16;
+            if ((dr >= -2) && (dr <= 1) && (dg >= -2) && (dg <= 1) && (db >= -2) && (db <= 1)) {
+                out.push_back(0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+            } else if ((dr - dg >= -8) && (dr - dg <= 7) && (db - dg >= -8) && (db - dg <= 7)) {
+                out.push_back(0x80 | (dg + 32));
+                out.push_back(((dr - dg + 8) << 4) | (db - dg + 8));
+            } else {
+                out.push_back(0xFE);
+                out.push_back(c >> 8);
+                out.push_back(c);
+            }
+        }
+        prev = c;
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief  Write RGB565 pixels out as a packed asset file
+    @param  path    File to create
+    @param  colors  Pixels in native RGB565, w per row
+    @param  w       Width in pixels
+    @param  h       Height in pixels
+    @return False on any I/O error
+*/
+/**************************************************************************/
+bool ILI9341_PackedAsset::save(const char *path, const uint16_t *colors, int16_t w, int16_t h) {
+    std::vector<uint8_t> ops;
+    encode(colors, w, h, ops);
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        printf("Can't create asset %s\n", path);
+        return false;
+    }
+    uint32_t len = ops.size();
+    uint8_t header[ILI9341_PACKED_HEADER_SIZE];
+    memcpy(header, ILI9341_PACKED_MAGIC, 4);
+    header[4]  = w;
+    header[5]  = w >> 8;
+    header[6]  = h;
+    header[7]  = h >> 8;
+    header[8]  = len;
+    header[9]  = len >> 8;
+    header[10] = len >> 16;
+    header[11] = len >> 24;
+    bool ok = fwrite(header, sizeof(header), 1, f) == 1;
+    if (ok && len) {
+        ok = fwrite(ops.data(), len, 1, f) == 1;
+    }
+    if (fclose(f) || !ok) {
+        printf("Can't write asset %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    @brief  Start decoding an opcode stream at its first pixel
+    @param  data  Opcodes, such as ILI9341_PackedAsset::data()
+    @param  len   Number of opcode bytes
+*/
+/**************************************************************************/
+ILI9341_AssetDecoder::ILI9341_AssetDecoder(const uint8_t *data, uint32_t len) :
+        _p(data), _end(data + len), _color(0), _run(0), _index() {}
+
+/**************************************************************************/
+/*!
+    @brief  Read the next opcode into _color and _run
+    @return False at the end of the data or on a truncated opcode
+*/
+/**************************************************************************/
+bool ILI9341_AssetDecoder::next(void) {
+    if (_p >= _end) return false;
+    uint8_t b = *_p++;
+    uint16_t c = _color;
+    _run = 1;
+    if (b < 0x40) {         // INDEX
+        _color = _index[b];
+        return true;
+    } else if (b < 0x80) {  // DIFF
+        c = ((((c >> 11) + ((b >> 4) & 3) - 2) & 0x1F) << 11) |
+            (((((c >> 5) & 0x3F) + ((b >> 2) & 3) - 2) & 0x3F) << 5) |
+            (((c & 0x1F) + (b & 3) - 2) & 0x1F);
+    } else if (b < 0xC0) {  // LUMA
+        if (_p >= _end) return false;
+        int dg = (b & 0x3F) - 32;
+        int dr = dg + (*_p >> 4) - 8;
+        int db = dg + (*_p & 0x0F) - 8;
+        _p++;
+        c = ((((c >> 11) + dr) & 0x1F) << 11) |
+            (((((c >> 5) & 0x3F) + dg) & 0x3F) << 5) |
+            (((c & 0x1F) + db) & 0x1F);
+    } else if (b < 0xFE) {  // RUN
+        _run = (b & 0x3F) + 1;
+        return true;
+    } else {                // RGB and RUN16
+        if (_end - _p < 2) return false;
+        if (b == 0xFF) {
+            _run = (_p[0] | (_p[1] << 8)) + 1;
+            _p += 2;
+            return true;
+        }
+        c = (_p[0] << 8) | _p[1];
+        _p += 2;
+    }
+    _index[packedHash(c)] = c;
+    _color = c;
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    @brief  Move past pixels without producing them
+    @param  n  Number of pixels
+    @return False if the data ends first
+*/
+/**************************************************************************/
+bool ILI9341_AssetDecoder::skip(uint32_t n) {
+    while (n) {
+        if (!_run && !next()) return false;
+        uint32_t k = (_run < n) ? _run : n;
+        _run -= k;
+        n    -= k;
+    }
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    @brief  Produce the next pixels in wire order (big endian RGB565)
+    @param  wire  Receives 2 * n bytes
+    @param  n     Number of pixels
+    @return False if the data ends first
+*/
+/**************************************************************************/
+bool ILI9341_AssetDecoder::decode(uint8_t *wire, uint32_t n) {
+    while (n) {
+        if (!_run && !next()) return false;
+        uint32_t k = (_run < n) ? _run : n;
+        uint8_t hi = _color >> 8, lo = _color;
+        for (uint32_t i=0; i<k; i++) {
+            *wire++ = hi;
+            *wire++ = lo;
+        }
+        _run -= k;
+        n    -= k;
+    }
+    return true;
+}
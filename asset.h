@@ -0,0 +1,140 @@
+/*!
+* @file asset.h
+*
+* Memory-mapped RGB565 image assets.
+*
+* An asset file is an 8 byte header followed by the pixels, row by row, in
+* wire order (big endian RGB565, high byte first), exactly as they are sent
+* to the ILI9341:
+*
+*   offset 0  "R565"      magic
+*   offset 4  uint16_t    width, little endian
+*   offset 6  uint16_t    height, little endian
+*   offset 8  width * height * 2 bytes of pixels
+*
+* The file is mapped read-only, so the pixels are shared with the page
+* cache and drawn straight from the mapping without a heap copy.
+*
+* A packed asset holds the same pixels as a stream of byte opcodes in the
+* spirit of QOI, adapted to RGB565. Flat-color artwork typically shrinks
+* 5-20x:
+*
+*   offset 0  "Q565"      magic
+*   offset 4  uint16_t    width, little endian
+*   offset 6  uint16_t    height, little endian
+*   offset 8  uint32_t    opcode bytes, little endian
+*   offset 12 opcodes, covering width * height pixels row by row
+*
+*   00iiiiii              INDEX  color in slot i of the recent-color table
+*   01rrggbb              DIFF   previous color + r, g, b, each stored +2
+*   10gggggg rrrrbbbb     LUMA   green + g (stored +32), red and blue +
+*                                the green step + r, b (stored +8)
+*   11nnnnnn              RUN    previous color 1 + n times, n < 62
+*   11111110 hi lo        RGB    color, big endian
+*   11111111 lo hi        RUN16  previous color 1 + n times, n < 65536
+*
+* Channel steps wrap (5, 6 and 5 bits). Decoding starts from black with an
+* all-black table; every color produced by DIFF, LUMA or RGB is stored in
+* slot (r * 3 + g * 5 + b * 7) % 64. Runs may continue across rows, so a
+* decoder streams the image in row order and skips clipped pixels without
+* producing them.
+*
+*/
+
+#ifndef _ILI9341_ASSET_H_
+#define _ILI9341_ASSET_H_
+
+#include <stdint.h>			//uint_t
+#include <stddef.h>			//size_t
+
+#include <vector>
+
+
+#define ILI9341_ASSET_MAGIC       "R565"    ///< First four bytes of an asset file
+#define ILI9341_ASSET_HEADER_SIZE 8         ///< Bytes before the first pixel
+#define ILI9341_ASSET_SAVE_CHUNK  256       ///< Pixels converted per write by save()
+
+#define ILI9341_PACKED_MAGIC       "Q565"   ///< First four bytes of a packed asset file
+#define ILI9341_PACKED_HEADER_SIZE 12       ///< Bytes before the first opcode
+#define ILI9341_PACKED_INDEX       64       ///< Slots in the recent-color table
+
+
+/// Read-only mapping of an RGB565 asset file
+class ILI9341_Asset {
+    public:
+        ILI9341_Asset() : _map(NULL), _mapSize(0), _width(0), _height(0) {}
+        ~ILI9341_Asset() { close(); }
+
+        bool            open(const char *path);
+        void            close(void);
+
+        /// True while a file is mapped
+        bool            isOpen(void) const  { return _map != NULL; }
+        int16_t         width(void) const   { return _width; }
+        int16_t         height(void) const  { return _height; }
+        /// Wire-order pixel bytes, 2 * width per row
+        const uint8_t  *pixels(void) const  { return _map + ILI9341_ASSET_HEADER_SIZE; }
+
+        static bool     save(const char *path, const uint16_t *colors, int16_t w, int16_t h);
+
+    private:
+        ILI9341_Asset(const ILI9341_Asset &);
+        ILI9341_Asset &operator=(const ILI9341_Asset &);
+
+        const uint8_t  *_map;       ///< Start of the mapping, at the header
+        size_t          _mapSize;   ///< Bytes mapped
+        int16_t         _width;     ///< Image width in pixels
+        int16_t         _height;    ///< Image height in pixels
+};
+
+/// Read-only mapping of a packed (run-length and QOI-style) RGB565 asset file
+class ILI9341_PackedAsset {
+    public:
+        ILI9341_PackedAsset() : _map(NULL), _mapSize(0), _width(0), _height(0), _size(0) {}
+        ~ILI9341_PackedAsset() { close(); }
+
+        bool            open(const char *path);
+        void            close(void);
+
+        /// True while a file is mapped
+        bool            isOpen(void) const  { return _map != NULL; }
+        int16_t         width(void) const   { return _width; }
+        int16_t         height(void) const  { return _height; }
+        /// Opcode stream, size() bytes
+        const uint8_t  *data(void) const    { return _map + ILI9341_PACKED_HEADER_SIZE; }
+        uint32_t        size(void) const    { return _size; }
+
+        static void     encode(const uint16_t *colors, int16_t w, int16_t h,
+                               std::vector<uint8_t> &out);
+        static bool     save(const char *path, const uint16_t *colors, int16_t w, int16_t h);
+
+    private:
+        ILI9341_PackedAsset(const ILI9341_PackedAsset &);
+        ILI9341_PackedAsset &operator=(const ILI9341_PackedAsset &);
+
+        const uint8_t  *_map;       ///< Start of the mapping, at the header
+        size_t          _mapSize;   ///< Bytes mapped
+        int16_t         _width;     ///< Image width in pixels
+        int16_t         _height;    ///< Image height in pixels
+        uint32_t        _size;      ///< Opcode bytes after the header
+};
+
+/// Streaming decoder for the opcodes of a packed asset
+class ILI9341_AssetDecoder {
+    public:
+        ILI9341_AssetDecoder(const uint8_t *data, uint32_t len);
+
+        bool            skip(uint32_t n);
+        bool            decode(uint8_t *wire, uint32_t n);
+
+    private:
+        bool            next(void);
+
+        const uint8_t  *_p;         ///< Next opcode byte
+        const uint8_t  *_end;       ///< End of the opcodes
+        uint16_t        _color;     ///< Last color produced
+        uint32_t        _run;       ///< Pixels of _color still to produce
+        uint16_t        _index[ILI9341_PACKED_INDEX]; ///< Recent colors by hash
+};
+
+#endif
@@ -0,0 +1,141 @@
+/*!
+* @file asset_pack.cpp
+*
+* Converts images to packed RGB565 assets (see asset.h) for
+* ILI9341_PackedAsset and Adafruit_ILI9341::drawAsset().
+*
+* Input is a plain asset file ("R565") or a binary PPM (P6, 8 bits per
+* channel), so artwork can be exported from most image tools with e.g.
+* `convert icon.png icon.ppm`. With -u a packed asset is unpacked back to
+* a plain asset, which is handy to check the round trip.
+*
+* Build on any Linux box:
+*   g++ -O2 -o asset_pack asset_pack.cpp asset.cpp
+*
+* Usage: asset_pack [-u] input output
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "asset.h"
+
+
+/// Read the next PPM header number, skipping whitespace and comments
+static bool ppmNumber(FILE *f, int &v) {
+    int c;
+    for (;;) {
+        c = fgetc(f);
+        if (c == '#') {
+            while ((c != '\n') && (c != EOF)) c = fgetc(f);
+        } else if ((c != ' ') && (c != '\t') && (c != '\r') && (c != '\n')) {
+            break;
+        }
+    }
+    if ((c < '0') || (c > '9')) return false;
+    v = 0;
+    while ((c >= '0') && (c <= '9')) {
+        v = v * 10 + (c - '0');
+        c = fgetc(f);
+    }
+    return true;    // The single whitespace after maxval is consumed here too
+}
+
+/// Load a binary PPM as native RGB565
+static bool loadPpm(const char *path, std::vector<uint16_t> &colors, int16_t &w, int16_t &h) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        printf("Can't open %s\n", path);
+        return false;
+    }
+    int pw, ph, maxval;
+    bool ok = (fgetc(f) == 'P') && (fgetc(f) == '6') &&
+              ppmNumber(f, pw) && ppmNumber(f, ph) && ppmNumber(f, maxval) &&
+              (pw > 0) && (pw <= 32767) && (ph > 0) && (ph <= 32767) && (maxval == 255);
+    if (!ok) {
+        printf("%s is not an 8-bit binary PPM\n", path);
+        fclose(f);
+        return false;
+    }
+    std::vector<uint8_t> rgb((size_t)pw * ph * 3);
+    ok = fread(rgb.data(), rgb.size(), 1, f) == 1;
+    fclose(f);
+    if (!ok) {
+        printf("%s is truncated\n", path);
+        return false;
+    }
+    colors.resize((size_t)pw * ph);
+    for (size_t i=0; i<colors.size(); i++) {
+        const uint8_t *p = &rgb[i * 3];
+        colors[i] = ((p[0] & 0xF8) << 8) | ((p[1] & 0xFC) << 3) | (p[2] >> 3);
+    }
+    w = pw;
+    h = ph;
+    return true;
+}
+
+/// Load a plain asset as native RGB565
+static bool loadAsset(const char *path, std::vector<uint16_t> &colors, int16_t &w, int16_t &h) {
+    ILI9341_Asset asset;
+    if (!asset.open(path)) return false;
+    w = asset.width();
+    h = asset.height();
+    colors.resize((size_t)w * h);
+    const uint8_t *p = asset.pixels();
+    for (size_t i=0; i<colors.size(); i++, p+=2) {
+        colors[i] = (p[0] << 8) | p[1];
+    }
+    return true;
+}
+
+static int pack(const char *in, const char *out) {
+    std::vector<uint16_t> colors;
+    int16_t w, h;
+    char magic[4] = { 0 };
+    FILE *f = fopen(in, "rb");
+    if (f) {
+        if (fread(magic, sizeof(magic), 1, f) != 1) magic[0] = 0;
+        fclose(f);
+    }
+    bool ok = memcmp(magic, ILI9341_ASSET_MAGIC, 4) ? loadPpm(in, colors, w, h)
+                                                    : loadAsset(in, colors, w, h);
+    if (!ok || !ILI9341_PackedAsset::save(out, colors.data(), w, h)) {
+        return 1;
+    }
+    ILI9341_PackedAsset packed;
+    if (!packed.open(out)) return 1;
+    uint32_t raw = (uint32_t)w * h * 2;
+    printf("%dx%d: %u -> %u bytes (%.1fx)\n", w, h, raw, packed.size(),
+           packed.size() ? (double)raw / packed.size() : 0.0);
+    return 0;
+}
+
+static int unpack(const char *in, const char *out) {
+    ILI9341_PackedAsset packed;
+    if (!packed.open(in)) return 1;
+    int16_t w = packed.width(), h = packed.height();
+    std::vector<uint8_t> wire((size_t)w * h * 2);
+    ILI9341_AssetDecoder dec(packed.data(), packed.size());
+    if (!dec.decode(wire.data(), (uint32_t)w * h)) {
+        printf("%s ends early\n", in);
+        return 1;
+    }
+    std::vector<uint16_t> colors((size_t)w * h);
+    for (size_t i=0; i<colors.size(); i++) {
+        colors[i] = (wire[i*2] << 8) | wire[i*2+1];
+    }
+    return ILI9341_Asset::save(out, colors.data(), w, h) ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    bool u = (argc > 1) && !strcmp(argv[1], "-u");
+    if (argc != 3 + u) {
+        fprintf(stderr, "Usage: %s [-u] input output\n", argv[0]);
+        return 2;
+    }
+    return u ? unpack(argv[2], argv[3]) : pack(argv[1], argv[2]);
+}
@@ -0,0 +1,331 @@
+/*!
+* @file bench.cpp
+*
+* Benchmark for the ILI9341 draw primitives and transports.
+*
+* Runs fixed workloads (full-screen fill, random pixels, H/V lines, bitmap
+* blits, text-like small rects, status-screen text, a replayed display
+* list, gauge shapes, a translucent banner, a sprite moving over composed
+* layers, packed flat-color artwork, rotation changes, small rects queued by
+* several threads) and prints one JSON object per workload on stdout:
+*
+*   {"transport":"sim","workload":"fill_screen","frames":50,
+*    "pixels_per_s":...,"bytes_per_s":...,"transactions_per_frame":...,
+*    "p50_us":...,"p99_us":...}
+*
+* A frame is one pass of the workload. Latency percentiles are per frame.
+*
+* Build on any Linux box (simulated panel only):
+*   g++ -O2 -pthread -o bench bench.cpp Adafruit_ILI9341.cpp transport_sim.cpp \
+*       transport_spidev.cpp spi.c color_convert.cpp font.cpp asset.cpp \
+*       display_list.cpp command_queue.cpp blend.cpp compositor.cpp \
+*       buffer_pool.cpp
+* Add -DBENCH_BCM2835 transport_bcm2835.cpp -lbcm2835 on a Pi for the
+* bcm2835 transport.
+*
+* Usage: bench [sim|spidev|bcm2835] [frames]
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "Adafruit_ILI9341.h"
+#include "command_queue.h"
+#include "compositor.h"
+#include "transport_sim.h"
+#include "transport_spidev.h"
+#ifdef BENCH_BCM2835
+#include "transport_bcm2835.h"
+#endif
+
+
+/// Transport wrapper counting bytes and CS-framed transactions
+class CountingTransport : public ILI9341_Transport {
+    public:
+        CountingTransport(ILI9341_Transport *bus) : _bus(bus), bytes(0), transactions(0) {}
+
+        bool    begin(void)                 { return _bus->begin(); }
+        void    end(void)                   { _bus->end(); }
+        void    setCS(bool high)            { if (!high) transactions++; _bus->setCS(high); }
+        void    setDC(bool data)            { _bus->setDC(data); }
+        void    setReset(bool high)         { _bus->setReset(high); }
+        void    write(uint8_t b)            { bytes++; _bus->write(b); }
+        void    write(const uint8_t *buf, uint32_t len) { bytes += len; _bus->write(buf, len); }
+        uint8_t read(void)                  { bytes++; return _bus->read(); }
+        void    delay(uint32_t ms)          { _bus->delay(ms); }
+        uint32_t maxTransfer(void) const    { return _bus->maxTransfer(); }
+
+        ILI9341_Transport *_bus;
+        uint64_t bytes;
+        uint64_t transactions;
+};
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint16_t bitmap[64 * 64];
+
+/// One frame of a workload, returns the number of pixels drawn
+typedef uint32_t (*Workload)(Adafruit_ILI9341 &tft, uint32_t frame);
+
+static uint32_t fillScreen(Adafruit_ILI9341 &tft, uint32_t frame) {
+    tft.fillRect(0, 0, tft.width(), tft.height(), (frame & 1) ? ILI9341_BLUE : ILI9341_RED);
+    return (uint32_t)tft.width() * tft.height();
+}
+
+static uint32_t randomPixels(Adafruit_ILI9341 &tft, uint32_t /*frame*/) {
+    for (int i=0; i<1000; i++) {
+        tft.drawPixel(rand() % tft.width(), rand() % tft.height(), rand());
+    }
+    return 1000;
+}
+
+static uint32_t hvLines(Adafruit_ILI9341 &tft, uint32_t /*frame*/) {
+    uint32_t pixels = 0;
+    for (int i=0; i<50; i++) {
+        int16_t y = rand() % tft.height(), x = rand() % tft.width();
+        tft.drawFastHLine(0, y, tft.width(), rand());
+        tft.drawFastVLine(x, 0, tft.height(), rand());
+        pixels += tft.width() + tft.height();
+    }
+    return pixels;
+}
+
+static uint32_t bitmapBlits(Adafruit_ILI9341 &tft, uint32_t /*frame*/) {
+    for (int i=0; i<10; i++) {
+        // Allow partly off-screen blits to exercise clipping
+        tft.drawRGBBitmap(rand() % tft.width() - 16, rand() % tft.height() - 16, bitmap, 64, 64);
+    }
+    return 10 * 64 * 64;
+}
+
+static uint32_t smallRects(Adafruit_ILI9341 &tft, uint32_t /*frame*/) {
+    for (int i=0; i<200; i++) { // About one character cell each
+        tft.fillRect(rand() % (tft.width() - 6), rand() % (tft.height() - 8), 6, 8, rand());
+    }
+    return 200 * 6 * 8;
+}
+
+static uint32_t statusText(Adafruit_ILI9341 &tft, uint32_t /*frame*/) {
+    char line[32];
+    for (int i=0; i<20; i++) { // Twenty status lines, same colors every frame
+        snprintf(line, sizeof(line), "Sensor %2d: %5u", i, (unsigned)(rand() % 100000));
+        tft.drawText(0, i * 10, line, ILI9341_WHITE, ILI9341_BLACK);
+    }
+    return 20 * 15 * 6 * 8;
+}
+
+static uint32_t displayList(Adafruit_ILI9341 &tft, uint32_t /*frame*/) {
+    static ILI9341_DisplayList list;
+    list.clear();
+    tft.beginRecording(&list);
+    tft.fillRect(0, 0, tft.width(), 40, ILI9341_NAVY); // Header bar
+    for (int i=0; i<100; i++) { // Widgets, partly hidden by later ones
+        tft.fillRect(rand() % (tft.width() - 32), 40 + rand() % (tft.height() - 72), 32, 32, rand());
+    }
+    for (int i=0; i<tft.width(); i++) { // Plot drawn point by point
+        tft.drawPixel(i, tft.height() - 1 - (i & 15), ILI9341_GREEN);
+    }
+    tft.endRecording();
+    list.optimize();
+    tft.drawList(list);
+    return tft.width() * 40 + 100 * 32 * 32 + tft.width();
+}
+
+static uint32_t gauge(Adafruit_ILI9341 &tft, uint32_t /*frame*/) {
+    int16_t cx = tft.width() / 2, cy = tft.height() / 2;
+    tft.fillCircle(cx, cy, 100, ILI9341_BLACK);
+    tft.drawCircle(cx, cy, 100, ILI9341_WHITE);
+    for (int i=0; i<12; i++) { // Ticks and needle, all diagonal
+        int16_t dx = rand() % 181 - 90, dy = rand() % 181 - 90;
+        tft.drawLine(cx + dx, cy + dy, cx + dx * 11 / 10, cy + dy * 11 / 10, ILI9341_WHITE);
+    }
+    tft.drawLine(cx, cy, cx + rand() % 161 - 80, cy - 80, ILI9341_RED);
+    tft.fillTriangle(cx - 8, cy + 30, cx + 8, cy + 30, cx, cy + 45, ILI9341_YELLOW);
+    tft.fillRoundRect(cx - 40, cy + 50, 80, 24, 6, ILI9341_DARKGREY);
+    return 31400 + 628 + 12 * 10 + 80 + 128 + 1920;
+}
+
+static uint32_t banner(Adafruit_ILI9341 &tft, uint32_t /*frame*/) {
+    // Without a framebuffer this includes reading the area back
+    tft.blendRect(0, tft.height() / 2 - 20, tft.width(), 40, ILI9341_RED, 96);
+    return tft.width() * 40;
+}
+
+static uint32_t sprite(Adafruit_ILI9341 &tft, uint32_t frame) {
+    static ILI9341_Compositor *comp;
+    static int8_t cursor;
+    if (!comp) { // Static background and a widget, with a cursor on top
+        static std::vector<uint16_t> background(ILI9341_TFTWIDTH * ILI9341_TFTHEIGHT);
+        for (size_t i=0; i<background.size(); i++) background[i] = i * 7;
+        comp = new ILI9341_Compositor(tft);
+        comp->addLayer(background.data(), ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, 0);
+        comp->moveLayer(comp->addLayer(bitmap, 64, 64, 1), 80, 120);
+        cursor = comp->addLayer(bitmap, 16, 16, 2, 64);
+        comp->setColorKey(cursor, true, 0);
+        comp->update();
+    }
+    comp->moveLayer(cursor, (frame * 3) % (tft.width() - 16), (frame * 5) % (tft.height() - 16));
+    return comp->update();
+}
+
+static uint32_t packedArt(Adafruit_ILI9341 &tft, uint32_t /*frame*/) {
+    static std::vector<uint8_t> ops;
+    if (ops.empty()) { // Flat-color icon: bands, a disc and an outline
+        std::vector<uint16_t> art(120 * 120);
+        for (int y=0; y<120; y++) {
+            for (int x=0; x<120; x++) {
+                int dx = x - 60, dy = y - 60;
+                uint16_t c = (y < 40) ? ILI9341_NAVY : (y < 80) ? ILI9341_DARKCYAN : ILI9341_OLIVE;
+                if (dx * dx + dy * dy < 900) c = ILI9341_ORANGE;
+                if ((x == 0) || (y == 0) || (x == 119) || (y == 119)) c = ILI9341_WHITE;
+                art[y * 120 + x] = c;
+            }
+        }
+        ILI9341_PackedAsset::encode(art.data(), 120, 120, ops);
+    }
+    for (int i=0; i<4; i++) { // Partly off-screen to exercise clipping
+        tft.drawPackedBitmap(rand() % tft.width() - 30, rand() % tft.height() - 30,
+                             ops.data(), ops.size(), 120, 120);
+    }
+    return 4 * 120 * 120;
+}
+
+static uint32_t rotations(Adafruit_ILI9341 &tft, uint32_t /*frame*/) {
+    uint32_t pixels = 0;
+    for (uint8_t r=0; r<4; r++) {
+        tft.setRotation(r);
+        tft.fillRect(0, 0, 32, 32, rand());
+        pixels += 32 * 32;
+    }
+    tft.setRotation(0);
+    return pixels;
+}
+
+#define BENCH_PRODUCERS          4       ///< Threads pushing to the command queue
+#define BENCH_PRODUCER_COMMANDS  200     ///< Commands each pushes per frame
+
+static ILI9341_CommandQueue *queue;
+
+static void producer(int id) {
+    for (int i=0; i<BENCH_PRODUCER_COMMANDS; i++) {
+        int16_t x = (id * 60 + (i % 6) * 10) % ILI9341_TFTWIDTH;
+        int16_t y = (i / 6) * 10 % ILI9341_TFTHEIGHT;
+        while (!queue->fillRect(x, y, 8, 8, id * 0x3000 + i)) { // Ring full, let the bus thread catch up
+            std::this_thread::yield();
+        }
+    }
+}
+
+static uint32_t queuedRects(Adafruit_ILI9341 &tft, uint32_t /*frame*/) {
+    if (!queue) {
+        queue = new ILI9341_CommandQueue(tft);
+        queue->start();
+    }
+    std::thread threads[BENCH_PRODUCERS];
+    for (int i=0; i<BENCH_PRODUCERS; i++) {
+        threads[i] = std::thread(producer, i);
+    }
+    for (int i=0; i<BENCH_PRODUCERS; i++) {
+        threads[i].join();
+    }
+    queue->sync();
+    return BENCH_PRODUCERS * BENCH_PRODUCER_COMMANDS * 8 * 8;
+}
+
+static const struct {
+    const char *name;
+    Workload    run;
+} workloads[] = {
+    { "fill_screen",   fillScreen   },
+    { "random_pixels", randomPixels },
+    { "hv_lines",      hvLines      },
+    { "bitmap_blit",   bitmapBlits  },
+    { "small_rects",   smallRects   },
+    { "status_text",   statusText   },
+    { "display_list",  displayList  },
+    { "gauge",         gauge        },
+    { "blend_banner",  banner       },
+    { "sprite",        sprite       },
+    { "packed_asset",  packedArt    },
+    { "rotation",      rotations    },
+    { "queued_rects",  queuedRects  },
+};
+
+static double percentile(std::vector<uint64_t> &v, double p) {
+    size_t i = (size_t)(p * (v.size() - 1) + 0.5);
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i] / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = (argc > 1) ? argv[1] : "sim";
+    int count        = (argc > 2) ? atoi(argv[2]) : 50;
+    ILI9341_Transport *bus;
+
+    if (count <= 0) {
+        fprintf(stderr, "Frame count must be at least 1\n");
+        return -1;
+    }
+    uint32_t frames = count;
+
+    if (!strcmp(name, "sim")) {
+        bus = new ILI9341_SimTransport();
+    } else if (!strcmp(name, "spidev")) {
+        bus = new ILI9341_SpidevTransport();
+#ifdef BENCH_BCM2835
+    } else if (!strcmp(name, "bcm2835")) {
+        bus = new ILI9341_BCM2835Transport();
+#endif
+    } else {
+        fprintf(stderr, "Unknown transport %s\n", name);
+        return -1;
+    }
+
+    CountingTransport counter(bus);
+    Adafruit_ILI9341 tft(&counter);
+    if (!tft.begin()) {
+        return -1;
+    }
+    for (uint32_t i=0; i<sizeof(bitmap)/sizeof(bitmap[0]); i++) {
+        bitmap[i] = i * 31;
+    }
+
+    for (size_t w=0; w<sizeof(workloads)/sizeof(workloads[0]); w++) {
+        std::vector<uint64_t> lat;
+        uint64_t pixels = 0;
+        srand(1); // Same sequence on every run and transport
+        uint64_t bytes0 = counter.bytes, trans0 = counter.transactions;
+        uint64_t t0 = nowNs();
+        for (uint32_t f=0; f<frames; f++) {
+            uint64_t s = nowNs();
+            pixels += workloads[w].run(tft, f);
+            lat.push_back(nowNs() - s);
+        }
+        double secs = (nowNs() - t0) / 1e9;
+        uint64_t bytes = counter.bytes - bytes0;
+        uint64_t trans = counter.transactions - trans0;
+
+        printf("{\"transport\":\"%s\",\"workload\":\"%s\",\"frames\":%u,"
+               "\"pixels_per_s\":%.0f,\"bytes_per_s\":%.0f,\"bytes_per_frame\":%.1f,"
+               "\"transactions_per_frame\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+               name, workloads[w].name, frames,
+               pixels / secs, bytes / secs, (double)bytes / frames,
+               (double)trans / frames, percentile(lat, 0.50), percentile(lat, 0.99));
+    }
+
+    delete queue;
+    tft.end();
+    delete bus;
+    return 0;
+}
@@ -0,0 +1,304 @@
+/*!
+* @file blend.cpp
+*
+* RGB565 alpha blending kernels, see blend.h.
+*
+* Pixels are split into 5/6/5-bit channels in 16-bit lanes. With a in
+* 0..256 every product and sum fits in 16 bits, so the SIMD loops use
+* plain 16-bit multiplies and handle 8 pixels per step, leaving the tail
+* to the scalar code.
+*
+*/
+
+#include "blend.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BLEND_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define BLEND_NEON 1
+#include <arm_neon.h>
+#endif
+
+
+/*
+ * Scalar reference
+ * */
+
+/// Alpha 0..255 to a blend weight 0..256
+static inline uint16_t weight(uint8_t alpha) {
+    return alpha + (alpha >> 7);
+}
+
+static inline uint16_t mix(uint16_t s, uint16_t d, uint16_t a) {
+    return (s * a + d * (256 - a) + 128) >> 8;
+}
+
+static inline uint16_t blend565(uint16_t s, uint16_t d, uint16_t a) {
+    return (mix(s >> 11, d >> 11, a) << 11) |
+           (mix((s >> 5) & 0x3F, (d >> 5) & 0x3F, a) << 5) |
+            mix(s & 0x1F, d & 0x1F, a);
+}
+
+static void blendFillScalar(uint16_t *dst, uint16_t color, uint8_t alpha, uint32_t n) {
+    uint16_t a = weight(alpha);
+    for (uint32_t i=0; i<n; i++) dst[i] = blend565(color, dst[i], a);
+}
+
+static void blendMaskScalar(uint16_t *dst, uint16_t color, const uint8_t *mask, uint32_t n) {
+    for (uint32_t i=0; i<n; i++) dst[i] = blend565(color, dst[i], weight(mask[i]));
+}
+
+static void blendRGBAScalar(uint16_t *dst, const uint8_t *rgba, uint32_t n) {
+    for (uint32_t i=0; i<n; i++, rgba+=4) {
+        uint16_t s = ((rgba[0] >> 3) << 11) | ((rgba[1] >> 2) << 5) | (rgba[2] >> 3);
+        dst[i] = blend565(s, dst[i], weight(rgba[3]));
+    }
+}
+
+/// Kernels for one CPU
+struct BlendKernels {
+    void (*fill)(uint16_t *dst, uint16_t color, uint8_t alpha, uint32_t n);
+    void (*mask)(uint16_t *dst, uint16_t color, const uint8_t *mask, uint32_t n);
+    void (*rgba)(uint16_t *dst, const uint8_t *rgba, uint32_t n);
+    const char *name;
+
+    BlendKernels();
+};
+
+
+#if BLEND_X86
+/*
+ * SSE2
+ * */
+__attribute__((target("sse2")))
+static inline __m128i mixSSE2(__m128i s, __m128i d, __m128i a, __m128i ia) {
+    __m128i v = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, ia));
+    return _mm_srli_epi16(_mm_add_epi16(v, _mm_set1_epi16(128)), 8);
+}
+
+/// Blend 8 source pixels, given as channels, onto dst with weights a
+__attribute__((target("sse2")))
+static inline void blend8SSE2(uint16_t *dst, __m128i sr, __m128i sg, __m128i sb, __m128i a) {
+    __m128i d  = _mm_loadu_si128((const __m128i *)dst);
+    __m128i ia = _mm_sub_epi16(_mm_set1_epi16(256), a);
+    __m128i r  = mixSSE2(sr, _mm_srli_epi16(d, 11), a, ia);
+    __m128i g  = mixSSE2(sg, _mm_and_si128(_mm_srli_epi16(d, 5), _mm_set1_epi16(0x3F)), a, ia);
+    __m128i b  = mixSSE2(sb, _mm_and_si128(d, _mm_set1_epi16(0x1F)), a, ia);
+    __m128i p  = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(r, 11), _mm_slli_epi16(g, 5)), b);
+    _mm_storeu_si128((__m128i *)dst, p);
+}
+
+__attribute__((target("sse2")))
+static void blendFillSSE2(uint16_t *dst, uint16_t color, uint8_t alpha, uint32_t n) {
+    __m128i sr = _mm_set1_epi16(color >> 11);
+    __m128i sg = _mm_set1_epi16((color >> 5) & 0x3F);
+    __m128i sb = _mm_set1_epi16(color & 0x1F);
+    __m128i a  = _mm_set1_epi16(weight(alpha));
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) blend8SSE2(dst + i, sr, sg, sb, a);
+    blendFillScalar(dst + i, color, alpha, n - i);
+}
+
+__attribute__((target("sse2")))
+static void blendMaskSSE2(uint16_t *dst, uint16_t color, const uint8_t *mask, uint32_t n) {
+    __m128i sr = _mm_set1_epi16(color >> 11);
+    __m128i sg = _mm_set1_epi16((color >> 5) & 0x3F);
+    __m128i sb = _mm_set1_epi16(color & 0x1F);
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i m = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(mask + i)), _mm_setzero_si128());
+        blend8SSE2(dst + i, sr, sg, sb, _mm_add_epi16(m, _mm_srli_epi16(m, 7)));
+    }
+    blendMaskScalar(dst + i, color, mask + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void blendRGBASSE2(uint16_t *dst, const uint8_t *rgba, uint32_t n) {
+    const __m128i low = _mm_set1_epi32(0xFF);
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(rgba + i * 4));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(rgba + i * 4 + 16));
+        // One channel per 16-bit lane, packs is exact for values up to 255
+        __m128i r = _mm_packs_epi32(_mm_and_si128(v0, low), _mm_and_si128(v1, low));
+        __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(v0, 8), low),
+                                    _mm_and_si128(_mm_srli_epi32(v1, 8), low));
+        __m128i b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(v0, 16), low),
+                                    _mm_and_si128(_mm_srli_epi32(v1, 16), low));
+        __m128i a = _mm_packs_epi32(_mm_srli_epi32(v0, 24), _mm_srli_epi32(v1, 24));
+        blend8SSE2(dst + i, _mm_srli_epi16(r, 3), _mm_srli_epi16(g, 2), _mm_srli_epi16(b, 3),
+                   _mm_add_epi16(a, _mm_srli_epi16(a, 7)));
+    }
+    blendRGBAScalar(dst + i, rgba + i * 4, n - i);
+}
+#endif
+
+
+#if BLEND_NEON
+/*
+ * NEON
+ * */
+static inline uint16x8_t mixNEON(uint16x8_t s, uint16x8_t d, uint16x8_t a, uint16x8_t ia) {
+    uint16x8_t v = vmlaq_u16(vmulq_u16(s, a), d, ia);
+    return vshrq_n_u16(vaddq_u16(v, vdupq_n_u16(128)), 8);
+}
+
+/// Blend 8 source pixels, given as channels, onto dst with weights a
+static inline void blend8NEON(uint16_t *dst, uint16x8_t sr, uint16x8_t sg, uint16x8_t sb, uint16x8_t a) {
+    uint16x8_t d  = vld1q_u16(dst);
+    uint16x8_t ia = vsubq_u16(vdupq_n_u16(256), a);
+    uint16x8_t r  = mixNEON(sr, vshrq_n_u16(d, 11), a, ia);
+    uint16x8_t g  = mixNEON(sg, vandq_u16(vshrq_n_u16(d, 5), vdupq_n_u16(0x3F)), a, ia);
+    uint16x8_t b  = mixNEON(sb, vandq_u16(d, vdupq_n_u16(0x1F)), a, ia);
+    vst1q_u16(dst, vorrq_u16(vorrq_u16(vshlq_n_u16(r, 11), vshlq_n_u16(g, 5)), b));
+}
+
+static void blendFillNEON(uint16_t *dst, uint16_t color, uint8_t alpha, uint32_t n) {
+    uint16x8_t sr = vdupq_n_u16(color >> 11);
+    uint16x8_t sg = vdupq_n_u16((color >> 5) & 0x3F);
+    uint16x8_t sb = vdupq_n_u16(color & 0x1F);
+    uint16x8_t a  = vdupq_n_u16(weight(alpha));
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) blend8NEON(dst + i, sr, sg, sb, a);
+    blendFillScalar(dst + i, color, alpha, n - i);
+}
+
+static void blendMaskNEON(uint16_t *dst, uint16_t color, const uint8_t *mask, uint32_t n) {
+    uint16x8_t sr = vdupq_n_u16(color >> 11);
+    uint16x8_t sg = vdupq_n_u16((color >> 5) & 0x3F);
+    uint16x8_t sb = vdupq_n_u16(color & 0x1F);
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t m = vmovl_u8(vld1_u8(mask + i));
+        blend8NEON(dst + i, sr, sg, sb, vaddq_u16(m, vshrq_n_u16(m, 7)));
+    }
+    blendMaskScalar(dst + i, color, mask + i, n - i);
+}
+
+static void blendRGBANEON(uint16_t *dst, const uint8_t *rgba, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint8x8x4_t p = vld4_u8(rgba + i * 4);  // De-interleaved channels
+        uint16x8_t  a = vmovl_u8(p.val[3]);
+        blend8NEON(dst + i, vmovl_u8(vshr_n_u8(p.val[0], 3)), vmovl_u8(vshr_n_u8(p.val[1], 2)),
+                   vmovl_u8(vshr_n_u8(p.val[2], 3)), vaddq_u16(a, vshrq_n_u16(a, 7)));
+    }
+    blendRGBAScalar(dst + i, rgba + i * 4, n - i);
+}
+#endif
+
+
+BlendKernels::BlendKernels() {
+    fill = blendFillScalar;
+    mask = blendMaskScalar;
+    rgba = blendRGBAScalar;
+    name = "scalar";
+#if BLEND_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        fill = blendFillSSE2;
+        mask = blendMaskSSE2;
+        rgba = blendRGBASSE2;
+        name = "sse2";
+    }
+#elif BLEND_NEON
+    fill = blendFillNEON;
+    mask = blendMaskNEON;
+    rgba = blendRGBANEON;
+    name = "neon";
+#endif
+}
+
+static const BlendKernels &kernels(void) {
+    static const BlendKernels k; // Picked once, on first use
+    return k;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Blend one color over a run of pixels with constant alpha
+    @param   dst  Native RGB565 pixels, updated in place
+    @param   color  16-bit 5-6-5 color to blend in
+    @param   alpha  Opacity of color, 0..255
+    @param   n  Number of pixels
+*/
+/**************************************************************************/
+void ILI9341_blendFill(uint16_t *dst, uint16_t color, uint8_t alpha, uint32_t n) {
+    kernels().fill(dst, color, alpha, n);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Blend one color over a run of pixels through a coverage mask
+    @param   dst  Native RGB565 pixels, updated in place
+    @param   color  16-bit 5-6-5 color to blend in
+    @param   mask  Opacity of color for each pixel, 0..255
+    @param   n  Number of pixels
+*/
+/**************************************************************************/
+void ILI9341_blendMask(uint16_t *dst, uint16_t color, const uint8_t *mask, uint32_t n) {
+    kernels().mask(dst, color, mask, n);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Composite RGBA8888 pixels over a run of RGB565 pixels
+    @param   dst  Native RGB565 pixels, updated in place
+    @param   rgba  Source pixels, R G B A bytes, not premultiplied
+    @param   n  Number of pixels
+*/
+/**************************************************************************/
+void ILI9341_blendRGBA(uint16_t *dst, const uint8_t *rgba, uint32_t n) {
+    kernels().rgba(dst, rgba, n);
+}
+
+/**************************************************************************/
+/*!
+    @brief   ILI9341_blendFill() with the portable reference kernel
+    @param   dst  Native RGB565 pixels, updated in place
+    @param   color  16-bit 5-6-5 color to blend in
+    @param   alpha  Opacity of color, 0..255
+    @param   n  Number of pixels
+*/
+/**************************************************************************/
+void ILI9341_blendFillScalar(uint16_t *dst, uint16_t color, uint8_t alpha, uint32_t n) {
+    blendFillScalar(dst, color, alpha, n);
+}
+
+/**************************************************************************/
+/*!
+    @brief   ILI9341_blendMask() with the portable reference kernel
+    @param   dst  Native RGB565 pixels, updated in place
+    @param   color  16-bit 5-6-5 color to blend in
+    @param   mask  Opacity of color for each pixel, 0..255
+    @param   n  Number of pixels
+*/
+/**************************************************************************/
+void ILI9341_blendMaskScalar(uint16_t *dst, uint16_t color, const uint8_t *mask, uint32_t n) {
+    blendMaskScalar(dst, color, mask, n);
+}
+
+/**************************************************************************/
+/*!
+    @brief   ILI9341_blendRGBA() with the portable reference kernel
+    @param   dst  Native RGB565 pixels, updated in place
+    @param   rgba  Source pixels, R G B A bytes, not premultiplied
+    @param   n  Number of pixels
+*/
+/**************************************************************************/
+void ILI9341_blendRGBAScalar(uint16_t *dst, const uint8_t *rgba, uint32_t n) {
+    blendRGBAScalar(dst, rgba, n);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Name of the kernel set in use
+    @return  "sse2", "neon" or "scalar"
+*/
+/**************************************************************************/
+const char *ILI9341_blendImpl(void) {
+    return kernels().name;
+}
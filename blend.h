@@ -0,0 +1,31 @@
+/*!
+* @file blend.h
+*
+* Alpha blending onto native RGB565 pixels, as held in the driver's shadow
+* framebuffer: a constant-alpha color, a color through an 8-bit coverage
+* mask (anti-aliased glyphs), and RGBA8888 images composited over.
+*
+* Alpha 0 keeps the destination and 255 replaces it. Each channel is
+* blended at 565 precision as (s * a + d * (256 - a) + 128) >> 8 with a
+* scaled to 0..256. The best kernel for the CPU is picked on first use:
+* SSE2 on x86, NEON when compiled for an ARM target with NEON, otherwise
+* a portable scalar loop. All kernels produce identical output.
+*
+*/
+
+#ifndef _ILI9341_BLEND_H_
+#define _ILI9341_BLEND_H_
+
+#include <stdint.h>			//uint_t
+
+
+void        ILI9341_blendFill(uint16_t *dst, uint16_t color, uint8_t alpha, uint32_t n);
+void        ILI9341_blendMask(uint16_t *dst, uint16_t color, const uint8_t *mask, uint32_t n);
+void        ILI9341_blendRGBA(uint16_t *dst, const uint8_t *rgba, uint32_t n);
+
+void        ILI9341_blendFillScalar(uint16_t *dst, uint16_t color, uint8_t alpha, uint32_t n);
+void        ILI9341_blendMaskScalar(uint16_t *dst, uint16_t color, const uint8_t *mask, uint32_t n);
+void        ILI9341_blendRGBAScalar(uint16_t *dst, const uint8_t *rgba, uint32_t n);
+const char *ILI9341_blendImpl(void);
+
+#endif
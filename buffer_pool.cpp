@@ -0,0 +1,165 @@
+/*!
+* @file buffer_pool.cpp
+*
+* Aligned transfer buffer pool, see buffer_pool.h.
+*
+*/
+
+#include <stdio.h>			//printf
+#include <stdlib.h>			//posix_memalign
+#include <time.h>
+#include <unistd.h>			//sysconf
+
+#include "buffer_pool.h"
+
+
+/// Buffer size resize() uses for a requested size
+static uint32_t poolBytes(uint32_t bytes) {
+    if (bytes < ILI9341_POOL_MIN_BYTES) bytes = ILI9341_POOL_MIN_BYTES;
+    if (bytes > ILI9341_POOL_MAX_BYTES) bytes = ILI9341_POOL_MAX_BYTES;
+    return bytes & ~1u;
+}
+
+/// Arena stride for a buffer size, whole cache lines
+static uint32_t poolPitch(uint32_t bytes) {
+    return (bytes + ILI9341_CACHE_LINE - 1) & ~(uint32_t)(ILI9341_CACHE_LINE - 1);
+}
+
+static uint64_t monotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Set up a pool. The arena is allocated on first use.
+    @param   count  Number of buffers, at most ILI9341_POOL_MAX
+    @param   bytes  Size of each buffer, see resize()
+*/
+/**************************************************************************/
+ILI9341_BufferPool::ILI9341_BufferPool(uint32_t count, uint32_t bytes) :
+        _arena(NULL), _count(count), _bytes(poolBytes(bytes)), _pitch(poolPitch(_bytes)),
+        _nfree(0), _stats() {
+    if (_count < 1) _count = 1;
+    if (_count > ILI9341_POOL_MAX) _count = ILI9341_POOL_MAX;
+}
+
+ILI9341_BufferPool::~ILI9341_BufferPool() {
+    free(_arena);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Change the size of the buffers and allocate the arena. Waits
+             for borrowed buffers to come back, so the caller must not
+             hold one.
+    @param   bytes  New size, clamped to ILI9341_POOL_MIN_BYTES ..
+             ILI9341_POOL_MAX_BYTES and rounded down to whole pixels
+    @return  False if the new arena could not be allocated
+*/
+/**************************************************************************/
+bool ILI9341_BufferPool::resize(uint32_t bytes) {
+    bytes = poolBytes(bytes);
+    std::unique_lock<std::mutex> lock(_lock);
+    if (bytes != _bytes) {
+        _returned.wait(lock, [this]{ return !_arena || (_nfree == _count); });
+        free(_arena);
+        _arena = NULL;
+        _bytes = bytes;
+        _pitch = poolPitch(bytes);
+    }
+    return allocate();
+}
+
+/**************************************************************************/
+/*!
+    @brief   Allocate the arena if it doesn't exist yet. Called with _lock held.
+    @return  False if the allocation failed
+*/
+/**************************************************************************/
+bool ILI9341_BufferPool::allocate(void) {
+    if (_arena) return true;
+    long page = sysconf(_SC_PAGESIZE);
+    if (page < ILI9341_CACHE_LINE) page = ILI9341_CACHE_LINE;
+    void *arena;
+    if (posix_memalign(&arena, page, (size_t)_pitch * _count)) {
+        printf("Transfer buffer pool allocation failed\n");
+        return false;
+    }
+    _arena = (uint8_t *)arena;
+    for (uint32_t i=0; i<_count; i++) { // Hand out the lowest addresses first
+        _free[i] = _count - 1 - i;
+    }
+    _nfree = _count;
+    _stats.buffers     = _count;
+    _stats.bufferBytes = _bytes;
+    _stats.inUse       = 0;
+    _stats.allocations++;
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Borrow a buffer, waiting for one to be returned if all are out
+    @return  size() bytes, cache-line aligned, or NULL if the arena could
+             not be allocated
+*/
+/**************************************************************************/
+uint8_t *ILI9341_BufferPool::acquire(void) {
+    std::unique_lock<std::mutex> lock(_lock);
+    if (!allocate()) return NULL;
+    if (!_nfree) {
+        _stats.waits++;
+        uint64_t t0 = monotonicNs();
+        _returned.wait(lock, [this]{ return _nfree != 0; });
+        _stats.waitNs += monotonicNs() - t0;
+    }
+    _stats.acquires++;
+    if (++_stats.inUse > _stats.peakInUse) {
+        _stats.peakInUse = _stats.inUse;
+    }
+    return _arena + (size_t)_free[--_nfree] * _pitch;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Return a buffer obtained from acquire()
+    @param   buf  The buffer, NULL is ignored
+*/
+/**************************************************************************/
+void ILI9341_BufferPool::release(uint8_t *buf) {
+    if (!buf) return;
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _free[_nfree++] = (buf - _arena) / _pitch;
+        _stats.inUse--;
+    }
+    _returned.notify_all();
+}
+
+/**************************************************************************/
+/*!
+    @brief   Snapshot of the pool counters
+    @return  The counters
+*/
+/**************************************************************************/
+ILI9341_PoolStats ILI9341_BufferPool::stats(void) const {
+    std::lock_guard<std::mutex> lock(_lock);
+    return _stats;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Zero the event counters. The peak restarts from the buffers
+             borrowed right now.
+*/
+/**************************************************************************/
+void ILI9341_BufferPool::resetStats(void) {
+    std::lock_guard<std::mutex> lock(_lock);
+    _stats.acquires    = 0;
+    _stats.waits       = 0;
+    _stats.waitNs      = 0;
+    _stats.allocations = 0;
+    _stats.peakInUse   = _stats.inUse;
+}
@@ -0,0 +1,101 @@
+/*!
+* @file buffer_pool.h
+*
+* Preallocated transfer buffers for the ILI9341 driver.
+*
+* The transfer paths (pixel byte swapping, format conversion, text, GRAM
+* readback and the async flush thread) each need a staging buffer for as
+* long as one bulk write. Instead of fixed members shared between threads
+* they borrow one from an ILI9341_BufferPool and hand it back afterwards.
+*
+* All buffers live in one arena allocated up front. The arena is page
+* aligned and every buffer starts on a cache line, so a buffer whose size
+* is a page multiple is page aligned too. Buffers are sized to the
+* largest transfer the transport submits (the spidev bufsiz), making each
+* borrowed buffer exactly one SPI message. Borrowing and returning only
+* take a mutex; nothing is allocated once the arena exists.
+*
+*/
+
+#ifndef _ILI9341_BUFFER_POOL_H_
+#define _ILI9341_BUFFER_POOL_H_
+
+#include <stdint.h>			//uint_t
+
+#include <mutex>
+#include <condition_variable>
+
+
+#define ILI9341_POOL_BUFFERS    4       ///< Buffers in a driver's pool
+#define ILI9341_POOL_MAX        8       ///< Most buffers a pool can hold
+#define ILI9341_POOL_MIN_BYTES  1024    ///< Smallest buffer, one GRAM readback row needs 960
+#define ILI9341_POOL_MAX_BYTES  65536   ///< Largest buffer, whatever the transport allows
+#define ILI9341_CACHE_LINE      64      ///< Alignment of every buffer
+
+
+/// Pool counters, see ILI9341_BufferPool::stats()
+struct ILI9341_PoolStats {
+    uint32_t buffers;           ///< Buffers in the arena
+    uint32_t bufferBytes;       ///< Size of each buffer
+    uint32_t inUse;             ///< Buffers currently borrowed
+    uint32_t peakInUse;         ///< Most buffers borrowed at once
+    uint64_t acquires;          ///< Buffers handed out
+    uint64_t waits;             ///< acquire() calls that found the pool empty
+    uint64_t waitNs;            ///< Time spent waiting for a buffer
+    uint64_t allocations;       ///< Times the arena was (re)allocated
+};
+
+/// Fixed set of aligned transfer buffers shared by the threads of one driver
+class ILI9341_BufferPool {
+    public:
+        ILI9341_BufferPool(uint32_t count = ILI9341_POOL_BUFFERS, uint32_t bytes = 4096);
+        ~ILI9341_BufferPool();
+
+        bool        resize(uint32_t bytes);
+        uint8_t    *acquire(void);
+        void        release(uint8_t *buf);
+
+        /// Bytes in each buffer
+        uint32_t    size(void) const { return _bytes; }
+        /// Buffers in the pool
+        uint32_t    count(void) const { return _count; }
+
+        ILI9341_PoolStats stats(void) const;
+        void        resetStats(void);
+
+    private:
+        ILI9341_BufferPool(const ILI9341_BufferPool &);
+        ILI9341_BufferPool &operator=(const ILI9341_BufferPool &);
+
+        bool        allocate(void);
+
+        uint8_t    *_arena;                     ///< All buffers, NULL until first use
+        uint32_t    _count;
+        uint32_t    _bytes;                     ///< Usable bytes per buffer
+        uint32_t    _pitch;                     ///< Distance between buffers in the arena
+        uint8_t     _free[ILI9341_POOL_MAX];    ///< Indices of the buffers not borrowed
+        uint32_t    _nfree;
+        ILI9341_PoolStats _stats;
+        mutable std::mutex _lock;               ///< Guards everything above
+        std::condition_variable _returned;      ///< Signalled when a buffer comes back
+};
+
+/// Borrows a buffer from a pool for the lifetime of the object
+class ILI9341_PoolBuffer {
+    public:
+        explicit ILI9341_PoolBuffer(ILI9341_BufferPool &pool) : _pool(pool), _buf(pool.acquire()) {}
+        ~ILI9341_PoolBuffer() { _pool.release(_buf); }
+
+        /// The borrowed bytes, ILI9341_BufferPool::size() of them
+        uint8_t    *data(void) const { return _buf; }
+        uint32_t    size(void) const { return _pool.size(); }
+
+    private:
+        ILI9341_PoolBuffer(const ILI9341_PoolBuffer &);
+        ILI9341_PoolBuffer &operator=(const ILI9341_PoolBuffer &);
+
+        ILI9341_BufferPool &_pool;
+        uint8_t    *_buf;
+};
+
+#endif
@@ -0,0 +1,304 @@
+/*!
+* @file color_convert.cpp
+*
+* RGB888 / BGR888 / RGBA8888 / GRAY8 to wire-order RGB565 kernels.
+*
+* Every kernel computes the two wire bytes of a pixel directly:
+*   hi = (r & 0xF8) | (g >> 5)
+*   lo = ((g << 3) & 0xE0) | (b >> 3)
+* so no byte swap is needed afterwards. The SIMD loops handle whole blocks
+* and leave the tail to the scalar code.
+*
+*/
+
+#include "color_convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+
+/*
+ * Scalar reference
+ * */
+static inline void put565(uint8_t *dst, uint8_t r, uint8_t g, uint8_t b) {
+    dst[0] = (r & 0xF8) | (g >> 5);
+    dst[1] = ((g << 3) & 0xE0) | (b >> 3);
+}
+
+static void rgb888Scalar(const uint8_t *src, uint8_t *dst, uint32_t n) {
+    for (uint32_t i=0; i<n; i++, src+=3, dst+=2) put565(dst, src[0], src[1], src[2]);
+}
+
+static void bgr888Scalar(const uint8_t *src, uint8_t *dst, uint32_t n) {
+    for (uint32_t i=0; i<n; i++, src+=3, dst+=2) put565(dst, src[2], src[1], src[0]);
+}
+
+static void rgba8888Scalar(const uint8_t *src, uint8_t *dst, uint32_t n) {
+    for (uint32_t i=0; i<n; i++, src+=4, dst+=2) put565(dst, src[0], src[1], src[2]);
+}
+
+static void gray8Scalar(const uint8_t *src, uint8_t *dst, uint32_t n) {
+    for (uint32_t i=0; i<n; i++, src++, dst+=2) put565(dst, src[0], src[0], src[0]);
+}
+
+static const ILI9341_ConvertFn scalarKernels[ILI9341_FORMAT_COUNT] = {
+    rgb888Scalar, bgr888Scalar, rgba8888Scalar, gray8Scalar
+};
+
+
+#if CONVERT_X86
+/*
+ * SSE2 / SSSE3 / AVX2
+ *
+ * 32-bit lanes holding r | g << 8 | b << 16 are turned into hi | lo << 8,
+ * which stored as little-endian 16-bit words is the wire byte order.
+ * */
+static inline __m128i lanes565(__m128i v) {
+    __m128i hi = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi32(0xF8)),
+                              _mm_and_si128(_mm_srli_epi32(v, 13), _mm_set1_epi32(0x07)));
+    __m128i lo = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 5), _mm_set1_epi32(0xE0)),
+                              _mm_and_si128(_mm_srli_epi32(v, 19), _mm_set1_epi32(0x1F)));
+    __m128i w  = _mm_or_si128(hi, _mm_slli_epi32(lo, 8));
+    return _mm_srai_epi32(_mm_slli_epi32(w, 16), 16); // Sign extend so packs keeps all bits
+}
+
+static void rgba8888SSE2(const uint8_t *src, uint8_t *dst, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = lanes565(_mm_loadu_si128((const __m128i *)(src + i * 4)));
+        __m128i b = lanes565(_mm_loadu_si128((const __m128i *)(src + i * 4 + 16)));
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_packs_epi32(a, b));
+    }
+    rgba8888Scalar(src + i * 4, dst + i * 2, n - i);
+}
+
+static void gray8SSE2(const uint8_t *src, uint8_t *dst, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i g  = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i hi = _mm_or_si128(_mm_and_si128(g, _mm_set1_epi8((char)0xF8)),
+                                  _mm_and_si128(_mm_srli_epi16(g, 5), _mm_set1_epi8(0x07)));
+        __m128i lo = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(g, 3), _mm_set1_epi8((char)0xE0)),
+                                  _mm_and_si128(_mm_srli_epi16(g, 3), _mm_set1_epi8(0x1F)));
+        _mm_storeu_si128((__m128i *)(dst + i * 2),      _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(dst + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    gray8Scalar(src + i, dst + i * 2, n - i);
+}
+
+/// Expand 4 packed 3-byte pixels to 32-bit lanes with pshufb
+__attribute__((target("ssse3")))
+static void rgb24SSSE3(const uint8_t *src, uint8_t *dst, uint32_t n, bool bgr) {
+    const __m128i shuf = bgr ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+                             : _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    uint32_t i = 0;
+    // Each 16-byte load covers 4 pixels plus 4 bytes of the next one, so
+    // stop while at least 10 pixels remain to stay inside the source
+    for (; i + 10 <= n; i += 8) {
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + i * 3)), shuf);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + i * 3 + 12)), shuf);
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_packs_epi32(lanes565(a), lanes565(b)));
+    }
+    if (bgr) {
+        bgr888Scalar(src + i * 3, dst + i * 2, n - i);
+    } else {
+        rgb888Scalar(src + i * 3, dst + i * 2, n - i);
+    }
+}
+
+__attribute__((target("ssse3")))
+static void rgb888SSSE3(const uint8_t *src, uint8_t *dst, uint32_t n) {
+    rgb24SSSE3(src, dst, n, false);
+}
+
+__attribute__((target("ssse3")))
+static void bgr888SSSE3(const uint8_t *src, uint8_t *dst, uint32_t n) {
+    rgb24SSSE3(src, dst, n, true);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i lanes565AVX2(__m256i v) {
+    __m256i hi = _mm256_or_si256(_mm256_and_si256(v, _mm256_set1_epi32(0xF8)),
+                                 _mm256_and_si256(_mm256_srli_epi32(v, 13), _mm256_set1_epi32(0x07)));
+    __m256i lo = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(v, 5), _mm256_set1_epi32(0xE0)),
+                                 _mm256_and_si256(_mm256_srli_epi32(v, 19), _mm256_set1_epi32(0x1F)));
+    __m256i w  = _mm256_or_si256(hi, _mm256_slli_epi32(lo, 8));
+    return _mm256_srai_epi32(_mm256_slli_epi32(w, 16), 16);
+}
+
+__attribute__((target("avx2")))
+static void rgba8888AVX2(const uint8_t *src, uint8_t *dst, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = lanes565AVX2(_mm256_loadu_si256((const __m256i *)(src + i * 4)));
+        __m256i b = lanes565AVX2(_mm256_loadu_si256((const __m256i *)(src + i * 4 + 32)));
+        // packs works per 128-bit lane, put the quadwords back in order
+        __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+        _mm256_storeu_si256((__m256i *)(dst + i * 2), p);
+    }
+    rgba8888SSE2(src + i * 4, dst + i * 2, n - i);
+}
+
+__attribute__((target("avx2")))
+static void gray8AVX2(const uint8_t *src, uint8_t *dst, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i g  = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i hi = _mm256_or_si256(_mm256_and_si256(g, _mm256_set1_epi8((char)0xF8)),
+                                     _mm256_and_si256(_mm256_srli_epi16(g, 5), _mm256_set1_epi8(0x07)));
+        __m256i lo = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(g, 3), _mm256_set1_epi8((char)0xE0)),
+                                     _mm256_and_si256(_mm256_srli_epi16(g, 3), _mm256_set1_epi8(0x1F)));
+        __m256i l  = _mm256_unpacklo_epi8(hi, lo);
+        __m256i h  = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i *)(dst + i * 2),      _mm256_permute2x128_si256(l, h, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + i * 2 + 32), _mm256_permute2x128_si256(l, h, 0x31));
+    }
+    gray8SSE2(src + i, dst + i * 2, n - i);
+}
+#endif
+
+
+#if CONVERT_NEON
+/*
+ * NEON: de-interleaving loads give one vector per channel, the wire bytes
+ * are computed per lane and re-interleaved by vst2q_u8.
+ * */
+static inline uint8x16x2_t neon565(uint8x16_t r, uint8x16_t g, uint8x16_t b) {
+    uint8x16x2_t out;
+    out.val[0] = vorrq_u8(vandq_u8(r, vdupq_n_u8(0xF8)), vshrq_n_u8(g, 5));
+    out.val[1] = vorrq_u8(vandq_u8(vshlq_n_u8(g, 3), vdupq_n_u8(0xE0)), vshrq_n_u8(b, 3));
+    return out;
+}
+
+static void rgb888NEON(const uint8_t *src, uint8_t *dst, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x3_t p = vld3q_u8(src + i * 3);
+        vst2q_u8(dst + i * 2, neon565(p.val[0], p.val[1], p.val[2]));
+    }
+    rgb888Scalar(src + i * 3, dst + i * 2, n - i);
+}
+
+static void bgr888NEON(const uint8_t *src, uint8_t *dst, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x3_t p = vld3q_u8(src + i * 3);
+        vst2q_u8(dst + i * 2, neon565(p.val[2], p.val[1], p.val[0]));
+    }
+    bgr888Scalar(src + i * 3, dst + i * 2, n - i);
+}
+
+static void rgba8888NEON(const uint8_t *src, uint8_t *dst, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x4_t p = vld4q_u8(src + i * 4);
+        vst2q_u8(dst + i * 2, neon565(p.val[0], p.val[1], p.val[2]));
+    }
+    rgba8888Scalar(src + i * 4, dst + i * 2, n - i);
+}
+
+static void gray8NEON(const uint8_t *src, uint8_t *dst, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t g = vld1q_u8(src + i);
+        vst2q_u8(dst + i * 2, neon565(g, g, g));
+    }
+    gray8Scalar(src + i, dst + i * 2, n - i);
+}
+#endif
+
+
+/// Kernel table chosen for this CPU
+struct ConvertKernels {
+    ILI9341_ConvertFn fn[ILI9341_FORMAT_COUNT];
+    const char       *name;
+
+    ConvertKernels() {
+        for (int i=0; i<ILI9341_FORMAT_COUNT; i++) fn[i] = scalarKernels[i];
+        name = "scalar";
+#if CONVERT_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2")) {
+            fn[ILI9341_RGBA8888] = rgba8888SSE2;
+            fn[ILI9341_GRAY8]    = gray8SSE2;
+            name = "sse2";
+        }
+        if (__builtin_cpu_supports("ssse3")) {
+            fn[ILI9341_RGB888]   = rgb888SSSE3;
+            fn[ILI9341_BGR888]   = bgr888SSSE3;
+            name = "ssse3";
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            fn[ILI9341_RGBA8888] = rgba8888AVX2;
+            fn[ILI9341_GRAY8]    = gray8AVX2;
+            name = "avx2";
+        }
+#elif CONVERT_NEON
+        fn[ILI9341_RGB888]   = rgb888NEON;
+        fn[ILI9341_BGR888]   = bgr888NEON;
+        fn[ILI9341_RGBA8888] = rgba8888NEON;
+        fn[ILI9341_GRAY8]    = gray8NEON;
+        name = "neon";
+#endif
+    }
+};
+
+static const ConvertKernels &kernels(void) {
+    static const ConvertKernels k; // Picked once, on first use
+    return k;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Size of one source pixel
+    @param   fmt  Source pixel format
+    @return  Bytes per pixel
+*/
+/**************************************************************************/
+uint8_t ILI9341_bytesPerPixel(ILI9341_PixelFormat fmt) {
+    static const uint8_t bpp[ILI9341_FORMAT_COUNT] = { 3, 3, 4, 1 };
+    return bpp[fmt];
+}
+
+/**************************************************************************/
+/*!
+    @brief   Convert pixels to wire-order RGB565 with the fastest kernel
+    @param   fmt  Source pixel format
+    @param   src  Source pixels
+    @param   dst  Destination, 2 bytes per pixel
+    @param   n    Number of pixels
+*/
+/**************************************************************************/
+void ILI9341_convert(ILI9341_PixelFormat fmt, const uint8_t *src, uint8_t *dst, uint32_t n) {
+    kernels().fn[fmt](src, dst, n);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Convert pixels with the portable reference kernel
+    @param   fmt  Source pixel format
+    @param   src  Source pixels
+    @param   dst  Destination, 2 bytes per pixel
+    @param   n    Number of pixels
+*/
+/**************************************************************************/
+void ILI9341_convertScalar(ILI9341_PixelFormat fmt, const uint8_t *src, uint8_t *dst, uint32_t n) {
+    scalarKernels[fmt](src, dst, n);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Name of the kernel set in use
+    @return  "avx2", "ssse3", "sse2", "neon" or "scalar"
+*/
+/**************************************************************************/
+const char *ILI9341_convertImpl(void) {
+    return kernels().name;
+}
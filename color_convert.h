@@ -0,0 +1,36 @@
+/*!
+* @file color_convert.h
+*
+* Batch conversion of 24/32-bit and grayscale pixels to RGB565 in wire
+* order (big endian, high byte first), ready to be written to the ILI9341.
+*
+* The best kernel for the CPU is picked on first use: AVX2, SSSE3 or SSE2
+* on x86, NEON when compiled for an ARM target with NEON, otherwise a
+* portable scalar loop. All kernels produce identical output.
+*
+*/
+
+#ifndef _ILI9341_COLOR_CONVERT_H_
+#define _ILI9341_COLOR_CONVERT_H_
+
+#include <stdint.h>			//uint_t
+
+
+/// Source pixel formats accepted by ILI9341_convert()
+enum ILI9341_PixelFormat {
+    ILI9341_RGB888,     ///< 3 bytes per pixel, R G B
+    ILI9341_BGR888,     ///< 3 bytes per pixel, B G R
+    ILI9341_RGBA8888,   ///< 4 bytes per pixel, R G B A, alpha ignored
+    ILI9341_GRAY8,      ///< 1 byte per pixel, luminance
+    ILI9341_FORMAT_COUNT
+};
+
+/// Conversion kernel: n source pixels to 2*n bytes of wire-order RGB565
+typedef void (*ILI9341_ConvertFn)(const uint8_t *src, uint8_t *dst, uint32_t n);
+
+uint8_t     ILI9341_bytesPerPixel(ILI9341_PixelFormat fmt);
+void        ILI9341_convert(ILI9341_PixelFormat fmt, const uint8_t *src, uint8_t *dst, uint32_t n);
+void        ILI9341_convertScalar(ILI9341_PixelFormat fmt, const uint8_t *src, uint8_t *dst, uint32_t n);
+const char *ILI9341_convertImpl(void);
+
+#endif
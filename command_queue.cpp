@@ -0,0 +1,331 @@
+/*!
+* @file command_queue.cpp
+*
+* Multi-producer, single-consumer draw command queue, see command_queue.h.
+*
+*/
+
+#include <string.h>			//strncpy
+#include <system_error>
+
+#include "command_queue.h"
+
+#define QUEUE_MASK  (ILI9341_QUEUE_SIZE - 1)
+
+static_assert((ILI9341_QUEUE_SIZE & QUEUE_MASK) == 0, "ILI9341_QUEUE_SIZE must be a power of two");
+
+
+ILI9341_CommandQueue::ILI9341_CommandQueue(Adafruit_ILI9341 &tft) : _tft(tft),
+        _head(0), _tail(0), _done(0), _dropped(0), _batches(0),
+        _sleeping(false), _running(false), _stop(false) {
+    for (uint32_t i=0; i<ILI9341_QUEUE_SIZE; i++) {
+        _slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+ILI9341_CommandQueue::~ILI9341_CommandQueue() {
+    stop();
+}
+
+/**************************************************************************/
+/*!
+    @brief   Start the bus thread
+    @return  False if the thread could not be created
+*/
+/**************************************************************************/
+bool ILI9341_CommandQueue::start(void) {
+    if (_thread.joinable()) return true;
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _stop = false;
+        _running = true;
+    }
+    try {
+        _thread = std::thread(&ILI9341_CommandQueue::busThread, this);
+    } catch (const std::system_error &) {
+        std::lock_guard<std::mutex> lock(_lock);
+        _running = false;
+        printf("Command queue thread creation failed\n");
+        return false;
+    }
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Run what is queued and stop the bus thread
+*/
+/**************************************************************************/
+void ILI9341_CommandQueue::stop(void) {
+    if (!_thread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _stop = true;
+    }
+    _wake.notify_one();
+    _thread.join();
+}
+
+/**************************************************************************/
+/*!
+    @brief   Queue a command. Never blocks and takes no lock unless the bus
+             thread has to be woken up.
+    @param   cmd  Command to copy into the queue
+    @return  False if the queue is full
+*/
+/**************************************************************************/
+bool ILI9341_CommandQueue::push(const ILI9341_Command &cmd) {
+    uint32_t pos = _head.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (true) {
+        slot = &_slots[pos & QUEUE_MASK];
+        int32_t dif = (int32_t)(slot->seq.load(std::memory_order_acquire) - pos);
+        if (dif == 0) { // Free, try to claim it
+            if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (dif < 0) { // Still holds a command from one lap ago
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else { // Another producer got it first
+            pos = _head.load(std::memory_order_relaxed);
+        }
+    }
+    slot->cmd = cmd;
+    slot->seq.store(pos + 1, std::memory_order_release);
+
+    // Pairs with the fence in busThread() so one side always sees the other
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_sleeping.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(_lock);
+        _wake.notify_one();
+    }
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Wait until every command queued before this call has run
+*/
+/**************************************************************************/
+void ILI9341_CommandQueue::sync(void) {
+    uint32_t target = _head.load(std::memory_order_acquire);
+    std::unique_lock<std::mutex> lock(_lock);
+    _idle.wait(lock, [this, target]{
+        return (int32_t)(_done.load(std::memory_order_acquire) - target) >= 0 || !_running;
+    });
+}
+
+/**************************************************************************/
+/*!
+    @brief   True if the next command has been published. Bus thread only.
+*/
+/**************************************************************************/
+bool ILI9341_CommandQueue::ready(void) const {
+    return _slots[_tail & QUEUE_MASK].seq.load(std::memory_order_acquire) == _tail + 1;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Take the next command. Bus thread only.
+    @param   cmd  Receives the command
+    @return  False if the queue is empty
+*/
+/**************************************************************************/
+bool ILI9341_CommandQueue::pop(ILI9341_Command &cmd) {
+    if (!ready()) return false;
+    Slot &slot = _slots[_tail & QUEUE_MASK];
+    cmd = slot.cmd;
+    slot.seq.store(_tail + ILI9341_QUEUE_SIZE, std::memory_order_release); // Free for the next lap
+    _tail++;
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Run one command on the panel
+    @param   cmd  Command to run
+*/
+/**************************************************************************/
+void ILI9341_CommandQueue::run(const ILI9341_Command &cmd) {
+    switch (cmd.op) {
+        case ILI9341_OP_FILL_RECT:
+            _tft.fillRect(cmd.x, cmd.y, cmd.w, cmd.h, cmd.color);
+            break;
+        case ILI9341_OP_PIXEL:
+            _tft.drawPixel(cmd.x, cmd.y, cmd.color);
+            break;
+        case ILI9341_OP_HLINE:
+            _tft.drawFastHLine(cmd.x, cmd.y, cmd.w, cmd.color);
+            break;
+        case ILI9341_OP_VLINE:
+            _tft.drawFastVLine(cmd.x, cmd.y, cmd.h, cmd.color);
+            break;
+        case ILI9341_OP_TEXT:
+            _tft.drawText(cmd.x, cmd.y, cmd.text, cmd.color, cmd.bg, cmd.size);
+            break;
+        case ILI9341_OP_BITMAP:
+            _tft.drawRGBBitmap(cmd.x, cmd.y, (uint16_t *)cmd.pixels, cmd.w, cmd.h);
+            break;
+        case ILI9341_OP_FLUSH:
+            _tft.flush();
+            break;
+        case ILI9341_OP_CALL:
+            cmd.fn(_tft, cmd.arg);
+            break;
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief   Bus thread: run everything queued as one write transaction,
+             then sleep until a producer wakes it
+*/
+/**************************************************************************/
+void ILI9341_CommandQueue::busThread(void) {
+    ILI9341_Command cmd;
+    while (true) {
+        if (pop(cmd)) {
+            _tft.startWrite();
+            do {
+                run(cmd);
+                _done.fetch_add(1, std::memory_order_release);
+            } while (pop(cmd));
+            _tft.endWrite();
+            _batches.fetch_add(1, std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> lock(_lock);
+            }
+            _idle.notify_all();
+            continue;
+        }
+
+        _sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::unique_lock<std::mutex> lock(_lock);
+        _wake.wait(lock, [this]{ return _stop || ready(); });
+        _sleeping.store(false, std::memory_order_relaxed);
+        if (_stop && !ready()) break;
+    }
+    std::lock_guard<std::mutex> lock(_lock);
+    _running = false;
+    _idle.notify_all();
+}
+
+/**************************************************************************/
+/*!
+    @brief   Queue fillRect(). Arguments as for Adafruit_ILI9341::fillRect().
+    @return  False if the queue is full
+*/
+/**************************************************************************/
+bool ILI9341_CommandQueue::fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) {
+    ILI9341_Command cmd = {};
+    cmd.op = ILI9341_OP_FILL_RECT;
+    cmd.x = x; cmd.y = y; cmd.w = w; cmd.h = h;
+    cmd.color = color;
+    return push(cmd);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Queue drawPixel()
+    @return  False if the queue is full
+*/
+/**************************************************************************/
+bool ILI9341_CommandQueue::drawPixel(int16_t x, int16_t y, uint16_t color) {
+    ILI9341_Command cmd = {};
+    cmd.op = ILI9341_OP_PIXEL;
+    cmd.x = x; cmd.y = y;
+    cmd.color = color;
+    return push(cmd);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Queue drawFastHLine()
+    @return  False if the queue is full
+*/
+/**************************************************************************/
+bool ILI9341_CommandQueue::drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color) {
+    ILI9341_Command cmd = {};
+    cmd.op = ILI9341_OP_HLINE;
+    cmd.x = x; cmd.y = y; cmd.w = w;
+    cmd.color = color;
+    return push(cmd);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Queue drawFastVLine()
+    @return  False if the queue is full
+*/
+/**************************************************************************/
+bool ILI9341_CommandQueue::drawFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color) {
+    ILI9341_Command cmd = {};
+    cmd.op = ILI9341_OP_VLINE;
+    cmd.x = x; cmd.y = y; cmd.h = h;
+    cmd.color = color;
+    return push(cmd);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Queue drawText(). The string is copied, up to
+             ILI9341_QUEUE_TEXT - 1 characters.
+    @return  False if the queue is full
+*/
+/**************************************************************************/
+bool ILI9341_CommandQueue::drawText(int16_t x, int16_t y, const char *str,
+        uint16_t fg, uint16_t bg, uint8_t size) {
+    ILI9341_Command cmd = {};
+    cmd.op = ILI9341_OP_TEXT;
+    cmd.x = x; cmd.y = y;
+    cmd.color = fg;
+    cmd.bg = bg;
+    cmd.size = size;
+    strncpy(cmd.text, str, sizeof(cmd.text) - 1);
+    cmd.text[sizeof(cmd.text) - 1] = '\0';
+    return push(cmd);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Queue drawRGBBitmap(). The pixels are not copied and must stay
+             valid until the command has run, see sync().
+    @return  False if the queue is full
+*/
+/**************************************************************************/
+bool ILI9341_CommandQueue::drawRGBBitmap(int16_t x, int16_t y, const uint16_t *pixels, int16_t w, int16_t h) {
+    ILI9341_Command cmd = {};
+    cmd.op = ILI9341_OP_BITMAP;
+    cmd.x = x; cmd.y = y; cmd.w = w; cmd.h = h;
+    cmd.pixels = pixels;
+    return push(cmd);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Queue flush()
+    @return  False if the queue is full
+*/
+/**************************************************************************/
+bool ILI9341_CommandQueue::flush(void) {
+    ILI9341_Command cmd = {};
+    cmd.op = ILI9341_OP_FLUSH;
+    return push(cmd);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Queue a function to run on the bus thread, inside the batch's
+             write transaction
+    @param   fn  Function to call
+    @param   arg  Passed to fn
+    @return  False if the queue is full
+*/
+/**************************************************************************/
+bool ILI9341_CommandQueue::call(void (*fn)(Adafruit_ILI9341 &tft, void *arg), void *arg) {
+    ILI9341_Command cmd = {};
+    cmd.op = ILI9341_OP_CALL;
+    cmd.fn = fn;
+    cmd.arg = arg;
+    return push(cmd);
+}
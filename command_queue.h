@@ -0,0 +1,114 @@
+/*!
+* @file command_queue.h
+*
+* Multi-producer, single-consumer draw command queue for the ILI9341 driver.
+*
+* Any number of threads push draw commands without taking a lock; a single
+* bus thread pops them in order and runs them on the panel, one write
+* transaction per batch of queued commands. The queue is a bounded ring of
+* ILI9341_QUEUE_SIZE slots with a sequence number per slot, so producers
+* only contend on one atomic increment. When the ring is full a push fails
+* instead of blocking.
+*
+*/
+
+#ifndef _ILI9341_COMMAND_QUEUE_H_
+#define _ILI9341_COMMAND_QUEUE_H_
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "Adafruit_ILI9341.h"
+
+
+#define ILI9341_QUEUE_SIZE    256    ///< Commands the ring holds, a power of two
+#define ILI9341_QUEUE_TEXT    40     ///< Characters of text carried by one command
+
+
+/// Operations a queued command can carry
+enum ILI9341_CommandOp {
+    ILI9341_OP_FILL_RECT,   ///< fillRect(x, y, w, h, color)
+    ILI9341_OP_PIXEL,       ///< drawPixel(x, y, color)
+    ILI9341_OP_HLINE,       ///< drawFastHLine(x, y, w, color)
+    ILI9341_OP_VLINE,       ///< drawFastVLine(x, y, h, color)
+    ILI9341_OP_TEXT,        ///< drawText(x, y, text, color, bg, size)
+    ILI9341_OP_BITMAP,      ///< drawRGBBitmap(x, y, pixels, w, h)
+    ILI9341_OP_FLUSH,       ///< flush()
+    ILI9341_OP_CALL         ///< fn(tft, arg)
+};
+
+/// One queued draw command
+struct ILI9341_Command {
+    uint8_t  op;            ///< ILI9341_CommandOp
+    int16_t  x, y, w, h;    ///< Geometry
+    uint16_t color;         ///< Draw color, text foreground
+    uint16_t bg;            ///< Text background
+    uint8_t  size;          ///< Text scale
+    const uint16_t *pixels; ///< Bitmap, must stay valid until the command has run
+    void   (*fn)(Adafruit_ILI9341 &tft, void *arg); ///< ILI9341_OP_CALL function
+    void    *arg;           ///< ILI9341_OP_CALL argument
+    char     text[ILI9341_QUEUE_TEXT]; ///< ILI9341_OP_TEXT string, truncated to fit
+};
+
+/// Lock-free MPSC queue of draw commands run by one bus thread
+class ILI9341_CommandQueue {
+    public:
+        ILI9341_CommandQueue(Adafruit_ILI9341 &tft);
+        ~ILI9341_CommandQueue();
+
+        bool    start(void);
+        void    stop(void);
+
+        bool    push(const ILI9341_Command &cmd);
+        void    sync(void);
+
+        bool    fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color);
+        bool    drawPixel(int16_t x, int16_t y, uint16_t color);
+        bool    drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color);
+        bool    drawFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color);
+        bool    drawText(int16_t x, int16_t y, const char *str,
+                    uint16_t fg, uint16_t bg, uint8_t size = 1);
+        bool    drawRGBBitmap(int16_t x, int16_t y, const uint16_t *pixels, int16_t w, int16_t h);
+        bool    flush(void);
+        bool    call(void (*fn)(Adafruit_ILI9341 &tft, void *arg), void *arg);
+
+        /// Pushes refused because the ring was full
+        uint64_t dropped(void) const   { return _dropped.load(std::memory_order_relaxed); }
+        /// Batches run by the bus thread, one write transaction each
+        uint64_t batches(void) const   { return _batches.load(std::memory_order_relaxed); }
+
+    private:
+        ILI9341_CommandQueue(const ILI9341_CommandQueue &);
+        ILI9341_CommandQueue &operator=(const ILI9341_CommandQueue &);
+
+        bool    pop(ILI9341_Command &cmd);
+        bool    ready(void) const;
+        void    run(const ILI9341_Command &cmd);
+        void    busThread(void);
+
+        /// Ring slot; seq tells producers and the consumer whose turn it is
+        struct Slot {
+            std::atomic<uint32_t> seq;
+            ILI9341_Command cmd;
+        };
+
+        Adafruit_ILI9341 &_tft;
+        Slot        _slots[ILI9341_QUEUE_SIZE];
+        alignas(64) std::atomic<uint32_t> _head;  ///< Next slot producers claim
+        alignas(64) uint32_t _tail;               ///< Next slot the bus thread reads
+        std::atomic<uint32_t> _done;              ///< Commands run so far
+        std::atomic<uint64_t> _dropped;
+        std::atomic<uint64_t> _batches;
+
+        std::atomic<bool> _sleeping;              ///< Bus thread is waiting for work
+        bool        _running;                     ///< Bus thread has not exited, guarded by _lock
+        bool        _stop;                        ///< Asks the bus thread to exit
+        std::thread _thread;
+        std::mutex  _lock;                        ///< Only for sleeping and waking
+        std::condition_variable _wake;            ///< Bus thread waits here for work
+        std::condition_variable _idle;            ///< sync() waits here for _done
+};
+
+#endif
@@ -0,0 +1,331 @@
+/*!
+* @file compositor.cpp
+*
+* Layered compositor, see compositor.h.
+*
+*/
+
+#include <string.h>			//memcpy
+
+#include "compositor.h"
+
+
+ILI9341_Compositor::ILI9341_Compositor(Adafruit_ILI9341 &tft, uint16_t background) :
+        _tft(tft), _background(background), _layers(), _norder(0),
+        _width(0), _height(0), _cols(0), _rows(0) {}
+
+/**************************************************************************/
+/*!
+    @brief   Add a layer, initially visible at (0, 0)
+    @param   pixels  Native RGB565 image, must stay valid while the layer exists
+    @param   w  Image width
+    @param   h  Image height
+    @param   z  Stacking order, higher is in front; equal z stack by id
+    @param   stride  Pixels per image row, 0 for w
+    @return  Layer id, or -1 if all ILI9341_MAX_LAYERS slots are used
+*/
+/**************************************************************************/
+int8_t ILI9341_Compositor::addLayer(const uint16_t *pixels, int16_t w, int16_t h,
+        int16_t z, int16_t stride) {
+    if (!pixels || (w <= 0) || (h <= 0)) return -1;
+    for (int8_t id=0; id<ILI9341_MAX_LAYERS; id++) {
+        ILI9341_Layer &l = _layers[id];
+        if (l.pixels) continue;
+        l.pixels  = pixels;
+        l.w       = w;
+        l.h       = h;
+        l.stride  = stride ? stride : w;
+        l.x       = 0;
+        l.y       = 0;
+        l.z       = z;
+        l.visible = true;
+        l.keyed   = false;
+        l.key     = 0;
+        _order[_norder++] = id;
+        sortLayers();
+        markLayer(l);
+        return id;
+    }
+    return -1;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Remove a layer, uncovering what is below it
+    @param   id  Layer id
+*/
+/**************************************************************************/
+void ILI9341_Compositor::removeLayer(int8_t id) {
+    if ((id < 0) || (id >= ILI9341_MAX_LAYERS)) return;
+    ILI9341_Layer &l = _layers[id];
+    if (!l.pixels) return;
+    markLayer(l);
+    l.pixels = NULL;
+    uint8_t n = 0;
+    for (uint8_t i=0; i<_norder; i++) {
+        if (_order[i] != id) _order[n++] = _order[i];
+    }
+    _norder = n;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Move a layer. Only the tiles it leaves and enters are redrawn.
+    @param   id  Layer id
+    @param   x  New screen column of its top-left pixel
+    @param   y  New screen row of its top-left pixel
+*/
+/**************************************************************************/
+void ILI9341_Compositor::moveLayer(int8_t id, int16_t x, int16_t y) {
+    if ((id < 0) || (id >= ILI9341_MAX_LAYERS)) return;
+    ILI9341_Layer &l = _layers[id];
+    if ((l.x == x) && (l.y == y)) return;
+    markLayer(l);
+    l.x = x;
+    l.y = y;
+    markLayer(l);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Change the stacking order of a layer
+    @param   id  Layer id
+    @param   z  Stacking order, higher is in front
+*/
+/**************************************************************************/
+void ILI9341_Compositor::setZ(int8_t id, int16_t z) {
+    if ((id < 0) || (id >= ILI9341_MAX_LAYERS)) return;
+    ILI9341_Layer &l = _layers[id];
+    if (l.z == z) return;
+    l.z = z;
+    sortLayers();
+    markLayer(l);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Show or hide a layer
+    @param   id  Layer id
+    @param   visible  False to hide
+*/
+/**************************************************************************/
+void ILI9341_Compositor::setVisible(int8_t id, bool visible) {
+    if ((id < 0) || (id >= ILI9341_MAX_LAYERS)) return;
+    ILI9341_Layer &l = _layers[id];
+    if (l.visible == visible) return;
+    l.visible = true; // So markLayer() sees it either way
+    markLayer(l);
+    l.visible = visible;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Make one color of a layer transparent, for sprites and cursors
+    @param   id  Layer id
+    @param   enable  False to make the layer opaque again
+    @param   key  16-bit 5-6-5 color not drawn
+*/
+/**************************************************************************/
+void ILI9341_Compositor::setColorKey(int8_t id, bool enable, uint16_t key) {
+    if ((id < 0) || (id >= ILI9341_MAX_LAYERS)) return;
+    ILI9341_Layer &l = _layers[id];
+    l.keyed = enable;
+    l.key   = key;
+    markLayer(l);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Point a layer at another image of the same size, e.g. the next
+             animation frame
+    @param   id  Layer id
+    @param   pixels  Native RGB565 image
+*/
+/**************************************************************************/
+void ILI9341_Compositor::setPixels(int8_t id, const uint16_t *pixels) {
+    if ((id < 0) || (id >= ILI9341_MAX_LAYERS)) return;
+    ILI9341_Layer &l = _layers[id];
+    if (!pixels || (l.pixels == pixels)) return;
+    l.pixels = pixels;
+    markLayer(l);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Change the color shown where no layer covers the screen
+    @param   color  16-bit 5-6-5 color
+*/
+/**************************************************************************/
+void ILI9341_Compositor::setBackground(uint16_t color) {
+    if (_background == color) return;
+    _background = color;
+    invalidate(0, 0, _tft.width(), _tft.height());
+}
+
+/**************************************************************************/
+/*!
+    @brief   Look up a layer
+    @param   id  Layer id as returned by addLayer()
+    @return  The layer; a free slot (pixels NULL) if id is out of range
+*/
+/**************************************************************************/
+const ILI9341_Layer &ILI9341_Compositor::layer(int8_t id) const {
+    static const ILI9341_Layer none = ILI9341_Layer();
+    if ((id < 0) || (id >= ILI9341_MAX_LAYERS)) return none;
+    return _layers[id];
+}
+
+/**************************************************************************/
+/*!
+    @brief   Redraw a whole layer after its pixels changed in place
+    @param   id  Layer id
+*/
+/**************************************************************************/
+void ILI9341_Compositor::invalidate(int8_t id) {
+    if ((id < 0) || (id >= ILI9341_MAX_LAYERS)) return;
+    markLayer(_layers[id]);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Redraw a screen area on the next update(), e.g. after part of
+             a layer's pixels changed in place
+    @param   x  Left column
+    @param   y  Top row
+    @param   w  Width
+    @param   h  Height
+*/
+/**************************************************************************/
+void ILI9341_Compositor::invalidate(int16_t x, int16_t y, int16_t w, int16_t h) {
+    if (!_cols) return; // Before the first update everything is drawn anyway
+    int32_t x0 = (x < 0) ? 0 : x, x1 = ((int32_t)x + w < _width)  ? x + w : _width;
+    int32_t y0 = (y < 0) ? 0 : y, y1 = ((int32_t)y + h < _height) ? y + h : _height;
+    if ((x0 >= x1) || (y0 >= y1)) return;
+
+    int32_t c0 = x0 / ILI9341_TILE_SIZE, c1 = (x1 - 1) / ILI9341_TILE_SIZE;
+    int32_t r0 = y0 / ILI9341_TILE_SIZE, r1 = (y1 - 1) / ILI9341_TILE_SIZE;
+    for (int32_t r=r0; r<=r1; r++) {
+        for (int32_t c=c0; c<=c1; c++) {
+            _dirty[r * _cols + c] = 1;
+        }
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief   Mark the tiles a visible layer covers
+    @param   l  Layer
+*/
+/**************************************************************************/
+void ILI9341_Compositor::markLayer(const ILI9341_Layer &l) {
+    if (l.pixels && l.visible) invalidate(l.x, l.y, l.w, l.h);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Keep _order sorted back to front, by z and then by id
+*/
+/**************************************************************************/
+void ILI9341_Compositor::sortLayers(void) {
+    for (uint8_t i=1; i<_norder; i++) { // Insertion sort, there are few layers
+        uint8_t id = _order[i], j = i;
+        for (; j; j--) {
+            const ILI9341_Layer &prev = _layers[_order[j - 1]];
+            if ((prev.z < _layers[id].z) || ((prev.z == _layers[id].z) && (_order[j - 1] < id))) break;
+            _order[j] = _order[j - 1];
+        }
+        _order[j] = id;
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief   Compose one screen area into _scratch. Starts at the topmost
+             opaque layer covering all of it, so layers below cost nothing.
+    @param   x  Left column
+    @param   y  Top row
+    @param   w  Width
+    @param   h  Height
+*/
+/**************************************************************************/
+void ILI9341_Compositor::compose(int16_t x, int16_t y, int16_t w, int16_t h) {
+    uint16_t *buf = _scratch.data();
+    int8_t first = -1;
+    for (int8_t i=_norder - 1; i>=0; i--) {
+        const ILI9341_Layer &l = _layers[_order[i]];
+        if (l.visible && !l.keyed && (l.x <= x) && (l.y <= y) &&
+                (l.x + l.w >= x + w) && (l.y + l.h >= y + h)) {
+            first = i;
+            break;
+        }
+    }
+    if (first < 0) {
+        for (int32_t i=0; i<(int32_t)w * h; i++) buf[i] = _background;
+        first = 0;
+    }
+
+    for (uint8_t i=first; i<_norder; i++) {
+        const ILI9341_Layer &l = _layers[_order[i]];
+        if (!l.visible) continue;
+        int16_t x0 = (l.x > x) ? l.x : x, x1 = (l.x + l.w < x + w) ? l.x + l.w : x + w;
+        int16_t y0 = (l.y > y) ? l.y : y, y1 = (l.y + l.h < y + h) ? l.y + l.h : y + h;
+        if ((x0 >= x1) || (y0 >= y1)) continue;
+
+        for (int16_t row=y0; row<y1; row++) {
+            const uint16_t *src = l.pixels + (int32_t)(row - l.y) * l.stride + (x0 - l.x);
+            uint16_t *dst = buf + (int32_t)(row - y) * w + (x0 - x);
+            if (!l.keyed) {
+                memcpy(dst, src, (x1 - x0) * sizeof(uint16_t));
+                continue;
+            }
+            for (int16_t i=0; i<x1 - x0; i++) {
+                if (src[i] != l.key) dst[i] = src[i];
+            }
+        }
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief   Recompose the tiles changed since the last update and send
+             them, in one write transaction. Dirty tiles next to each
+             other in a tile row go out as one address window. The first
+             update, and the first after the screen size changed, draws
+             the whole screen.
+    @return  Number of pixels sent
+*/
+/**************************************************************************/
+uint32_t ILI9341_Compositor::update(void) {
+    if ((_tft.width() != _width) || (_tft.height() != _height)) {
+        _width  = _tft.width();
+        _height = _tft.height();
+        _cols   = (_width  + ILI9341_TILE_SIZE - 1) / ILI9341_TILE_SIZE;
+        _rows   = (_height + ILI9341_TILE_SIZE - 1) / ILI9341_TILE_SIZE;
+        _dirty.assign((size_t)_cols * _rows, 1);
+        _scratch.resize((size_t)_width * ILI9341_TILE_SIZE);
+    }
+
+    uint32_t sent = 0;
+    ILI9341_Transaction tx(_tft);
+    for (int16_t r=0; r<_rows; r++) {
+        uint8_t *dirty = &_dirty[(size_t)r * _cols];
+        for (int16_t c=0; c<_cols; ) {
+            if (!dirty[c]) {
+                c++;
+                continue;
+            }
+            int16_t end = c;
+            while ((end < _cols) && dirty[end]) dirty[end++] = 0;
+
+            int16_t x = c * ILI9341_TILE_SIZE, y = r * ILI9341_TILE_SIZE;
+            int16_t w = ((end * ILI9341_TILE_SIZE < _width) ? end * ILI9341_TILE_SIZE : _width) - x;
+            int16_t h = (y + ILI9341_TILE_SIZE < _height) ? ILI9341_TILE_SIZE : _height - y;
+            compose(x, y, w, h);
+            _tft.setAddrWindow(x, y, w, h);
+            _tft.writePixels(_scratch.data(), (uint32_t)w * h);
+            sent += (uint32_t)w * h;
+            c = end;
+        }
+    }
+    return sent;
+}
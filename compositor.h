@@ -0,0 +1,76 @@
+/*!
+* @file compositor.h
+*
+* Layered compositor for the ILI9341 driver.
+*
+* The compositor owns a stack of layers (a background image, widgets,
+* sprites, a cursor), each an RGB565 image with a position and a z order.
+* Changing a layer only marks the ILI9341_TILE_SIZE tiles it covered and
+* now covers; update() recomposes just those tiles, bottom layer first,
+* and streams them out with setAddrWindow() and bulk pixel writes. The
+* cost of an update follows the changed area, and layers hidden under an
+* opaque one are never read.
+*
+*/
+
+#ifndef _ILI9341_COMPOSITOR_H_
+#define _ILI9341_COMPOSITOR_H_
+
+#include <vector>
+
+#include "Adafruit_ILI9341.h"
+
+
+#define ILI9341_MAX_LAYERS  16      ///< Layers one compositor holds
+
+
+/// One compositor layer
+struct ILI9341_Layer {
+    const uint16_t *pixels;     ///< Native RGB565 image, not copied; NULL if the slot is free
+    int16_t  w, h;              ///< Image size
+    int16_t  stride;            ///< Pixels per image row
+    int16_t  x, y;              ///< Screen position of the top-left pixel
+    int16_t  z;                 ///< Stacking order, higher is in front
+    bool     visible;
+    bool     keyed;             ///< Pixels equal to key are transparent
+    uint16_t key;
+};
+
+/// Stack of layers recomposed tile by tile onto one panel
+class ILI9341_Compositor {
+    public:
+        ILI9341_Compositor(Adafruit_ILI9341 &tft, uint16_t background = ILI9341_BLACK);
+
+        int8_t      addLayer(const uint16_t *pixels, int16_t w, int16_t h,
+                             int16_t z = 0, int16_t stride = 0);
+        void        removeLayer(int8_t id);
+        void        moveLayer(int8_t id, int16_t x, int16_t y);
+        void        setZ(int8_t id, int16_t z);
+        void        setVisible(int8_t id, bool visible);
+        void        setColorKey(int8_t id, bool enable, uint16_t key = 0);
+        void        setPixels(int8_t id, const uint16_t *pixels);
+        void        setBackground(uint16_t color);
+        void        invalidate(int8_t id);
+        void        invalidate(int16_t x, int16_t y, int16_t w, int16_t h);
+
+        uint32_t    update(void);
+
+        const ILI9341_Layer &layer(int8_t id) const;
+
+    private:
+        void        markLayer(const ILI9341_Layer &l);
+        void        sortLayers(void);
+        void        compose(int16_t x, int16_t y, int16_t w, int16_t h);
+
+        Adafruit_ILI9341 &_tft;
+        uint16_t    _background;                    ///< Shown where no layer covers the screen
+        ILI9341_Layer _layers[ILI9341_MAX_LAYERS];
+        uint8_t     _order[ILI9341_MAX_LAYERS];     ///< Ids of used layers, back to front
+        uint8_t     _norder;
+        int16_t     _width, _height;                ///< Screen size _dirty was made for
+        int16_t     _cols, _rows;                   ///< Tiles across and down
+        std::vector<uint8_t>  _dirty;               ///< One flag per tile
+        std::vector<uint16_t> _scratch;             ///< One composed tile row
+};
+
+#endif
@@ -0,0 +1,271 @@
+/*!
+* @file display_list.cpp
+*
+* Recorded draw calls and their optimizer, see display_list.h.
+*
+*/
+
+#include <stddef.h>
+
+#include "display_list.h"
+
+
+/**************************************************************************/
+/*!
+    @brief   Append a solid rectangle
+    @param   x  Left column
+    @param   y  Top row
+    @param   w  Width, already clipped
+    @param   h  Height, already clipped
+    @param   color  16-bit 5-6-5 color
+*/
+/**************************************************************************/
+void ILI9341_DisplayList::fill(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) {
+    ILI9341_DisplayOp op = {};
+    op.x = x; op.y = y; op.w = w; op.h = h;
+    op.kind  = ILI9341_DL_FILL;
+    op.color = color;
+    _ops.push_back(op);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Append a bitmap. The pixels are referenced, not copied, and
+             must outlive every replay.
+    @param   x  Left column
+    @param   y  Top row
+    @param   w  Width, already clipped
+    @param   h  Height, already clipped
+    @param   pixels  Top-left pixel of the clipped area
+    @param   stride  Pixels per source row
+*/
+/**************************************************************************/
+void ILI9341_DisplayList::bitmap(int16_t x, int16_t y, int16_t w, int16_t h,
+        const uint16_t *pixels, int16_t stride) {
+    ILI9341_DisplayOp op = {};
+    op.x = x; op.y = y; op.w = w; op.h = h;
+    op.kind   = ILI9341_DL_BITMAP;
+    op.stride = stride;
+    op.pixels = pixels;
+    _ops.push_back(op);
+}
+
+static bool overlaps(const ILI9341_DisplayOp &a, const ILI9341_DisplayOp &b) {
+    return (a.x < b.x + b.w) && (b.x < a.x + a.w) &&
+           (a.y < b.y + b.h) && (b.y < a.y + a.h);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Rewrite the list to draw the same image with fewer bytes and
+             window changes: operations hidden by later ones are dropped
+             or trimmed, neighbouring rectangles of one color are merged,
+             and independent operations are ordered so consecutive ones
+             share their column or page range.
+    @return  Number of operations removed
+*/
+/**************************************************************************/
+uint32_t ILI9341_DisplayList::optimize(void) {
+    uint32_t removed = dropHidden();
+    removed += mergeFills();
+    reorder();
+    return removed;
+}
+
+/// One bit per pixel, set where a later operation draws
+class Coverage {
+    public:
+        Coverage(int32_t w, int32_t h) : _words((w + 63) / 64), _bits((size_t)_words * h, 0) {}
+
+        bool rowCovered(int32_t y, int32_t x, int32_t w) const {
+            const uint64_t *row = &_bits[(size_t)y * _words];
+            for (int32_t i=x; i<x+w; ) {
+                int32_t bit = i & 63, n = 64 - bit;
+                if (n > x + w - i) n = x + w - i;
+                uint64_t mask = (n == 64) ? ~0ULL : (((1ULL << n) - 1) << bit);
+                if ((row[i >> 6] & mask) != mask) return false;
+                i += n;
+            }
+            return true;
+        }
+        bool colCovered(int32_t x, int32_t y, int32_t h) const {
+            for (int32_t row=y; row<y+h; row++) {
+                if (!((_bits[(size_t)row * _words + (x >> 6)] >> (x & 63)) & 1)) return false;
+            }
+            return true;
+        }
+        void cover(const ILI9341_DisplayOp &op) {
+            for (int32_t y=op.y; y<op.y+op.h; y++) {
+                uint64_t *row = &_bits[(size_t)y * _words];
+                for (int32_t i=op.x; i<op.x+op.w; ) {
+                    int32_t bit = i & 63, n = 64 - bit;
+                    if (n > op.x + op.w - i) n = op.x + op.w - i;
+                    row[i >> 6] |= (n == 64) ? ~0ULL : (((1ULL << n) - 1) << bit);
+                    i += n;
+                }
+            }
+        }
+
+    private:
+        int32_t _words;                 ///< 64-bit words per row
+        std::vector<uint64_t> _bits;
+};
+
+/**************************************************************************/
+/*!
+    @brief   Walk the list backwards tracking which pixels later operations
+             draw. Operations drawn over completely are dropped; rows and
+             columns drawn over at their edges are trimmed off.
+    @return  Number of operations removed
+*/
+/**************************************************************************/
+uint32_t ILI9341_DisplayList::dropHidden(void) {
+    int32_t w = 0, h = 0;
+    for (size_t i=0; i<_ops.size(); i++) {
+        if (_ops[i].x + _ops[i].w > w) w = _ops[i].x + _ops[i].w;
+        if (_ops[i].y + _ops[i].h > h) h = _ops[i].y + _ops[i].h;
+    }
+    Coverage later(w, h);
+
+    std::vector<ILI9341_DisplayOp> kept;
+    for (size_t i=_ops.size(); i-- > 0; ) {
+        ILI9341_DisplayOp op = _ops[i];
+        int16_t x0 = op.x, y0 = op.y;
+        while ((op.h > 0) && later.rowCovered(op.y, op.x, op.w)) { op.y++; op.h--; }
+        while ((op.h > 0) && later.rowCovered(op.y + op.h - 1, op.x, op.w)) op.h--;
+        while ((op.h > 0) && (op.w > 0) && later.colCovered(op.x, op.y, op.h)) { op.x++; op.w--; }
+        while ((op.h > 0) && (op.w > 0) && later.colCovered(op.x + op.w - 1, op.y, op.h)) op.w--;
+        if ((op.w <= 0) || (op.h <= 0)) continue;
+
+        if (op.kind == ILI9341_DL_BITMAP) {
+            op.pixels += (int32_t)(op.y - y0) * op.stride + (op.x - x0);
+        }
+        later.cover(op);
+        kept.push_back(op);
+    }
+    uint32_t removed = _ops.size() - kept.size();
+    _ops.assign(kept.rbegin(), kept.rend());
+    return removed;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Merge pairs of same-colored rectangles that share a whole edge,
+             such as the pixels of a run or the rows of a bar. A pair is
+             only merged if no operation between them draws over the one
+             that would move.
+    @return  Number of operations removed
+*/
+/**************************************************************************/
+uint32_t ILI9341_DisplayList::mergeFills(void) {
+    std::vector<bool> dead(_ops.size(), false);
+    uint32_t removed = 0;
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (size_t i=0; i<_ops.size(); i++) {
+            if (dead[i] || (_ops[i].kind != ILI9341_DL_FILL)) continue;
+            size_t end = i + 1 + ILI9341_DL_MERGE_WINDOW;
+            if (end > _ops.size()) end = _ops.size();
+            for (size_t j=i+1; j<end; j++) {
+                if (dead[j]) continue;
+                ILI9341_DisplayOp &a = _ops[i], &b = _ops[j];
+                if ((b.kind != ILI9341_DL_FILL) || (b.color != a.color)) continue;
+
+                ILI9341_DisplayOp u = a;
+                if ((a.y == b.y) && (a.h == b.h) && ((a.x + a.w == b.x) || (b.x + b.w == a.x))) {
+                    u.x = (a.x < b.x) ? a.x : b.x;
+                    u.w = a.w + b.w;
+                } else if ((a.x == b.x) && (a.w == b.w) && ((a.y + a.h == b.y) || (b.y + b.h == a.y))) {
+                    u.y = (a.y < b.y) ? a.y : b.y;
+                    u.h = a.h + b.h;
+                } else {
+                    continue;
+                }
+
+                // Either a moves forward to j or b moves back to i
+                bool aMoves = true, bMoves = true;
+                for (size_t k=i+1; k<j && (aMoves || bMoves); k++) {
+                    if (dead[k]) continue;
+                    if (overlaps(_ops[k], a)) aMoves = false;
+                    if (overlaps(_ops[k], b)) bMoves = false;
+                }
+                if (bMoves) {
+                    a = u;
+                    dead[j] = true;
+                } else if (aMoves) {
+                    b = u;
+                    dead[i] = true;
+                } else {
+                    continue;
+                }
+                removed++;
+                merged = true;
+                if (dead[i]) break;
+            }
+        }
+    }
+
+    size_t n = 0;
+    for (size_t i=0; i<_ops.size(); i++) {
+        if (!dead[i]) _ops[n++] = _ops[i];
+    }
+    _ops.resize(n);
+    return removed;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Reorder operations so that consecutive ones share the column
+             range (CASET) or page range (PASET) and the driver can skip
+             those commands. An operation never moves past an earlier one
+             it overlaps, so the image is unchanged.
+*/
+/**************************************************************************/
+void ILI9341_DisplayList::reorder(void) {
+    size_t n = _ops.size();
+    std::vector<std::vector<uint32_t> > after(n);  // Operations that must wait for i
+    std::vector<uint32_t> waiting(n, 0);            // Earlier overlapping operations not emitted yet
+    for (size_t i=0; i<n; i++) {
+        for (size_t j=i+1; j<n; j++) {
+            if (overlaps(_ops[i], _ops[j])) {
+                after[i].push_back(j);
+                waiting[j]++;
+            }
+        }
+    }
+
+    std::vector<uint32_t> ready;
+    for (size_t i=0; i<n; i++) {
+        if (!waiting[i]) ready.push_back(i);
+    }
+
+    std::vector<ILI9341_DisplayOp> out;
+    out.reserve(n);
+    while (!ready.empty()) {
+        // Prefer sharing both ranges, then one; ties go to the earliest
+        size_t pick = 0;
+        int best = -1;
+        for (size_t r=0; r<ready.size(); r++) {
+            const ILI9341_DisplayOp &op = _ops[ready[r]];
+            int score = 0;
+            if (!out.empty()) {
+                const ILI9341_DisplayOp &last = out.back();
+                if ((op.x == last.x) && (op.w == last.w)) score++;
+                if ((op.y == last.y) && (op.h == last.h)) score++;
+            }
+            if ((score > best) || ((score == best) && (ready[r] < ready[pick]))) {
+                best = score;
+                pick = r;
+            }
+        }
+        uint32_t i = ready[pick];
+        ready[pick] = ready.back();
+        ready.pop_back();
+        out.push_back(_ops[i]);
+        for (size_t k=0; k<after[i].size(); k++) {
+            if (--waiting[after[i][k]] == 0) ready.push_back(after[i][k]);
+        }
+    }
+    _ops.swap(out);
+}
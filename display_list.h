@@ -0,0 +1,63 @@
+/*!
+* @file display_list.h
+*
+* Recorded draw calls for the ILI9341 driver.
+*
+* While Adafruit_ILI9341::beginRecording() is active, rectangle, line,
+* pixel and RGB565 bitmap calls are clipped and appended to an
+* ILI9341_DisplayList instead of being sent. optimize() then rewrites the
+* list so it draws the same image with less bus traffic, and
+* Adafruit_ILI9341::drawList() replays it as often as needed.
+*
+*/
+
+#ifndef _ILI9341_DISPLAY_LIST_H_
+#define _ILI9341_DISPLAY_LIST_H_
+
+#include <stdint.h>			//uint_t
+
+#include <vector>
+
+
+#define ILI9341_DL_MERGE_WINDOW  32     ///< Later operations optimize() tries to merge each one with
+
+
+/// Kinds of recorded operation
+enum ILI9341_DisplayOpKind {
+    ILI9341_DL_FILL,        ///< Solid rectangle
+    ILI9341_DL_BITMAP       ///< RGB565 pixels
+};
+
+/// One recorded operation, already clipped to the screen
+struct ILI9341_DisplayOp {
+    int16_t  x, y, w, h;        ///< Area drawn
+    uint8_t  kind;              ///< ILI9341_DisplayOpKind
+    uint16_t color;             ///< ILI9341_DL_FILL color
+    int16_t  stride;            ///< ILI9341_DL_BITMAP pixels per source row
+    const uint16_t *pixels;     ///< ILI9341_DL_BITMAP top-left pixel, not copied
+};
+
+/// Recorded list of draw operations
+class ILI9341_DisplayList {
+    public:
+        void        clear(void)         { _ops.clear(); }
+        void        fill(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color);
+        void        bitmap(int16_t x, int16_t y, int16_t w, int16_t h,
+                           const uint16_t *pixels, int16_t stride);
+
+        uint32_t    optimize(void);
+
+        /// Number of operations
+        uint32_t    size(void) const    { return _ops.size(); }
+        /// Operation i, in replay order
+        const ILI9341_DisplayOp &operator[](uint32_t i) const { return _ops[i]; }
+
+    private:
+        uint32_t    dropHidden(void);
+        uint32_t    mergeFills(void);
+        void        reorder(void);
+
+        std::vector<ILI9341_DisplayOp> _ops;
+};
+
+#endif
@@ -0,0 +1,34 @@
+/*!
+* @file font.h
+*
+* Compact bitmap font format for the ILI9341 text renderer.
+*
+* Glyphs are stored column by column, one byte per column with bit 0 at the
+* top, so a font is at most 8 pixels tall. Every glyph in a font has the
+* same width. ILI9341_Font5x7 is the classic 5x7 ASCII font (with one row
+* for descenders) that Adafruit_GFX ships as its default.
+*
+*/
+
+#ifndef _ILI9341_FONT_H_
+#define _ILI9341_FONT_H_
+
+#include <stdint.h>			//uint_t
+
+
+#define ILI9341_FONT_MAX_WIDTH  8    ///< Largest glyph width plus spacing
+#define ILI9341_FONT_MAX_HEIGHT 8    ///< Rows in a column byte
+
+/// Fixed-width bitmap font
+struct ILI9341_Font {
+    const uint8_t *columns; ///< width bytes per glyph, first to last, bit 0 = top row
+    uint8_t width;          ///< Columns per glyph
+    uint8_t height;         ///< Rows per glyph, at most ILI9341_FONT_MAX_HEIGHT
+    uint8_t spacing;        ///< Blank columns after each glyph
+    uint8_t first;          ///< First character in the table
+    uint8_t last;           ///< Last character in the table
+};
+
+extern const ILI9341_Font ILI9341_Font5x7;
+
+#endif
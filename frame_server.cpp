@@ -0,0 +1,401 @@
+/*!
+* @file frame_server.cpp
+*
+* Shared-memory frame server and client, see frame_server.h.
+*
+*/
+
+#include <errno.h>
+#include <fcntl.h>			//O_* flags
+#include <signal.h>			//kill
+#include <string.h>			//memset
+#include <time.h>			//clock_gettime
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frame_server.h"
+
+
+/// Make the control block usable again after its lock owner died in the middle of an update
+static void shmRecover(ILI9341_ShmHeader *shm) {
+    pthread_mutex_consistent(&shm->lock);
+    if (shm->ndamage > ILI9341_SHM_MAX_DAMAGE) {
+        shm->ndamage = ILI9341_SHM_MAX_DAMAGE;
+    }
+}
+
+/// Lock the control block, recovering it if a client died holding it
+static void shmLock(ILI9341_ShmHeader *shm) {
+    if (pthread_mutex_lock(&shm->lock) == EOWNERDEAD) {
+        shmRecover(shm);
+    }
+}
+
+static void shmUnlock(ILI9341_ShmHeader *shm) {
+    pthread_mutex_unlock(&shm->lock);
+}
+
+/// CLOCK_MONOTONIC time ms from now, for the condition variables
+static struct timespec deadline(uint32_t ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec  += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+static int32_t rectArea(const ILI9341_Rect &r) {
+    return (int32_t)r.w * r.h;
+}
+
+static ILI9341_Rect rectUnion(const ILI9341_Rect &a, const ILI9341_Rect &b) {
+    ILI9341_Rect u;
+    u.x = (a.x < b.x) ? a.x : b.x;
+    u.y = (a.y < b.y) ? a.y : b.y;
+    u.w = ((a.x + a.w > b.x + b.w) ? a.x + a.w : b.x + b.w) - u.x;
+    u.h = ((a.y + a.h > b.y + b.h) ? a.y + a.h : b.y + b.h) - u.y;
+    return u;
+}
+
+
+ILI9341_FrameServer::ILI9341_FrameServer(Adafruit_ILI9341 &tft, const char *name, uint32_t rate) :
+        _tft(tft), _name(name), _rate(rate), _stop(false), _frames(0),
+        _shm(NULL), _size(0), _pixels(NULL), _width(0), _height(0) {}
+
+ILI9341_FrameServer::~ILI9341_FrameServer() {
+    end();
+}
+
+/**************************************************************************/
+/*!
+    @brief   Create the shared segment, sized for the panel's current
+             rotation. A segment left behind by a server that died is
+             replaced; one owned by a running server is not.
+    @return  False if the segment could not be created
+*/
+/**************************************************************************/
+bool ILI9341_FrameServer::begin(void) {
+    if (_shm) return true;
+    if (create()) return true;
+    if (errno != EEXIST) {
+        printf("Frame server: shm_open %s failed: %s\n", _name, strerror(errno));
+        return false;
+    }
+
+    // Check whether the owner of the existing segment is still alive
+    ILI9341_FrameClient old;
+    if (old.open(_name) && old.connected()) {
+        printf("Frame server: %s is served by another process\n", _name);
+        return false;
+    }
+    old.close();
+    shm_unlink(_name);
+    if (create()) return true;
+    printf("Frame server: shm_open %s failed: %s\n", _name, strerror(errno));
+    return false;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Create, size, map and initialize a new segment
+    @return  False with errno set on failure
+*/
+/**************************************************************************/
+bool ILI9341_FrameServer::create(void) {
+    int fd = shm_open(_name, O_CREAT | O_EXCL | O_RDWR, 0660); // Owner and group may draw
+    if (fd < 0) return false;
+
+    uint32_t offset = (sizeof(ILI9341_ShmHeader) + 63) & ~63u; // Cache-line aligned pixels
+    size_t size = offset + (size_t)_tft.width() * _tft.height() * sizeof(uint16_t);
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    int err = errno;
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(_name);
+        errno = err;
+        return false;
+    }
+
+    _shm    = (ILI9341_ShmHeader *)p;
+    _size   = size;
+    _pixels = (uint16_t *)((uint8_t *)p + offset);
+    _width  = _tft.width();
+    _height = _tft.height();
+    memset(_shm, 0, offset); // ftruncate zeroed the pixels
+
+    pthread_mutexattr_t ma;
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&_shm->lock, &ma);
+    pthread_mutexattr_destroy(&ma);
+
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&_shm->damaged, &ca);
+    pthread_cond_init(&_shm->flushed, &ca);
+    pthread_condattr_destroy(&ca);
+
+    _shm->version     = ILI9341_SHM_VERSION;
+    _shm->pixelOffset = offset;
+    _shm->serverPid   = getpid();
+    _shm->width       = _width;
+    _shm->height      = _height;
+    __atomic_store_n(&_shm->magic, ILI9341_SHM_MAGIC, __ATOMIC_RELEASE); // Clients may attach now
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Remove the segment. Attached clients keep their mapping but
+             see connected() turn false.
+*/
+/**************************************************************************/
+void ILI9341_FrameServer::end(void) {
+    if (!_shm) return;
+    shmLock(_shm);
+    __atomic_store_n(&_shm->magic, 0, __ATOMIC_RELEASE);
+    _shm->completed = _shm->submitted; // Nothing more will be sent, release waiters
+    pthread_cond_broadcast(&_shm->flushed);
+    shmUnlock(_shm);
+    munmap(_shm, _size);
+    shm_unlink(_name);
+    _shm    = NULL;
+    _pixels = NULL;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Send damaged regions straight from shared memory, one address
+             window and one pixel stream per region
+    @param   rects  Regions as clients wrote them; any client may write the
+             segment, so each is clipped to the framebuffer here
+    @param   n  Number of regions
+*/
+/**************************************************************************/
+void ILI9341_FrameServer::send(const ILI9341_Rect *rects, uint8_t n) {
+    ILI9341_Transaction tx(_tft);
+    for (uint8_t i=0; i<n; i++) {
+        // Our own size, not the header's, which clients can also write
+        int32_t x0 = (rects[i].x < 0) ? 0 : rects[i].x;
+        int32_t y0 = (rects[i].y < 0) ? 0 : rects[i].y;
+        int32_t x1 = (int32_t)rects[i].x + rects[i].w;
+        int32_t y1 = (int32_t)rects[i].y + rects[i].h;
+        if (x1 > _width)  x1 = _width;
+        if (y1 > _height) y1 = _height;
+        if ((x0 >= x1) || (y0 >= y1)) continue;
+
+        _tft.setAddrWindow(x0, y0, x1 - x0, y1 - y0);
+        for (int32_t row=y0; row<y1; row++) { // Rows continue the same RAMWR
+            _tft.writePixels(_pixels + row * _width + x0, x1 - x0);
+        }
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief   Serve frames until stop(). Damage submitted while a frame is
+             being sent, or before the next flush is due, is collected and
+             sent together.
+*/
+/**************************************************************************/
+void ILI9341_FrameServer::run(void) {
+    if (!_shm) return;
+    ILI9341_Rect rects[ILI9341_SHM_MAX_DAMAGE];
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (!_stop.load()) {
+        shmLock(_shm);
+        while ((_shm->submitted == _shm->completed) && !_stop.load()) {
+            struct timespec ts = deadline(ILI9341_SHM_POLL_MS);
+            if (pthread_cond_timedwait(&_shm->damaged, &_shm->lock, &ts) == EOWNERDEAD) {
+                shmRecover(_shm);
+            }
+        }
+        // A client may have died mid-update or written garbage
+        uint8_t  n     = _shm->ndamage;
+        if (n > ILI9341_SHM_MAX_DAMAGE) n = ILI9341_SHM_MAX_DAMAGE;
+        uint32_t fence = _shm->submitted;
+        memcpy(rects, _shm->damage, n * sizeof(ILI9341_Rect));
+        _shm->ndamage = 0;
+        shmUnlock(_shm);
+        if (_stop.load()) break;
+
+        send(rects, n);
+        _frames++;
+
+        shmLock(_shm);
+        _shm->completed = fence;
+        pthread_cond_broadcast(&_shm->flushed);
+        shmUnlock(_shm);
+
+        uint32_t rate = _rate;
+        if (rate) { // Next flush no earlier than one period after this one started
+            next.tv_nsec += 1000000000L / rate;
+            while (next.tv_nsec >= 1000000000L) {
+                next.tv_sec++;
+                next.tv_nsec -= 1000000000L;
+            }
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec > next.tv_sec) || ((now.tv_sec == next.tv_sec) && (now.tv_nsec > next.tv_nsec))) {
+                next = now; // Running late, don't try to catch up
+            } else {
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+            }
+        }
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief   Attach to a server's segment
+    @param   name  Segment name the server was started with
+    @return  False if no compatible server segment exists
+*/
+/**************************************************************************/
+bool ILI9341_FrameClient::open(const char *name) {
+    close();
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return false;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if ((fstat(fd, &st) == 0) && ((size_t)st.st_size >= sizeof(ILI9341_ShmHeader))) {
+        p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (p == MAP_FAILED) return false;
+
+    ILI9341_ShmHeader *shm = (ILI9341_ShmHeader *)p;
+    if ((__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != ILI9341_SHM_MAGIC) ||
+            (shm->version != ILI9341_SHM_VERSION) ||
+            ((size_t)shm->pixelOffset + (size_t)shm->width * shm->height * 2 > (size_t)st.st_size)) {
+        munmap(p, st.st_size);
+        return false;
+    }
+    _shm    = shm;
+    _size   = st.st_size;
+    _pixels = (uint16_t *)((uint8_t *)p + shm->pixelOffset);
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Detach from the segment
+*/
+/**************************************************************************/
+void ILI9341_FrameClient::close(void) {
+    if (!_shm) return;
+    munmap(_shm, _size);
+    _shm    = NULL;
+    _pixels = NULL;
+}
+
+/**************************************************************************/
+/*!
+    @brief   True while the server that created the segment is running
+*/
+/**************************************************************************/
+bool ILI9341_FrameClient::connected(void) const {
+    if (!_shm || (__atomic_load_n(&_shm->magic, __ATOMIC_ACQUIRE) != ILI9341_SHM_MAGIC)) return false;
+    return (kill(_shm->serverPid, 0) == 0) || (errno == EPERM);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Tell the server a region of the shared pixels is ready to be
+             sent. When ILI9341_SHM_MAX_DAMAGE regions are already pending,
+             it is merged into the one that grows least.
+    @param   x  Left column
+    @param   y  Top row
+    @param   w  Width
+    @param   h  Height
+    @return  Fence for waitFence(), 0 when not attached
+*/
+/**************************************************************************/
+uint32_t ILI9341_FrameClient::submit(int16_t x, int16_t y, int16_t w, int16_t h) {
+    if (!_shm) return 0;
+
+    // Clip to the framebuffer
+    int32_t x2 = (int32_t)x + w, y2 = (int32_t)y + h;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x2 > _shm->width)  x2 = _shm->width;
+    if (y2 > _shm->height) y2 = _shm->height;
+
+    shmLock(_shm);
+    uint32_t fence = ++_shm->submitted;
+    if (!fence) fence = ++_shm->submitted; // 0 means "not attached"
+    if ((x2 > x) && (y2 > y)) {
+        ILI9341_Rect r;
+        r.x = x;
+        r.y = y;
+        r.w = x2 - x;
+        r.h = y2 - y;
+        if (_shm->ndamage < ILI9341_SHM_MAX_DAMAGE) {
+            _shm->damage[_shm->ndamage++] = r;
+        } else if (_shm->ndamage > ILI9341_SHM_MAX_DAMAGE) { // Written by a broken client
+            _shm->ndamage = ILI9341_SHM_MAX_DAMAGE;
+            _shm->damage[0] = rectUnion(_shm->damage[0], r);
+        } else {
+            uint8_t best = 0;
+            int32_t bestGrowth = 0;
+            for (uint8_t i=0; i<ILI9341_SHM_MAX_DAMAGE; i++) {
+                int32_t growth = rectArea(rectUnion(_shm->damage[i], r)) - rectArea(_shm->damage[i]);
+                if (!i || (growth < bestGrowth)) {
+                    best = i;
+                    bestGrowth = growth;
+                }
+            }
+            _shm->damage[best] = rectUnion(_shm->damage[best], r);
+        }
+    }
+    pthread_cond_signal(&_shm->damaged);
+    shmUnlock(_shm);
+    return fence;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Tell the server the whole framebuffer is ready to be sent
+    @return  Fence for waitFence(), 0 when not attached
+*/
+/**************************************************************************/
+uint32_t ILI9341_FrameClient::submit(void) {
+    return submit(0, 0, width(), height());
+}
+
+/**************************************************************************/
+/*!
+    @brief   Wait until a submitted frame has reached the panel
+    @param   fence  Value returned by submit()
+    @param   timeoutMs  Longest wait in milliseconds
+    @return  False on timeout or when not attached
+*/
+/**************************************************************************/
+bool ILI9341_FrameClient::waitFence(uint32_t fence, uint32_t timeoutMs) {
+    if (!_shm || !fence) return false;
+    struct timespec ts = deadline(timeoutMs);
+    shmLock(_shm);
+    int rc = 0;
+    while (((int32_t)(_shm->completed - fence) < 0) && (rc != ETIMEDOUT)) {
+        rc = pthread_cond_timedwait(&_shm->flushed, &_shm->lock, &ts);
+        if (rc == EOWNERDEAD) {
+            shmRecover(_shm);
+        }
+    }
+    bool done = (int32_t)(_shm->completed - fence) >= 0;
+    shmUnlock(_shm);
+    return done;
+}
@@ -0,0 +1,118 @@
+/*!
+* @file frame_server.h
+*
+* Shared-memory frame server for the ILI9341 driver.
+*
+* Only one process can own the SPI controller, so ILI9341_FrameServer owns
+* the panel and publishes a POSIX shared-memory segment holding a native
+* RGB565 framebuffer and a small control block. Other processes attach
+* with ILI9341_FrameClient, draw straight into the shared pixels, and
+* submit damage rectangles. The server sends the damaged regions to the
+* panel at most rate times per second, straight from shared memory.
+*
+* Each submit returns a fence. Once waitFence() returns for it, the frame
+* has reached the panel and the damaged area may be drawn again without
+* tearing. The control block is guarded by a process-shared robust mutex,
+* so a client that dies while holding it does not wedge the server.
+*
+*/
+
+#ifndef _ILI9341_FRAME_SERVER_H_
+#define _ILI9341_FRAME_SERVER_H_
+
+#include <pthread.h>
+#include <atomic>
+
+#include "Adafruit_ILI9341.h"
+
+
+#define ILI9341_SHM_NAME        "/ili9341"  ///< Default segment name
+#define ILI9341_SHM_MAGIC       0x39333431  ///< "9341", set once the segment is ready
+#define ILI9341_SHM_VERSION     1           ///< Bumped when ILI9341_ShmHeader changes
+#define ILI9341_SHM_MAX_DAMAGE  16          ///< Pending damage rectangles before they merge
+#define ILI9341_SHM_RATE        30          ///< Default flushes per second
+#define ILI9341_SHM_POLL_MS     100         ///< How often an idle server checks for stop()
+
+
+/// Control block at the start of the shared segment
+struct ILI9341_ShmHeader {
+    uint32_t magic;                 ///< ILI9341_SHM_MAGIC while a server runs
+    uint32_t version;               ///< ILI9341_SHM_VERSION
+    uint32_t pixelOffset;           ///< Bytes from the segment start to the pixels
+    int32_t  serverPid;
+    int16_t  width, height;         ///< Framebuffer size, rows are width pixels
+    pthread_mutex_t lock;           ///< Guards everything below
+    pthread_cond_t  damaged;        ///< Signalled by clients on submit
+    pthread_cond_t  flushed;        ///< Broadcast by the server when completed moves
+    uint32_t submitted;             ///< Fence of the last submitted frame
+    uint32_t completed;             ///< Fence of the last frame on the panel
+    uint8_t  ndamage;
+    ILI9341_Rect damage[ILI9341_SHM_MAX_DAMAGE];    ///< Regions not sent yet
+};
+
+/// Owns the panel and flushes what clients draw into shared memory
+class ILI9341_FrameServer {
+    public:
+        ILI9341_FrameServer(Adafruit_ILI9341 &tft, const char *name = ILI9341_SHM_NAME,
+                            uint32_t rate = ILI9341_SHM_RATE);
+        ~ILI9341_FrameServer();
+
+        bool        begin(void);
+        void        end(void);
+        void        run(void);
+        /// Make run() return, safe from a signal handler
+        void        stop(void)              { _stop.store(true); }
+        /// Change the flush rate, 0 to flush as soon as damage arrives
+        void        setRate(uint32_t rate)  { _rate = rate; }
+        /// Frames sent to the panel so far
+        uint32_t    frames(void) const      { return _frames; }
+        /// Shared pixels, for drawing a first frame in the server itself
+        uint16_t   *pixels(void)            { return _pixels; }
+
+    private:
+        ILI9341_FrameServer(const ILI9341_FrameServer &);
+        ILI9341_FrameServer &operator=(const ILI9341_FrameServer &);
+
+        bool        create(void);
+        void        send(const ILI9341_Rect *rects, uint8_t n);
+
+        Adafruit_ILI9341 &_tft;
+        const char  *_name;
+        uint32_t    _rate;
+        std::atomic<bool> _stop;
+        uint32_t    _frames;
+        ILI9341_ShmHeader *_shm;    ///< Mapped segment, NULL before begin()
+        size_t      _size;          ///< Mapped bytes
+        uint16_t    *_pixels;
+        int16_t     _width;         ///< Framebuffer size the segment was created with
+        int16_t     _height;
+};
+
+/// Attaches to a running ILI9341_FrameServer
+class ILI9341_FrameClient {
+    public:
+        ILI9341_FrameClient() : _shm(NULL), _size(0), _pixels(NULL) {}
+        ~ILI9341_FrameClient()              { close(); }
+
+        bool        open(const char *name = ILI9341_SHM_NAME);
+        void        close(void);
+        /// Shared framebuffer, width() pixels per row
+        uint16_t   *pixels(void)            { return _pixels; }
+        int16_t     width(void) const       { return _shm ? _shm->width : 0; }
+        int16_t     height(void) const      { return _shm ? _shm->height : 0; }
+
+        uint32_t    submit(int16_t x, int16_t y, int16_t w, int16_t h);
+        uint32_t    submit(void);
+        bool        waitFence(uint32_t fence, uint32_t timeoutMs);
+        bool        connected(void) const;
+
+    private:
+        ILI9341_FrameClient(const ILI9341_FrameClient &);
+        ILI9341_FrameClient &operator=(const ILI9341_FrameClient &);
+
+        ILI9341_ShmHeader *_shm;
+        size_t      _size;
+        uint16_t    *_pixels;
+};
+
+#endif
@@ -0,0 +1,110 @@
+/*!
+* @file ili9341d.cpp
+*
+* Frame server daemon: owns the panel and serves a shared-memory
+* framebuffer to other processes, see frame_server.h.
+*
+* Build on a Pi:
+*   g++ -O2 -pthread -DILI9341D_BCM2835 -o ili9341d ili9341d.cpp frame_server.cpp \
+*       Adafruit_ILI9341.cpp transport_bcm2835.cpp transport_spidev.cpp \
+*       transport_sim.cpp spi.c color_convert.cpp font.cpp asset.cpp \
+*       display_list.cpp blend.cpp buffer_pool.cpp -lbcm2835 -lrt
+* Leave out -DILI9341D_BCM2835, transport_bcm2835.cpp and -lbcm2835 for a
+* spidev or simulated panel only.
+*
+* Usage: ili9341d [-t sim|spidev|bcm2835] [-n name] [-r rate] [-R rotation] [-d]
+*   -t  Transport, spidev by default
+*   -n  Shared-memory segment name, /ili9341 by default
+*   -r  Flushes per second, 0 to flush as soon as damage arrives
+*   -R  Panel rotation 0-3, which sets the framebuffer size
+*   -d  Detach and run in the background
+*
+*/
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "frame_server.h"
+#include "transport_sim.h"
+#include "transport_spidev.h"
+#ifdef ILI9341D_BCM2835
+#include "transport_bcm2835.h"
+#endif
+
+
+static ILI9341_FrameServer *server;
+
+static void onSignal(int) {
+    if (server) server->stop();
+}
+
+int main(int argc, char **argv)
+{
+    const char *transport = "spidev", *name = ILI9341_SHM_NAME;
+    uint32_t rate = ILI9341_SHM_RATE;
+    uint8_t rotation = 0;
+    bool detach = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:r:R:d")) != -1) {
+        switch (opt) {
+            case 't': transport = optarg;               break;
+            case 'n': name      = optarg;               break;
+            case 'r': rate      = atoi(optarg);         break;
+            case 'R': rotation  = atoi(optarg) & 3;     break;
+            case 'd': detach    = true;                 break;
+            default:
+                fprintf(stderr, "Usage: %s [-t sim|spidev|bcm2835] [-n name] [-r rate] [-R rotation] [-d]\n", argv[0]);
+                return -1;
+        }
+    }
+
+    ILI9341_Transport *bus;
+    if (!strcmp(transport, "sim")) {
+        bus = new ILI9341_SimTransport();
+    } else if (!strcmp(transport, "spidev")) {
+        bus = new ILI9341_SpidevTransport();
+#ifdef ILI9341D_BCM2835
+    } else if (!strcmp(transport, "bcm2835")) {
+        bus = new ILI9341_BCM2835Transport();
+#endif
+    } else {
+        fprintf(stderr, "Unknown transport %s\n", transport);
+        return -1;
+    }
+
+    if (detach && (daemon(0, 0) != 0)) {
+        perror("daemon");
+        return -1;
+    }
+
+    Adafruit_ILI9341 tft(bus);
+    if (!tft.begin()) {
+        return -1;
+    }
+    tft.setRotation(rotation);
+    tft.fillRect(0, 0, tft.width(), tft.height(), ILI9341_BLACK); // Matches the zeroed framebuffer
+
+    ILI9341_FrameServer fs(tft, name, rate);
+    if (!fs.begin()) {
+        tft.end();
+        return -1;
+    }
+    server = &fs;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onSignal;
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    fs.run();
+
+    server = NULL;
+    fs.end();
+    tft.end();
+    delete bus;
+    return 0;
+}
@@ -1,10 +1,12 @@
 
 #include "Adafruit_ILI9341.h"
+#include "transport_bcm2835.h"
 
 int main(int argc, char **argv)
 {
 	
-	Adafruit_ILI9341 driver;
+	ILI9341_BCM2835Transport bus;
+	Adafruit_ILI9341 driver(&bus);
 	
 	if (false == driver.begin()){
 		return -1;
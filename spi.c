@@ -1,17 +1,25 @@
 
+#include <time.h>				//clock_gettime
+
 #include "spi.h"
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
-SPI::SPI() {
-	device = "/dev/spidev0.0";
+SPI::SPI(const char *dev, uint32_t speed_hz) {
+	device = dev;
 	mode = SPI_MODE_0 | SPI_NO_CS;
 	bits = 8;
-	speed = 500000;
+	speed = speed_hz;
 	delay = 0;
+	fd = -1;
+	maxbuf = SPI_BUFSIZ;
+	nseg = 0;
+	segbytes = 0;
+	resetStats();
 }
 bool SPI::begin(void) {
 	int ret = 0;
+	FILE *f;
 
 	fd = open(device, O_RDWR);
 	if (fd < 0) {
@@ -78,9 +86,22 @@ bool SPI::begin(void) {
 	tr32.delay_usecs = delay;
 	tr32.bits_per_word = bits;
 	
+	//Largest message the driver accepts
+	f = fopen(SPI_BUFSIZ_PATH, "r");
+	if (f) {
+		unsigned int b;
+		if (fscanf(f, "%u", &b) == 1 && b > 0) {
+			maxbuf = b;
+		}
+		fclose(f);
+	}
+	nseg = 0;
+	segbytes = 0;
+	
 	printf("spi mode: %d\n", mode);
 	printf("bits per word: %d\n", bits);
 	printf("max speed: %d Hz (%d KHz)\n", speed, speed/1000);
+	printf("bufsiz: %u bytes\n", maxbuf);
 	
 	return true;
 exit_close:
@@ -90,11 +111,31 @@ exit_noclose:
 }
 void SPI::end(void) {
 	close(fd);
+	fd = -1;
+}
+bool SPI::setSpeed(uint32_t speed_hz) {
+	//Queued segments were queued with the old speed, send them first
+	if (!submit()) {
+		return false;
+	}
+	if (fd >= 0 && ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) == -1) {
+		perror("SPI Error: can't set max speed hz");
+		return false;
+	}
+	speed = speed_hz;
+	tr8.speed_hz = speed;
+	tr16.speed_hz = speed;
+	tr32.speed_hz = speed;
+	return true;
 }
 uint8_t SPI::read(void) {
 	int ret;
+	//Queued segments go out first to keep the byte order
+	if (!submit()) {
+		return 0;
+	}
 	tx8[0] = 0;
-	ret = ioctl(fd, SPI_IOC_MESSAGE(1), &tr8);
+	ret = message(&tr8, 1);
 	if (ret < 1) {
 		perror("SPI Error: failed to read 8 bit value.");
 		return 0;
@@ -103,8 +144,11 @@ uint8_t SPI::read(void) {
 }
 void SPI::write(uint8_t v) {
 	int ret;
+	if (!submit()) {
+		return;
+	}
 	tx8[0] = v;
-	ret = ioctl(fd, SPI_IOC_MESSAGE(1), &tr8);
+	ret = message(&tr8, 1);
 	if (ret < 1) {
 		perror("SPI Error: failed to write 8 bit value.");
 		return;
@@ -112,9 +156,12 @@ void SPI::write(uint8_t v) {
 }
 void SPI::write16(uint16_t s) {
 	int ret;
+	if (!submit()) {
+		return;
+	}
 	tx16[0] = s >> 8; //Write out in Big Endian
 	tx16[1] = s;
-	ret = ioctl(fd, SPI_IOC_MESSAGE(1), &tr16);
+	ret = message(&tr16, 1);
 	if (ret < 1) {
 		perror("SPI Error: failed to write 16 bit value.");
 		return;
@@ -122,18 +169,99 @@ void SPI::write16(uint16_t s) {
 }
 void SPI::write32(uint32_t w) {
 	int ret;
+	if (!submit()) {
+		return;
+	}
 	tx32[0] = w >> 24; //Write out in Big Endian
 	tx32[1] = w >> 16;
 	tx32[2] = w >> 8;
 	tx32[3] = w;
-	ret = ioctl(fd, SPI_IOC_MESSAGE(1), &tr32);
+	ret = message(&tr32, 1);
 	if (ret < 1) {
 		perror("SPI Error: failed to write 32 bit value.");
 		return;
 	}
 }
+bool SPI::write(const uint8_t *buf, uint32_t len) {
+	return transfer(buf, NULL, len);
+}
+bool SPI::read(uint8_t *buf, uint32_t len) {
+	memset(buf, 0, len); //Clock out zeros while reading
+	return transfer(buf, buf, len);
+}
+bool SPI::transfer(const uint8_t *tx, uint8_t *rx, uint32_t len) {
+	if (!queue(tx, rx, len)) {
+		return false;
+	}
+	return submit();
+}
+bool SPI::queue(const uint8_t *tx, uint8_t *rx, uint32_t len, uint32_t speed_hz, bool cs_change) {
+	while (len) {
+		uint32_t n = (len > maxbuf) ? maxbuf : len;
+		//A message may hold at most maxbuf bytes, start a new one if full
+		if (nseg == SPI_MAX_SEGMENTS || segbytes + n > maxbuf) {
+			if (!submit()) {
+				return false;
+			}
+		}
+		struct spi_ioc_transfer *tr = &segs[nseg++];
+		memset(tr,0,sizeof(struct spi_ioc_transfer));
+		tr->tx_buf = (unsigned long)tx;
+		tr->rx_buf = (unsigned long)rx;
+		tr->len = n;
+		tr->speed_hz = speed_hz ? speed_hz : speed;
+		tr->delay_usecs = delay;
+		tr->bits_per_word = bits;
+		tr->cs_change = cs_change;
+		segbytes += n;
+		if (tx) tx += n;
+		if (rx) rx += n;
+		len -= n;
+	}
+	return true;
+}
+bool SPI::submit(void) {
+	int ret;
+	if (nseg == 0) {
+		return true;
+	}
+	ret = message(segs, nseg);
+	nseg = 0;
+	segbytes = 0;
+	if (ret < 1) {
+		perror("SPI Error: failed to submit queued transfers.");
+		return false;
+	}
+	return true;
+}
+
+
+int SPI::message(struct spi_ioc_transfer *tr, uint32_t n) {
+	struct timespec t0, t1;
+	int ret;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ret = ioctl(fd, SPI_IOC_MESSAGE(n), tr);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	counters.syscalls++;
+	counters.segments += n;
+	for (uint32_t i = 0; i < n; i++) {
+		counters.bytes += tr[i].len;
+	}
+	counters.ns += (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+	return ret;
+}
+void SPI::resetStats(void) {
+	memset(&counters, 0, sizeof(counters));
+}
+void SPI::dumpStats(FILE *f) const {
+	fprintf(f, "spi.syscalls %llu\n", (unsigned long long)counters.syscalls);
+	fprintf(f, "spi.segments %llu\n", (unsigned long long)counters.segments);
+	fprintf(f, "spi.bytes %llu\n", (unsigned long long)counters.bytes);
+	fprintf(f, "spi.ns %llu\n", (unsigned long long)counters.ns);
+}
 
 
+#ifdef SPI_TEST_MAIN
 int main(int argc, char *argv[])
 {
 	SPI spi;
@@ -149,3 +277,4 @@ int main(int argc, char *argv[])
 	printf("Done");
 	return 0;
 }
+#endif
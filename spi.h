@@ -12,16 +12,48 @@
 #include <linux/spi/spidev.h>
 
 
+#define SPI_BUFSIZ	4096		//spidev default maximum bytes per message
+#define SPI_BUFSIZ_PATH	"/sys/module/spidev/parameters/bufsiz"
+#define SPI_MAX_SEGMENTS	64	//Segments submitted per SPI_IOC_MESSAGE
+#define SPI_DEFAULT_SPEED	500000	//Clock used unless the constructor is given one
+
+//Transfer counters, see SPI::stats()
+struct SPI_Stats {
+	uint64_t syscalls;				//SPI_IOC_MESSAGE ioctls issued
+	uint64_t segments;				//spi_ioc_transfer segments submitted
+	uint64_t bytes;					//Bytes clocked on the bus
+	uint64_t ns;					//Time spent inside the ioctls
+};
+
 class SPI {
 public:
-				SPI();
+				SPI(const char *device = "/dev/spidev0.0", uint32_t speed_hz = SPI_DEFAULT_SPEED);
 	bool 		begin(void);
 	void 		end(void);
     uint8_t 	read(void);
     void     	write(uint8_t v);
     void 		write16(uint16_t s);
     void 		write32(uint32_t w);
+    bool 		write(const uint8_t *buf, uint32_t len);
+    bool 		read(uint8_t *buf, uint32_t len);
+
+    //Queued transfers. Buffers must stay valid until submit() returns.
+    bool 		queue(const uint8_t *tx, uint8_t *rx, uint32_t len,
+    				uint32_t speed_hz = 0, bool cs_change = false);
+    bool 		submit(void);
+    uint32_t 	pending(void) const { return nseg; }
+    uint32_t 	bufsiz(void) const { return maxbuf; }
+
+    bool 		setSpeed(uint32_t speed_hz);
+    uint32_t 	getSpeed(void) const { return speed; }
+
+    const SPI_Stats &stats(void) const { return counters; }
+    void 		resetStats(void);
+    void 		dumpStats(FILE *f = stdout) const;
 private:
+	bool 		transfer(const uint8_t *tx, uint8_t *rx, uint32_t len);
+	int 		message(struct spi_ioc_transfer *tr, uint32_t n);
+
 	const char *device;
 	uint8_t mode;
 	uint8_t bits;
@@ -37,6 +69,11 @@ private:
 	struct spi_ioc_transfer tr8;
 	struct spi_ioc_transfer tr16;
 	struct spi_ioc_transfer tr32;
+	uint32_t maxbuf;				//Largest message spidev accepts, in bytes
+	struct spi_ioc_transfer segs[SPI_MAX_SEGMENTS];
+	uint32_t nseg;					//Segments queued in segs
+	uint32_t segbytes;				//Bytes queued in segs
+	SPI_Stats counters;
 };
 
 #endif
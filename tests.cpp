@@ -0,0 +1,1385 @@
+/*!
+* @file tests.cpp
+*
+* Regression tests for the ILI9341 driver, run on the simulated panel.
+*
+* Each test checks a fast path against a plain reference: what a panel
+* driven through ILI9341_SimTransport ends up with in its GRAM, or the
+* scalar version of a SIMD kernel. Prints one line per test and exits
+* non-zero if any failed.
+*
+* Build on any Linux box:
+*   g++ -O2 -pthread -o tests tests.cpp Adafruit_ILI9341.cpp transport_sim.cpp \
+*       color_convert.cpp font.cpp asset.cpp command_queue.cpp display_list.cpp \
+*       blend.cpp compositor.cpp frame_server.cpp buffer_pool.cpp -lrt
+*
+* Usage: tests
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "Adafruit_ILI9341.h"
+#include "asset.h"
+#include "blend.h"
+#include "color_convert.h"
+#include "command_queue.h"
+#include "compositor.h"
+#include "frame_server.h"
+#include "transport_sim.h"
+
+
+#define SCREEN_PIXELS   (ILI9341_TFTWIDTH * ILI9341_TFTHEIGHT)
+
+/// Fail the current test, naming the condition that did not hold
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("  %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            return false; \
+        } \
+    } while (0)
+
+/// True if both simulated panels show the same picture
+static bool sameScreen(const ILI9341_SimTransport &a, const ILI9341_SimTransport &b) {
+    return !memcmp(a.gram(), b.gram(), SCREEN_PIXELS * sizeof(uint16_t));
+}
+
+/// Pixels of a simulated panel that differ from color
+static uint32_t countOther(const ILI9341_SimTransport &sim, uint16_t color) {
+    uint32_t n = 0;
+    for (int i=0; i<SCREEN_PIXELS; i++) {
+        if (sim.gram()[i] != color) n++;
+    }
+    return n;
+}
+
+/// Basic draws land where they should, clipped to the screen
+static bool simTransport(void) {
+    ILI9341_SimTransport sim;
+    Adafruit_ILI9341 tft(&sim);
+    CHECK(tft.begin());
+    CHECK(sim.displayOn() && !sim.sleeping());
+
+    tft.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+    CHECK(countOther(sim, ILI9341_BLACK) == 0);
+    tft.fillRect(10, 20, 30, 40, ILI9341_RED);
+    CHECK(sim.displayPixel(10, 20) == ILI9341_RED);
+    CHECK(sim.displayPixel(39, 59) == ILI9341_RED);
+    CHECK(sim.displayPixel(9, 20) == ILI9341_BLACK);
+    CHECK(sim.displayPixel(40, 59) == ILI9341_BLACK);
+    CHECK(countOther(sim, ILI9341_BLACK) == 30 * 40);
+
+    // Off the edges only the visible part is drawn
+    tft.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+    tft.fillRect(ILI9341_TFTWIDTH - 5, ILI9341_TFTHEIGHT - 5, 10, 10, ILI9341_GREEN);
+    tft.drawPixel(0, 0, ILI9341_WHITE);
+    tft.drawPixel(ILI9341_TFTWIDTH, 0, ILI9341_WHITE);
+    CHECK(sim.displayPixel(ILI9341_TFTWIDTH - 5, ILI9341_TFTHEIGHT - 5) == ILI9341_GREEN);
+    CHECK(sim.displayPixel(ILI9341_TFTWIDTH - 1, ILI9341_TFTHEIGHT - 1) == ILI9341_GREEN);
+    CHECK(sim.displayPixel(0, 0) == ILI9341_WHITE);
+    CHECK(countOther(sim, ILI9341_BLACK) == 5 * 5 + 1);
+
+    static uint16_t bitmap[20 * 10];
+    for (int i=0; i<20*10; i++) bitmap[i] = i * 97;
+    tft.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+    tft.drawRGBBitmap(ILI9341_TFTWIDTH - 5, 100, bitmap, 20, 10);
+    for (int y=0; y<10; y++) {
+        for (int x=0; x<5; x++) {
+            CHECK(sim.displayPixel(ILI9341_TFTWIDTH - 5 + x, 100 + y) == bitmap[y * 20 + x]);
+        }
+    }
+
+    // Landscape draws cover the same area, clipped to the rotated size
+    for (uint8_t r=0; r<4; r++) {
+        int16_t w = (r & 1) ? ILI9341_TFTHEIGHT : ILI9341_TFTWIDTH;
+        int16_t h = (r & 1) ? ILI9341_TFTWIDTH : ILI9341_TFTHEIGHT;
+        tft.setRotation(r);
+        tft.fillRect(0, 0, w, h, ILI9341_BLACK);
+        tft.fillRect(w - 20, 10, 50, 30, ILI9341_BLUE);
+        CHECK(countOther(sim, ILI9341_BLACK) == 20 * 30);
+    }
+    return true;
+}
+
+/// The init table leaves the panel awake, on and in portrait, with the sleep-out waits kept
+static bool initSequence(void) {
+    ILI9341_SimTransport sim;
+    Adafruit_ILI9341 tft(&sim);
+    CHECK(tft.begin());
+    CHECK(sim.displayOn() && !sim.sleeping() && !sim.inverted());
+    CHECK(sim.madctl() == 0x48);
+    CHECK(sim.delayMs() >= 120 + 120 + 120); // Reset, SLPOUT, DISPON
+
+    // A caller's own table replaces the built-in one
+    static const uint8_t table[] = {
+        ILI9341_SLPOUT, ILI9341_INIT_DELAY | 0, 120,
+        ILI9341_INVON , 0,
+        ILI9341_DISPON, 0,
+        0x00
+    };
+    ILI9341_SimTransport custom;
+    Adafruit_ILI9341 other(&custom);
+    CHECK(other.begin(table));
+    CHECK(custom.displayOn() && !custom.sleeping() && custom.inverted());
+    return true;
+}
+
+/// Set a clipped rectangle of a portrait reference image
+static void refFill(uint16_t *ref, int16_t x, int16_t y, int16_t w, int16_t h, uint16_t c) {
+    for (int16_t j=y; j<y+h; j++) {
+        for (int16_t i=x; i<x+w; i++) {
+            if ((i >= 0) && (j >= 0) && (i < ILI9341_TFTWIDTH) && (j < ILI9341_TFTHEIGHT)) {
+                ref[j * ILI9341_TFTWIDTH + i] = c;
+            }
+        }
+    }
+}
+
+/// True if the panel shows the portrait reference image
+static bool showsImage(const ILI9341_SimTransport &sim, const uint16_t *ref) {
+    for (int i=0; i<SCREEN_PIXELS; i++) {
+        if (sim.displayPixel(i % ILI9341_TFTWIDTH, i / ILI9341_TFTWIDTH) != ref[i]) return false;
+    }
+    return true;
+}
+
+/// Consecutive writes reuse the panel's address window instead of resending it
+static bool windowCache(void) {
+    static uint16_t want[SCREEN_PIXELS];
+    ILI9341_SimTransport sim;
+    Adafruit_ILI9341 tft(&sim);
+    CHECK(tft.begin());
+    tft.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+    refFill(want, 0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+
+    // A left-to-right run of pixels is one window and one RAMWR
+    uint64_t commands = sim.commands();
+    tft.startWrite();
+    for (int16_t x=0; x<100; x++) {
+        tft.writePixel(20 + x, 50, ILI9341_RED);
+    }
+    tft.endWrite();
+    CHECK(sim.commands() - commands <= 3);
+    refFill(want, 20, 50, 100, 1, ILI9341_RED);
+
+    // Refilling the same rectangle sends no window at all
+    tft.fillRect(10, 10, 5, 5, ILI9341_GREEN);
+    commands = sim.commands();
+    tft.fillRect(10, 10, 5, 5, ILI9341_BLUE);
+    CHECK(sim.commands() - commands <= 1);
+    refFill(want, 10, 10, 5, 5, ILI9341_BLUE);
+    CHECK(showsImage(sim, want));
+
+    // Whatever the mix, with other commands in between, pixels land exactly
+    for (int i=0; i<3000; i++) {
+        int16_t x = rand() % 260 - 10, y = rand() % 340 - 10;
+        uint16_t c = rand();
+        switch (rand() % 4) {
+            case 0:
+                tft.drawPixel(x, y, c);
+                refFill(want, x, y, 1, 1, c);
+                break;
+            case 1: {
+                int16_t w = rand() % 20, h = rand() % 20;
+                tft.fillRect(x, y, w, h, c);
+                refFill(want, x, y, w, h, c);
+                break;
+            }
+            case 2:
+                tft.startWrite();
+                for (int16_t j=0; j<12; j++) {
+                    tft.writePixel(x + j, y, c + j);
+                    refFill(want, x + j, y, 1, 1, c + j);
+                }
+                tft.endWrite();
+                break;
+            default:
+                tft.invertDisplay(i & 1);
+                break;
+        }
+    }
+    CHECK(showsImage(sim, want));
+    return true;
+}
+
+static uint16_t sceneBitmap[40 * 30];
+
+/// Overlapping draws, partly off-screen, the same for a given seed
+static void scene(Adafruit_ILI9341 &tft, unsigned seed) {
+    srand(seed);
+    for (int i=0; i<300; i++) {
+        int16_t x = rand() % 260 - 10, y = rand() % 340 - 10;
+        uint16_t c = rand() % 4 * 0x1111;
+        switch (rand() % 5) {
+            case 0:  tft.fillRect(x, y, rand() % 60, rand() % 60, c); break;
+            case 1:  tft.drawPixel(x, y, c); break;
+            case 2:  for (int j=0; j<20; j++) tft.drawPixel(x + j, y, c); break;
+            case 3:  tft.drawFastVLine(x, y, rand() % 50, c); break;
+            default: tft.drawRGBBitmap(x - 20, y - 20, sceneBitmap, 40, 30); break;
+        }
+    }
+}
+
+/// The framebuffer shows what direct drawing shows, sending only what changed
+static bool framebuffer(void) {
+    for (int i=0; i<40*30; i++) sceneBitmap[i] = i * 77;
+    ILI9341_SimTransport direct, shadow;
+    Adafruit_ILI9341 a(&direct), b(&shadow);
+    CHECK(a.begin() && b.begin());
+    CHECK(b.enableFramebuffer());
+    for (unsigned seed=1; seed<10; seed++) {
+        uint8_t r = seed % 4;
+        a.setRotation(r);
+        b.setRotation(r);
+        scene(a, seed);
+        scene(b, seed);
+        b.flush();
+        CHECK(sameScreen(direct, shadow));
+    }
+    a.setRotation(0);
+    b.setRotation(0);
+
+    // Left and top edges clip too
+    a.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+    a.fillRect(-5, -5, 10, 10, ILI9341_GREEN);
+    CHECK(direct.displayPixel(4, 4) == ILI9341_GREEN);
+    CHECK(countOther(direct, ILI9341_BLACK) == 5 * 5);
+
+    // Nearby rects merge when the gap is within ILI9341_DIRTY_SLACK
+    b.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+    b.flush();
+    uint64_t sent = shadow.pixels();
+    b.fillRect(10, 10, 20, 10, ILI9341_RED);
+    b.fillRect(10, 21, 20, 10, ILI9341_RED);
+    b.flush();
+    CHECK(shadow.pixels() - sent == 20 * 21);
+    CHECK(shadow.displayPixel(10, 20) == ILI9341_BLACK);
+
+    // Distant ones go out separately
+    sent = shadow.pixels();
+    b.fillRect(0, 0, 10, 10, ILI9341_RED);
+    b.fillRect(200, 300, 10, 10, ILI9341_RED);
+    b.flush();
+    CHECK(shadow.pixels() - sent == 2 * 10 * 10);
+
+    // More changes than tracked rects still all reach the panel
+    a.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+    b.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+    for (int i=0; i<ILI9341_MAX_DIRTY * 4; i++) {
+        int16_t x = rand() % ILI9341_TFTWIDTH, y = rand() % ILI9341_TFTHEIGHT;
+        a.drawPixel(x, y, ILI9341_WHITE);
+        b.drawPixel(x, y, ILI9341_WHITE);
+    }
+    b.flush();
+    CHECK(sameScreen(direct, shadow));
+
+    // Rotating keeps the picture; later draws land as on a plain panel
+    for (uint8_t r=1; r<=4; r++) {
+        a.setRotation(r);
+        b.setRotation(r);
+        b.flush();
+        CHECK(sameScreen(direct, shadow));
+        a.fillRect(5, 5, 50, 20, ILI9341_YELLOW);
+        b.fillRect(5, 5, 50, 20, ILI9341_YELLOW);
+        b.flush();
+        CHECK(sameScreen(direct, shadow));
+    }
+
+    // begin() resets the panel; the framebuffer puts the picture back
+    static uint16_t before[SCREEN_PIXELS];
+    b.setRotation(1);
+    b.fillRect(0, 0, 30, 10, ILI9341_BLUE);
+    b.flush();
+    for (int p=0; p<SCREEN_PIXELS; p++) {
+        before[p] = shadow.displayPixel(p % ILI9341_TFTWIDTH, p / ILI9341_TFTWIDTH);
+    }
+    CHECK(b.begin());
+    b.flush();
+    for (int p=0; p<SCREEN_PIXELS; p++) {
+        CHECK(shadow.displayPixel(p % ILI9341_TFTWIDTH, p / ILI9341_TFTWIDTH) == before[p]);
+    }
+    return true;
+}
+
+/// Frames sent by the flush thread match direct drawing, even when the bus closes right after
+static bool asyncFlush(void) {
+    ILI9341_SimTransport direct, async;
+    Adafruit_ILI9341 a(&direct), b(&async);
+    CHECK(a.begin() && b.begin());
+    CHECK(b.enableAsyncFlush());
+    for (unsigned seed=1; seed<20; seed++) {
+        if (seed % 5 == 0) { // Rotating waits for the frame in flight
+            a.setRotation(seed / 5);
+            b.setRotation(seed / 5);
+        }
+        scene(a, seed);
+        scene(b, seed); // Drawn while the previous frame goes out
+        b.present();
+    }
+    b.waitFlush();
+    CHECK(sameScreen(direct, async));
+
+    // Both buffers follow a rotation, the next one re-sends the older one
+    for (uint8_t r=1; r<=4; r++) {
+        a.setRotation(r);
+        b.setRotation(r);
+        a.fillRect(10 * r, 20, 30, 40, ILI9341_GREEN);
+        b.fillRect(10 * r, 20, 30, 40, ILI9341_GREEN);
+        b.present();
+        b.present();
+    }
+    b.waitFlush();
+    CHECK(sameScreen(direct, async));
+
+    // end() lets the frame in flight finish before closing the bus
+    a.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_WHITE);
+    b.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_WHITE);
+    b.present();
+    b.end();
+    CHECK(sameScreen(direct, async));
+    return true;
+}
+
+/// Counters match the traffic, including a frame the flush thread sends
+static bool counters(void) {
+    ILI9341_SimTransport sim;
+    Adafruit_ILI9341 tft(&sim);
+    CHECK(tft.begin());
+    tft.resetStats();
+    tft.fillRect(10, 20, 10, 10, ILI9341_RED);
+    ILI9341_Stats st = tft.stats();
+    CHECK(st.calls[ILI9341_API_fillRect] == 1);
+    CHECK(st.commands == 3);                // CASET, PASET, RAMWR
+    CHECK(st.payloadBytes == 4 + 4 + 200);
+
+    CHECK(tft.enableAsyncFlush());
+    tft.resetStats();
+    tft.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLUE);
+    tft.present();
+    CHECK(tft.stats().payloadBytes >= SCREEN_PIXELS * 2);
+    return true;
+}
+
+/// Vectorized pixel format conversion gives the scalar result at every length and alignment
+static bool convertKernels(void) {
+    static uint8_t src[4 * 300 + 64], fast[2 * 300 + 64], slow[2 * 300 + 64];
+    for (size_t i=0; i<sizeof(src); i++) src[i] = rand();
+    for (int f=0; f<ILI9341_FORMAT_COUNT; f++) {
+        for (uint32_t n=0; n<300; n++) {
+            memset(fast, 0xAA, sizeof(fast));
+            memset(slow, 0xAA, sizeof(slow));
+            ILI9341_convert((ILI9341_PixelFormat)f, src + (n & 3), fast, n);
+            ILI9341_convertScalar((ILI9341_PixelFormat)f, src + (n & 3), slow, n);
+            CHECK(!memcmp(fast, slow, sizeof(fast)));
+        }
+    }
+    uint8_t rgb[3] = { 0xFF, 0x80, 0x10 }, out[2];
+    ILI9341_convertScalar(ILI9341_RGB888, rgb, out, 1);
+    CHECK((out[0] == 0xFC) && (out[1] == 0x02));
+    return true;
+}
+
+/// A log redrawing only the band scrollAdvance() exposes keeps its fixed rows and line order
+static bool scrollRegions(void) {
+    const uint16_t top = 20, bottom = 30, area = ILI9341_TFTHEIGHT - top - bottom;
+    ILI9341_SimTransport sim;
+    Adafruit_ILI9341 tft(&sim);
+    CHECK(tft.begin());
+    tft.fillRect(0, 0, ILI9341_TFTWIDTH, top, ILI9341_RED);
+    tft.fillRect(0, ILI9341_TFTHEIGHT - bottom, ILI9341_TFTWIDTH, bottom, ILI9341_BLUE);
+    tft.setScrollMargins(top, bottom);
+    CHECK((sim.scrollTop() == top) && (sim.scrollHeight() == area));
+
+    // Expected colors of the scroll area rows, top to bottom on screen
+    std::vector<uint16_t> log(area);
+    uint16_t next = 1;
+    for (uint16_t i=0; i<area; i++) {
+        log[i] = next++;
+        tft.drawFastHLine(0, top + i, ILI9341_TFTWIDTH, log[i]);
+    }
+    for (int step=0; step<100; step++) {
+        uint16_t lines = 1 + rand() % 20;
+        uint16_t start = tft.scrollAdvance(lines);
+        CHECK((start >= top) && (start < top + area));
+        for (uint16_t i=0; i<lines; i++) {
+            uint16_t row = top + (start - top + i) % area;
+            tft.drawFastHLine(0, row, ILI9341_TFTWIDTH, next);
+            log.erase(log.begin());
+            log.push_back(next++);
+        }
+        for (uint16_t y=0; y<ILI9341_TFTHEIGHT; y++) {
+            uint16_t want = (y < top) ? ILI9341_RED
+                          : (y >= top + area) ? ILI9341_BLUE : log[y - top];
+            CHECK(sim.displayPixel(rand() % ILI9341_TFTWIDTH, y) == want);
+        }
+    }
+    return true;
+}
+
+/// Frame differencing shows every frame while sending only the tiles that changed
+static bool tileDiff(void) {
+    ILI9341_SimTransport direct, diffed;
+    Adafruit_ILI9341 a(&direct), b(&diffed);
+    CHECK(a.begin() && b.begin());
+    b.enableFrameDiff();
+    std::vector<uint16_t> frame(SCREEN_PIXELS);
+    for (uint8_t r=0; r<2; r++) {
+        a.setRotation(r);
+        b.setRotation(r);
+        int16_t w = a.width(), h = a.height();
+        for (int i=0; i<SCREEN_PIXELS; i++) frame[i] = rand();
+        for (int step=0; step<50; step++) {
+            for (int k=rand() % 4; k>0; k--) { // A few small changes per frame
+                int16_t x = rand() % (w - 20), y = rand() % (h - 20);
+                for (int16_t j=0; j<20; j++) frame[(y + j) * w + x + rand() % 20] = rand();
+            }
+            a.drawRGBBitmap(0, 0, frame.data(), w, h);
+            b.drawFrame(frame.data());
+            CHECK(sameScreen(direct, diffed));
+        }
+
+        // An unchanged frame sends nothing, one pixel sends its tile, a
+        // 2x2 block of tiles goes out as one address window
+        uint64_t pixels = diffed.pixels();
+        b.drawFrame(frame.data());
+        CHECK(diffed.pixels() == pixels);
+        frame[40 * w + 40]++;
+        b.drawFrame(frame.data());
+        CHECK(diffed.pixels() == pixels + ILI9341_TILE_SIZE * ILI9341_TILE_SIZE);
+        uint64_t commands = diffed.commands();
+        frame[70 * w + 70]++; // Tiles (4, 4) to (5, 5)
+        frame[70 * w + 90]++;
+        frame[90 * w + 70]++;
+        frame[90 * w + 90]++;
+        b.drawFrame(frame.data());
+        CHECK(diffed.commands() - commands <= 3);
+        CHECK(diffed.pixels() == pixels + 5 * ILI9341_TILE_SIZE * ILI9341_TILE_SIZE);
+    }
+    return true;
+}
+
+/// Text as the font's pixels drawn one by one, blank for characters it lacks
+static void refText(Adafruit_ILI9341 &tft, const ILI9341_Font *font, int16_t x, int16_t y,
+        const char *str, uint16_t fg, uint16_t bg, uint8_t size) {
+    int16_t cw = font->width + font->spacing;
+    for (int i=0; str[i]; i++) {
+        uint8_t ch = str[i];
+        bool known = (ch >= font->first) && (ch <= font->last);
+        for (int16_t c=0; c<cw; c++) {
+            uint8_t bits = (known && (c < font->width)) ?
+                font->columns[(ch - font->first) * font->width + c] : 0;
+            for (int16_t r=0; r<font->height; r++) {
+                tft.fillRect(x + (i * cw + c) * size, y + r * size, size, size,
+                             ((bits >> r) & 1) ? fg : bg);
+            }
+        }
+    }
+}
+
+/// drawText() matches the font drawn pixel by pixel, clipped, and hits its cache on redraws
+static bool glyphCache(void) {
+    static const uint8_t narrowColumns[] = { 0x0F, 0x09, 0x0F, 0x06, 0x09, 0x06 };
+    static const ILI9341_Font narrow = { narrowColumns, 3, 4, 2, '0', '1' };
+    ILI9341_SimTransport direct, shadow, ref;
+    Adafruit_ILI9341 a(&direct), b(&shadow), c(&ref);
+    CHECK(a.begin() && b.begin() && c.begin());
+    CHECK(b.enableFramebuffer());
+    Adafruit_ILI9341 *panels[] = { &a, &b };
+    static const char *text[] = { "Hello, world", "0110 \x01~", "Sensor 12: 34567", "1001" };
+    for (int i=0; i<300; i++) {
+        const ILI9341_Font *font = (i % 4 == 3) ? &narrow : NULL;
+        const char *str = text[rand() % 4];
+        int16_t x = rand() % 300 - 60, y = rand() % 340 - 10;
+        uint16_t fg = rand() % 4, bg = 0xFFFF - rand() % 4; // Few pairs, so the cache gets hits
+        uint8_t size = 1 + rand() % 3;
+        for (int p=0; p<2; p++) {
+            CHECK(panels[p]->setFont(font));
+            panels[p]->drawText(x, y, str, fg, bg, size);
+        }
+        refText(c, font ? font : &ILI9341_Font5x7, x, y, str, fg, bg, size);
+        if (i % 100 == 99) {
+            a.setRotation(i / 100);
+            b.setRotation(i / 100);
+            c.setRotation(i / 100);
+        }
+    }
+    b.flush();
+    CHECK(sameScreen(direct, ref));
+    CHECK(sameScreen(shadow, ref));
+
+    a.setFont(NULL);
+    CHECK(a.textWidth("Hello", 2) == 5 * 6 * 2);
+    a.drawText(0, 0, "Hello", ILI9341_WHITE, ILI9341_BLACK);
+    a.resetStats();
+    a.drawText(0, 0, "Hello", ILI9341_WHITE, ILI9341_BLACK);
+    ILI9341_Stats st = a.stats();
+    CHECK((st.glyphHits == 5) && (st.glyphMisses == 0));
+    CHECK(st.commands <= 3); // One address window for the whole string
+    return true;
+}
+
+/// A saved and mapped asset draws like the bitmap it was saved from
+static bool assets(void) {
+    char path[] = "/tmp/ili9341-asset-XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+    static uint16_t image[40 * 30];
+    for (int i=0; i<40 * 30; i++) image[i] = rand();
+    bool saved = ILI9341_Asset::save(path, image, 40, 30);
+    ILI9341_Asset asset;
+    bool opened = saved && asset.open(path);
+    unlink(path); // The mapping outlives the name
+    CHECK(opened && (asset.width() == 40) && (asset.height() == 30));
+
+    ILI9341_SimTransport direct, shadow, ref;
+    Adafruit_ILI9341 a(&direct), b(&shadow), c(&ref);
+    CHECK(a.begin() && b.begin() && c.begin());
+    CHECK(b.enableFramebuffer());
+    for (int i=0; i<100; i++) {
+        int16_t x = rand() % 280 - 20, y = rand() % 360 - 20;
+        a.drawAsset(x, y, asset);
+        b.drawAsset(x, y, asset);
+        c.drawRGBBitmap(x, y, image, 40, 30);
+    }
+    b.flush();
+    CHECK(sameScreen(direct, ref));
+    CHECK(sameScreen(shadow, ref));
+    return true;
+}
+
+/// Calibration settles one step below the fastest clock the panel takes
+static bool clockCalibration(void) {
+    const uint32_t limit = 20000000;
+    ILI9341_SimTransport sim;
+    Adafruit_ILI9341 tft(&sim);
+    CHECK(tft.begin());
+    uint32_t best = tft.calibrateClock(ILI9341_CAL_MIN_HZ, 40000000);
+    CHECK(best == 40000000); // No limit, every step passes
+
+    CHECK(tft.enableFramebuffer());
+    tft.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_RED);
+    tft.flush();
+    sim.setMaxClock(limit);
+    best = tft.calibrateClock();
+    uint64_t step = ILI9341_CAL_STEP;
+    CHECK((best < limit) && ((uint64_t)best * step * step / 10000 > limit));
+    CHECK(sim.clock() == best);
+    tft.flush(); // Puts back what the test patterns overwrote
+    CHECK(countOther(sim, ILI9341_RED) == 0);
+    return true;
+}
+
+/// readRect() returns what was drawn, from the panel or the framebuffer, in every rotation
+static bool readback(void) {
+    std::vector<uint16_t> image(SCREEN_PIXELS), buf(SCREEN_PIXELS);
+    for (int fb=0; fb<2; fb++) {
+        ILI9341_SimTransport sim;
+        Adafruit_ILI9341 tft(&sim);
+        CHECK(tft.begin());
+        CHECK(!fb || tft.enableFramebuffer());
+        for (uint8_t r=0; r<4; r++) {
+            tft.setRotation(r);
+            int16_t w = tft.width(), h = tft.height();
+            for (int i=0; i<SCREEN_PIXELS; i++) image[i] = rand();
+            tft.drawRGBBitmap(0, 0, image.data(), w, h);
+            tft.readRect(0, 0, w, h, buf.data()); // Several transfer buffers worth
+            CHECK(buf == image);
+            for (int i=0; i<50; i++) { // Partly off screen, those pixels are left alone
+                int16_t rx = rand() % (w + 40) - 40, ry = rand() % (h + 40) - 40;
+                int16_t rw = 1 + rand() % 80, rh = 1 + rand() % 80;
+                std::fill(buf.begin(), buf.end(), 0x1234);
+                tft.readRect(rx, ry, rw, rh, buf.data());
+                for (int16_t y=0; y<rh; y++) {
+                    for (int16_t x=0; x<rw; x++) {
+                        bool on = (rx + x >= 0) && (rx + x < w) && (ry + y >= 0) && (ry + y < h);
+                        uint16_t want = on ? image[(ry + y) * w + rx + x] : 0x1234;
+                        CHECK(buf[y * rw + x] == want);
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/// Threads in this process
+static int threadCount(void) {
+    int n = 0;
+    DIR *dir = opendir("/proc/self/task");
+    if (!dir) return -1;
+    while (struct dirent *e = readdir(dir)) {
+        if (e->d_name[0] != '.') n++;
+    }
+    closedir(dir);
+    return n;
+}
+
+/// flushAll() shows every panel's frame, and end() leaves no flush thread behind
+static bool parallelFlush(void) {
+    int threads = threadCount();
+    ILI9341_SimTransport sims[4], refs[4];
+    Adafruit_ILI9341 *panels[4], *direct[4];
+    for (int i=0; i<4; i++) {
+        panels[i] = new Adafruit_ILI9341(&sims[i]);
+        direct[i] = new Adafruit_ILI9341(&refs[i]);
+        CHECK(panels[i]->begin() && direct[i]->begin());
+    }
+    CHECK(panels[0]->enableAsyncFlush() && panels[1]->enableAsyncFlush());
+    CHECK(panels[2]->enableFramebuffer()); // panels[3] draws straight to the bus
+    for (unsigned seed=1; seed<10; seed++) {
+        for (int i=0; i<4; i++) {
+            scene(*panels[i], seed * 4 + i);
+            scene(*direct[i], seed * 4 + i);
+        }
+        Adafruit_ILI9341::flushAll(panels, 4);
+        for (int i=0; i<4; i++) CHECK(sameScreen(sims[i], refs[i]));
+    }
+    CHECK(threadCount() == threads + 3);
+
+    // A panel that was ended flushes again after begin()
+    for (int i=0; i<4; i++) panels[i]->end();
+    CHECK(threadCount() == threads);
+    for (int i=0; i<4; i++) {
+        CHECK(panels[i]->begin() && direct[i]->begin());
+        panels[i]->fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+        direct[i]->fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+        scene(*panels[i], 100 + i);
+        scene(*direct[i], 100 + i);
+    }
+    Adafruit_ILI9341::flushAll(panels, 4);
+    for (int i=0; i<4; i++) {
+        CHECK(sameScreen(sims[i], refs[i]));
+        delete panels[i];
+        delete direct[i];
+    }
+    CHECK(threadCount() == threads);
+    return true;
+}
+
+#define QUEUE_PRODUCERS     4       ///< Threads pushing to the queue
+#define QUEUE_COMMANDS      5000    ///< Commands each pushes
+
+/// Rectangle command i of a producer, each producer in its own column band
+static void queuedRect(int id, int i, int16_t &x, int16_t &y) {
+    x = id * 60 + (i * 7) % 50;
+    y = (i * 13) % 300;
+}
+
+static void producer(ILI9341_CommandQueue *queue, int id) {
+    for (int i=0; i<QUEUE_COMMANDS; i++) {
+        int16_t x, y;
+        queuedRect(id, i, x, y);
+        while (!queue->fillRect(x, y, 10, 20, id * 1000 + i)) { // Full, let the bus thread catch up
+            std::this_thread::yield();
+        }
+    }
+}
+
+/// Commands pushed by several threads at once all run, each thread's in order
+static bool commandQueue(void) {
+    for (int fb=0; fb<2; fb++) {
+        ILI9341_SimTransport queued, direct;
+        Adafruit_ILI9341 a(&queued), b(&direct);
+        CHECK(a.begin() && b.begin());
+        if (fb) CHECK(a.enableFramebuffer());
+        ILI9341_CommandQueue queue(a);
+        CHECK(queue.start());
+        std::thread threads[QUEUE_PRODUCERS];
+        for (int id=0; id<QUEUE_PRODUCERS; id++) {
+            threads[id] = std::thread(producer, &queue, id);
+        }
+        for (int id=0; id<QUEUE_PRODUCERS; id++) {
+            threads[id].join();
+        }
+        CHECK(queue.flush());
+        queue.sync();
+        queue.stop();
+        for (int id=0; id<QUEUE_PRODUCERS; id++) {
+            for (int i=0; i<QUEUE_COMMANDS; i++) {
+                int16_t x, y;
+                queuedRect(id, i, x, y);
+                b.fillRect(x, y, 10, 20, id * 1000 + i);
+            }
+        }
+        CHECK(sameScreen(queued, direct));
+    }
+    return true;
+}
+
+/// Replaying an optimized display list draws what the recorded calls drew
+static bool displayList(void) {
+    for (int i=0; i<40*30; i++) sceneBitmap[i] = i * 77;
+    for (unsigned seed=1; seed<30; seed++) {
+        ILI9341_SimTransport direct, replayed;
+        Adafruit_ILI9341 a(&direct), b(&replayed);
+        CHECK(a.begin() && b.begin());
+        a.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+        b.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+        scene(a, seed);
+        ILI9341_DisplayList list;
+        b.beginRecording(&list);
+        scene(b, seed);
+        b.endRecording();
+        uint32_t ops = list.size();
+        CHECK(list.optimize() <= ops);
+        b.drawList(list);
+        CHECK(sameScreen(direct, replayed));
+    }
+    return true;
+}
+
+
+/// Reference panel for the Adafruit_GFX algorithms below
+static Adafruit_ILI9341 *gfx;
+
+static void gfxPixel(int16_t x, int16_t y, uint16_t c) {
+    gfx->drawPixel(x, y, c);
+}
+
+// Lines only visit their on-screen pixels, drawPixel() would clip the rest anyway
+static void gfxHLine(int16_t x, int16_t y, int16_t w, uint16_t c) {
+    for (int16_t i=std::max(0, -x); i<std::min<int>(w, ILI9341_TFTWIDTH - x); i++) gfxPixel(x + i, y, c);
+}
+
+static void gfxVLine(int16_t x, int16_t y, int16_t h, uint16_t c) {
+    for (int16_t i=std::max(0, -y); i<std::min<int>(h, ILI9341_TFTHEIGHT - y); i++) gfxPixel(x, y + i, c);
+}
+
+static void gfxLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint16_t c) {
+    bool steep = abs(y1 - y0) > abs(x1 - x0);
+    if (steep) {
+        std::swap(x0, y0);
+        std::swap(x1, y1);
+    }
+    if (x0 > x1) {
+        std::swap(x0, x1);
+        std::swap(y0, y1);
+    }
+    int16_t dx = x1 - x0, dy = abs(y1 - y0);
+    int16_t err = dx / 2, ystep = (y0 < y1) ? 1 : -1;
+    for (; x0<=x1; x0++) {
+        if (steep) gfxPixel(y0, x0, c);
+        else       gfxPixel(x0, y0, c);
+        err -= dy;
+        if (err < 0) {
+            y0 += ystep;
+            err += dx;
+        }
+    }
+}
+
+static void gfxCircle(int16_t x0, int16_t y0, int16_t r, uint16_t c) {
+    int16_t f = 1 - r, ddx = 1, ddy = -2 * r, x = 0, y = r;
+    gfxPixel(x0, y0 + r, c);
+    gfxPixel(x0, y0 - r, c);
+    gfxPixel(x0 + r, y0, c);
+    gfxPixel(x0 - r, y0, c);
+    while (x < y) {
+        if (f >= 0) {
+            y--;
+            ddy += 2;
+            f += ddy;
+        }
+        x++;
+        ddx += 2;
+        f += ddx;
+        gfxPixel(x0 + x, y0 + y, c);
+        gfxPixel(x0 - x, y0 + y, c);
+        gfxPixel(x0 + x, y0 - y, c);
+        gfxPixel(x0 - x, y0 - y, c);
+        gfxPixel(x0 + y, y0 + x, c);
+        gfxPixel(x0 - y, y0 + x, c);
+        gfxPixel(x0 + y, y0 - x, c);
+        gfxPixel(x0 - y, y0 - x, c);
+    }
+}
+
+static void gfxCorner(int16_t x0, int16_t y0, int16_t r, uint8_t corner, uint16_t c) {
+    int16_t f = 1 - r, ddx = 1, ddy = -2 * r, x = 0, y = r;
+    while (x < y) {
+        if (f >= 0) {
+            y--;
+            ddy += 2;
+            f += ddy;
+        }
+        x++;
+        ddx += 2;
+        f += ddx;
+        if (corner & 4) {
+            gfxPixel(x0 + x, y0 + y, c);
+            gfxPixel(x0 + y, y0 + x, c);
+        }
+        if (corner & 2) {
+            gfxPixel(x0 + x, y0 - y, c);
+            gfxPixel(x0 + y, y0 - x, c);
+        }
+        if (corner & 8) {
+            gfxPixel(x0 - y, y0 + x, c);
+            gfxPixel(x0 - x, y0 + y, c);
+        }
+        if (corner & 1) {
+            gfxPixel(x0 - y, y0 - x, c);
+            gfxPixel(x0 - x, y0 - y, c);
+        }
+    }
+}
+
+static void gfxRoundRect(int16_t x, int16_t y, int16_t w, int16_t h, int16_t r, uint16_t c) {
+    int16_t max = ((w < h) ? w : h) / 2;
+    if (r > max) r = max;
+    gfxHLine(x + r, y, w - 2 * r, c);
+    gfxHLine(x + r, y + h - 1, w - 2 * r, c);
+    gfxVLine(x, y + r, h - 2 * r, c);
+    gfxVLine(x + w - 1, y + r, h - 2 * r, c);
+    gfxCorner(x + r, y + r, r, 1, c);
+    gfxCorner(x + w - r - 1, y + r, r, 2, c);
+    gfxCorner(x + w - r - 1, y + h - r - 1, r, 4, c);
+    gfxCorner(x + r, y + h - r - 1, r, 8, c);
+}
+
+static void gfxFillCorner(int16_t x0, int16_t y0, int16_t r, uint8_t corners, int16_t delta,
+        uint16_t c) {
+    int16_t f = 1 - r, ddx = 1, ddy = -2 * r, x = 0, y = r, px = x, py = y;
+    delta++;
+    while (x < y) {
+        if (f >= 0) {
+            y--;
+            ddy += 2;
+            f += ddy;
+        }
+        x++;
+        ddx += 2;
+        f += ddx;
+        if (x < (y + 1)) {
+            if (corners & 1) gfxVLine(x0 + x, y0 - y, 2 * y + delta, c);
+            if (corners & 2) gfxVLine(x0 - x, y0 - y, 2 * y + delta, c);
+        }
+        if (y != py) {
+            if (corners & 1) gfxVLine(x0 + py, y0 - px, 2 * px + delta, c);
+            if (corners & 2) gfxVLine(x0 - py, y0 - px, 2 * px + delta, c);
+            py = y;
+        }
+        px = x;
+    }
+}
+
+static void gfxFillCircle(int16_t x0, int16_t y0, int16_t r, uint16_t c) {
+    gfxVLine(x0, y0 - r, 2 * r + 1, c);
+    gfxFillCorner(x0, y0, r, 3, 0, c);
+}
+
+static void gfxFillRoundRect(int16_t x, int16_t y, int16_t w, int16_t h, int16_t r, uint16_t c) {
+    int16_t max = ((w < h) ? w : h) / 2;
+    if (r > max) r = max;
+    for (int16_t i=x+r; i<x+w-r; i++) gfxVLine(i, y, h, c);
+    gfxFillCorner(x + w - r - 1, y + r, r, 1, h - 2 * r - 1, c);
+    gfxFillCorner(x + r, y + r, r, 2, h - 2 * r - 1, c);
+}
+
+static void gfxFillTriangle(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
+        int16_t x2, int16_t y2, uint16_t c) {
+    int16_t a, b, y, last;
+    if (y0 > y1) { std::swap(y0, y1); std::swap(x0, x1); }
+    if (y1 > y2) { std::swap(y2, y1); std::swap(x2, x1); }
+    if (y0 > y1) { std::swap(y0, y1); std::swap(x0, x1); }
+    if (y0 == y2) {
+        a = b = x0;
+        if (x1 < a) a = x1;
+        else if (x1 > b) b = x1;
+        if (x2 < a) a = x2;
+        else if (x2 > b) b = x2;
+        gfxHLine(a, y0, b - a + 1, c);
+        return;
+    }
+    int16_t dx01 = x1 - x0, dy01 = y1 - y0, dx02 = x2 - x0, dy02 = y2 - y0,
+            dx12 = x2 - x1, dy12 = y2 - y1;
+    int32_t sa = 0, sb = 0;
+    last = (y1 == y2) ? y1 : y1 - 1;
+    for (y=y0; y<=last; y++) {
+        a = x0 + sa / dy01;
+        b = x0 + sb / dy02;
+        sa += dx01;
+        sb += dx02;
+        if (a > b) std::swap(a, b);
+        gfxHLine(a, y, b - a + 1, c);
+    }
+    sa = (int32_t)dx12 * (y - y1);
+    sb = (int32_t)dx02 * (y - y0);
+    for (; y<=y2; y++) {
+        a = x1 + sa / dy12;
+        b = x0 + sb / dy02;
+        sa += dx12;
+        sb += dx02;
+        if (a > b) std::swap(a, b);
+        gfxHLine(a, y, b - a + 1, c);
+    }
+}
+
+/// Span-based shapes light exactly the pixels Adafruit_GFX would
+static bool primitives(void) {
+    ILI9341_SimTransport fast, slow;
+    Adafruit_ILI9341 tft(&fast), ref(&slow);
+    CHECK(tft.begin() && ref.begin());
+    gfx = &ref;
+    for (int i=0; i<2000; i++) {
+        tft.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+        ref.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+        // Partly off-screen shapes exercise clipping too
+        int16_t x0 = rand() % 300 - 30, y0 = rand() % 380 - 30;
+        int16_t x1 = rand() % 300 - 30, y1 = rand() % 380 - 30;
+        int16_t x2 = rand() % 300 - 30, y2 = rand() % 380 - 30;
+        int16_t r = rand() % 60;
+        int16_t w = rand() % 120 + 1, h = rand() % 120 + 1;
+        if (i % 14 >= 7) { // Shapes much larger than the screen, mostly clipped away
+            x0 = rand() % 1200 - 480;
+            y0 = rand() % 1200 - 440;
+            r = rand() % 500;
+            w = rand() % 1000 + 1;
+            h = rand() % 1000 + 1;
+        }
+        switch (i % 7) {
+            case 0:
+                tft.drawLine(x0, y0, x1, y1, ILI9341_MAGENTA);
+                gfxLine(x0, y0, x1, y1, ILI9341_MAGENTA);
+                break;
+            case 1:
+                tft.drawCircle(x0, y0, r, ILI9341_MAGENTA);
+                gfxCircle(x0, y0, r, ILI9341_MAGENTA);
+                break;
+            case 2:
+                tft.drawRoundRect(x0, y0, w, h, r, ILI9341_MAGENTA);
+                gfxRoundRect(x0, y0, w, h, r, ILI9341_MAGENTA);
+                break;
+            case 3:
+                tft.fillCircle(x0, y0, r, ILI9341_MAGENTA);
+                gfxFillCircle(x0, y0, r, ILI9341_MAGENTA);
+                break;
+            case 4:
+                tft.fillRoundRect(x0, y0, w, h, r, ILI9341_MAGENTA);
+                gfxFillRoundRect(x0, y0, w, h, r, ILI9341_MAGENTA);
+                break;
+            case 5:
+                tft.fillTriangle(x0, y0, x1, y1, x2, y2, ILI9341_MAGENTA);
+                gfxFillTriangle(x0, y0, x1, y1, x2, y2, ILI9341_MAGENTA);
+                break;
+            default:
+                tft.drawTriangle(x0, y0, x1, y1, x2, y2, ILI9341_MAGENTA);
+                gfxLine(x0, y0, x1, y1, ILI9341_MAGENTA);
+                gfxLine(x1, y1, x2, y2, ILI9341_MAGENTA);
+                gfxLine(x2, y2, x0, y0, ILI9341_MAGENTA);
+                break;
+        }
+        CHECK(sameScreen(fast, slow));
+    }
+
+    // A filled shape covers its own outline
+    for (int i=0; i<200; i++) {
+        int16_t x = rand() % ILI9341_TFTWIDTH, y = rand() % ILI9341_TFTHEIGHT;
+        int16_t r = rand() % 80;
+        int16_t rx = 10, ry = 10, rw = 100, rh = 60;
+        if (i & 1) {
+            x = rand() % 1200 - 480;
+            y = rand() % 1200 - 440;
+            r = rand() % 500;
+            rx = rand() % 1200 - 480;
+            ry = rand() % 1200 - 440;
+            rw = rand() % 1000 + 1;
+            rh = rand() % 1000 + 1;
+        }
+        tft.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+        ref.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+        tft.drawCircle(x, y, r, ILI9341_RED);
+        tft.drawRoundRect(rx, ry, rw, rh, r % 300, ILI9341_RED);
+        ref.fillCircle(x, y, r, ILI9341_WHITE);
+        ref.fillRoundRect(rx, ry, rw, rh, r % 300, ILI9341_WHITE);
+        for (int p=0; p<SCREEN_PIXELS; p++) {
+            CHECK((fast.gram()[p] != ILI9341_RED) || (slow.gram()[p] == ILI9341_WHITE));
+        }
+    }
+    return true;
+}
+/// Vectorized blending gives the scalar result, and both driver paths agree
+static bool blendKernels(void) {
+    for (int i=0; i<3000; i++) {
+        uint32_t n = rand() % 100;
+        uint16_t fast[100], slow[100];
+        uint8_t mask[100], rgba[400];
+        for (uint32_t j=0; j<n; j++) {
+            fast[j] = slow[j] = rand();
+            mask[j] = rand();
+        }
+        for (int j=0; j<400; j++) rgba[j] = rand();
+        uint16_t color = rand();
+        uint8_t alpha = rand();
+        switch (i % 3) {
+            case 0:
+                ILI9341_blendFill(fast, color, alpha, n);
+                ILI9341_blendFillScalar(slow, color, alpha, n);
+                break;
+            case 1:
+                ILI9341_blendMask(fast, color, mask, n);
+                ILI9341_blendMaskScalar(slow, color, mask, n);
+                break;
+            default:
+                ILI9341_blendRGBA(fast, rgba, n);
+                ILI9341_blendRGBAScalar(slow, rgba, n);
+                break;
+        }
+        CHECK(!memcmp(fast, slow, n * sizeof(uint16_t)));
+    }
+
+    // Reading the panel back and blending in the framebuffer must match
+    ILI9341_SimTransport readback, shadow;
+    Adafruit_ILI9341 a(&readback), b(&shadow);
+    CHECK(a.begin() && b.begin());
+    CHECK(b.enableFramebuffer());
+    static uint8_t mask[50 * 40], image[300 * 100 * 4];
+    for (size_t i=0; i<sizeof(mask); i++) mask[i] = rand();
+    for (size_t i=0; i<sizeof(image); i++) image[i] = rand();
+    Adafruit_ILI9341 *panels[] = { &a, &b };
+    for (int p=0; p<2; p++) {
+        Adafruit_ILI9341 &tft = *panels[p];
+        tft.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLUE);
+        tft.fillRect(30, 30, 100, 100, ILI9341_YELLOW);
+        tft.blendRect(-10, 20, 200, 60, ILI9341_RED, 100);
+        tft.blendMask(220, 300, mask, 50, 40, ILI9341_WHITE);
+        tft.blendRGBA(-5, -5, image, 300, 100); // Several chunks when read back
+        tft.flush();
+    }
+    CHECK(sameScreen(readback, shadow));
+    return true;
+}
+
+static uint16_t layerImages[6][100 * 80];
+static uint16_t layerBackground[SCREEN_PIXELS];
+
+/// What the compositor should show: every visible layer drawn in full, back to front
+static void composeAll(const ILI9341_Compositor &comp, const int8_t *ids, int n,
+        uint16_t background, uint16_t *out) {
+    for (int i=0; i<SCREEN_PIXELS; i++) out[i] = background;
+    std::vector<int8_t> order(ids, ids + n);
+    std::stable_sort(order.begin(), order.end(), [&comp](int8_t a, int8_t b) {
+        const ILI9341_Layer &la = comp.layer(a), &lb = comp.layer(b);
+        return (la.z < lb.z) || ((la.z == lb.z) && (a < b));
+    });
+    for (size_t i=0; i<order.size(); i++) {
+        const ILI9341_Layer &l = comp.layer(order[i]);
+        if (!l.pixels || !l.visible) continue;
+        for (int16_t y=0; y<l.h; y++) {
+            for (int16_t x=0; x<l.w; x++) {
+                int16_t sx = l.x + x, sy = l.y + y;
+                if ((sx < 0) || (sy < 0) || (sx >= ILI9341_TFTWIDTH) || (sy >= ILI9341_TFTHEIGHT)) continue;
+                uint16_t p = l.pixels[y * l.stride + x];
+                if (l.keyed && (p == l.key)) continue;
+                out[sy * ILI9341_TFTWIDTH + sx] = p;
+            }
+        }
+    }
+}
+
+/// Redrawing only the damaged tiles leaves the screen a full recompose would
+static bool compositor(void) {
+    static uint16_t want[SCREEN_PIXELS];
+    for (int k=0; k<6; k++) {
+        for (int i=0; i<100*80; i++) {
+            layerImages[k][i] = (rand() % 4 == 0) ? ILI9341_MAGENTA : rand();
+        }
+    }
+    for (int i=0; i<SCREEN_PIXELS; i++) layerBackground[i] = i;
+
+    for (int fb=0; fb<2; fb++) {
+        ILI9341_SimTransport sim;
+        Adafruit_ILI9341 tft(&sim);
+        CHECK(tft.begin());
+        if (fb) CHECK(tft.enableFramebuffer());
+        ILI9341_Compositor comp(tft, ILI9341_NAVY);
+        int8_t ids[7];
+        ids[0] = comp.addLayer(layerBackground, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, -10);
+        for (int k=0; k<6; k++) {
+            ids[k + 1] = comp.addLayer(layerImages[k], 20 + k * 13, 15 + k * 11, k % 3, 100);
+            CHECK(ids[k + 1] >= 0);
+            comp.moveLayer(ids[k + 1], rand() % 260 - 20, rand() % 340 - 20);
+            if (k & 1) comp.setColorKey(ids[k + 1], true, ILI9341_MAGENTA);
+        }
+        comp.setVisible(ids[0], false);
+        // Bad ids are ignored
+        comp.moveLayer(-1, 0, 0);
+        comp.setZ(ILI9341_MAX_LAYERS, 3);
+        CHECK(!comp.layer(ILI9341_MAX_LAYERS).pixels);
+
+        for (int i=0; i<300; i++) {
+            int8_t id = ids[1 + rand() % 6];
+            switch (rand() % 6) {
+                case 0: case 1: case 2:
+                    comp.moveLayer(id, comp.layer(id).x + rand() % 11 - 5,
+                                   comp.layer(id).y + rand() % 11 - 5);
+                    break;
+                case 3:  comp.setZ(id, rand() % 5); break;
+                case 4:  comp.setVisible(id, rand() % 2); break;
+                default: comp.setVisible(ids[0], rand() % 2); break;
+            }
+            comp.update();
+            tft.flush();
+            composeAll(comp, ids, 7, ILI9341_NAVY, want);
+            for (int p=0; p<SCREEN_PIXELS; p++) {
+                CHECK(sim.displayPixel(p % ILI9341_TFTWIDTH, p / ILI9341_TFTWIDTH) == want[p]);
+            }
+        }
+    }
+    return true;
+}
+
+/// Server thread body for frameServer()
+static void serve(ILI9341_FrameServer *server) {
+    server->run();
+}
+
+/// Clients of frameServer() drawing random regions, checked on the panel
+static bool frameClients(const char *name, const ILI9341_SimTransport &sim) {
+    ILI9341_FrameClient a, b;
+    CHECK(a.open(name) && b.open(name) && a.connected());
+    CHECK((a.width() == ILI9341_TFTWIDTH) && (a.height() == ILI9341_TFTHEIGHT));
+    uint16_t *pix = a.pixels();
+    for (int i=0; i<400; i++) {
+        // Many small regions, more than the server keeps apart, from two clients
+        ILI9341_FrameClient &c = (i & 1) ? b : a;
+        int16_t x = rand() % 260 - 10, y = rand() % 340 - 10, w = rand() % 40 + 1, h = rand() % 30 + 1;
+        uint16_t color = rand();
+        for (int16_t row=std::max<int16_t>(y, 0); row<std::min<int16_t>(y + h, ILI9341_TFTHEIGHT); row++) {
+            for (int16_t col=std::max<int16_t>(x, 0); col<std::min<int16_t>(x + w, ILI9341_TFTWIDTH); col++) {
+                pix[row * ILI9341_TFTWIDTH + col] = color;
+            }
+        }
+        uint32_t fence = c.submit(x, y, w, h);
+        CHECK(fence);
+        if (i % 20 == 19) {
+            CHECK(c.waitFence(fence, 5000));
+            for (int p=0; p<SCREEN_PIXELS; p++) {
+                CHECK(sim.displayPixel(p % ILI9341_TFTWIDTH, p / ILI9341_TFTWIDTH) == pix[p]);
+            }
+        }
+    }
+    return true;
+}
+
+/// Regions clients draw into shared memory reach the panel by the time their fence completes
+static bool frameServer(void) {
+    char name[32];
+    snprintf(name, sizeof(name), "/ili9341-tests-%d", (int)getpid());
+    ILI9341_FrameClient client;
+    CHECK(!client.open(name));
+
+    ILI9341_SimTransport sim;
+    Adafruit_ILI9341 tft(&sim);
+    CHECK(tft.begin());
+    tft.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_BLACK);
+    ILI9341_FrameServer server(tft, name, 0);
+    CHECK(server.begin());
+    memset(server.pixels(), 0, SCREEN_PIXELS * sizeof(uint16_t));
+    CHECK(client.open(name));
+    std::thread thread(serve, &server);
+    bool ok = frameClients(name, sim);
+    server.stop();
+    thread.join();
+    CHECK(ok && (server.frames() > 0));
+
+    server.end();
+    CHECK(!client.connected());
+    CHECK(!client.open(name));
+    return true;
+}
+
+/// Simulated panel whose transfers are as small as the pool allows
+class SmallTransferSim : public ILI9341_SimTransport {
+    public:
+        uint32_t maxTransfer(void) const { return ILI9341_POOL_MIN_BYTES; }
+};
+
+/// Pool buffers sized to the transport draw the same picture and all come back
+static bool bufferPool(void) {
+    ILI9341_BufferPool pool(ILI9341_POOL_BUFFERS, 5000);
+    uint8_t *bufs[ILI9341_POOL_BUFFERS];
+    for (int i=0; i<ILI9341_POOL_BUFFERS; i++) {
+        bufs[i] = pool.acquire();
+        CHECK(bufs[i] && !((uintptr_t)bufs[i] % ILI9341_CACHE_LINE));
+        for (int j=0; j<i; j++) CHECK(abs(bufs[i] - bufs[j]) >= 5000);
+    }
+    CHECK(pool.stats().inUse == ILI9341_POOL_BUFFERS);
+    for (int i=0; i<ILI9341_POOL_BUFFERS; i++) pool.release(bufs[i]);
+    CHECK(!pool.stats().inUse && !pool.stats().waits);
+
+    static uint16_t back[2][120 * 50];
+    static uint8_t rgb[70 * 40 * 3];
+    for (size_t i=0; i<sizeof(rgb); i++) rgb[i] = rand();
+    ILI9341_SimTransport big;
+    SmallTransferSim small;
+    Adafruit_ILI9341 a(&big), b(&small);
+    Adafruit_ILI9341 *panels[] = { &a, &b };
+    for (int p=0; p<2; p++) {
+        Adafruit_ILI9341 &tft = *panels[p];
+        CHECK(tft.begin());
+        tft.fillRect(0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT, ILI9341_NAVY);
+        scene(tft, 7);
+        tft.drawRGBBitmap(-10, 100, rgb, ILI9341_RGB888, 70, 40);
+        tft.drawText(3, 200, "Pool buffers", ILI9341_WHITE, ILI9341_BLACK, 2);
+        tft.blendRect(0, 40, ILI9341_TFTWIDTH, 120, ILI9341_RED, 80);
+        tft.readRect(50, 60, 120, 50, back[p]);
+    }
+    CHECK(b.poolStats().bufferBytes == ILI9341_POOL_MIN_BYTES);
+    CHECK(sameScreen(big, small));
+    CHECK(!memcmp(back[0], back[1], sizeof(back[0])));
+    for (int p=0; p<2; p++) {
+        // Only the cached fill-color buffer stays out
+        CHECK(panels[p]->poolStats().inUse <= 1);
+        CHECK(!panels[p]->poolStats().waits);
+    }
+    return true;
+}
+
+/// Test image: noise, gradients, stripes, one color, or flat areas with specks
+static std::vector<uint16_t> packImage(int kind, int16_t w, int16_t h) {
+    std::vector<uint16_t> img((size_t)w * h);
+    for (int16_t y=0; y<h; y++) {
+        for (int16_t x=0; x<w; x++) {
+            uint16_t c;
+            switch (kind) {
+                case 0:  c = rand(); break;
+                case 1:  c = x * 3 + y * 5; break;
+                case 2:  c = (((x / 16) + (y / 9)) & 1) ? ILI9341_RED : ILI9341_BLUE; break;
+                case 3:  c = 0x1234; break;
+                default:
+                    c = ((x / 8 & 31) << 11) | ((y / 5 & 63) << 5) | ((x + y) / 9 & 31);
+                    if (rand() % 50 == 0) c = rand();
+                    break;
+            }
+            img[(size_t)y * w + x] = c;
+        }
+    }
+    return img;
+}
+
+/// Packed assets decode to the image they were encoded from, and draw like it
+static bool packedAssets(void) {
+    for (int kind=0; kind<5; kind++) {
+        for (int i=0; i<20; i++) {
+            int16_t w = 1 + rand() % 300, h = 1 + rand() % 300;
+            std::vector<uint16_t> img = packImage(kind, w, h);
+            std::vector<uint8_t> ops;
+            ILI9341_PackedAsset::encode(img.data(), w, h, ops);
+            std::vector<uint8_t> wire((size_t)w * h * 2);
+            ILI9341_AssetDecoder dec(ops.data(), ops.size());
+            CHECK(dec.decode(wire.data(), (uint32_t)w * h));
+            for (size_t p=0; p<img.size(); p++) {
+                CHECK(((wire[p * 2] << 8) | wire[p * 2 + 1]) == img[p]);
+            }
+            ILI9341_AssetDecoder skipper(ops.data(), ops.size());
+            CHECK(skipper.skip((uint32_t)w * h));
+        }
+    }
+
+    for (int fb=0; fb<2; fb++) {
+        ILI9341_SimTransport packed, plain;
+        Adafruit_ILI9341 a(&packed), b(&plain);
+        CHECK(a.begin() && b.begin());
+        if (fb) CHECK(a.enableFramebuffer() && b.enableFramebuffer());
+        for (int i=0; i<300; i++) {
+            int16_t w = 1 + rand() % 200, h = 1 + rand() % 200;
+            std::vector<uint16_t> img = packImage(rand() % 5, w, h);
+            std::vector<uint8_t> ops;
+            ILI9341_PackedAsset::encode(img.data(), w, h, ops);
+            if (i % 7 == 0) {
+                uint8_t r = rand() % 4;
+                a.setRotation(r);
+                b.setRotation(r);
+            }
+            int16_t x = rand() % 400 - 150, y = rand() % 500 - 200;
+            CHECK(a.drawPackedBitmap(x, y, ops.data(), ops.size(), w, h));
+            b.drawRGBBitmap(x, y, img.data(), w, h);
+        }
+        a.flush();
+        b.flush();
+        CHECK(sameScreen(packed, plain));
+        // A truncated stream draws what it has, reports it and returns its buffer
+        std::vector<uint16_t> img = packImage(0, 50, 50);
+        std::vector<uint8_t> ops;
+        ILI9341_PackedAsset::encode(img.data(), 50, 50, ops);
+        CHECK(!a.drawPackedBitmap(-10, -10, ops.data(), ops.size() / 2, 50, 50));
+        CHECK(a.poolStats().inUse <= 1);
+        // Data that ends before the first visible pixel sends nothing
+        uint64_t commands = a.stats().commands;
+        CHECK(!a.drawPackedBitmap(-10, -40, ops.data(), ops.size() / 10, 50, 50));
+        CHECK(a.stats().commands == commands);
+        CHECK(a.drawPackedBitmap(-60, 0, ops.data(), 0, 50, 50)); // Nothing visible
+    }
+
+    char path[] = "/tmp/ili9341_testsXXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+    std::vector<uint16_t> img = packImage(2, 100, 60);
+    bool saved = ILI9341_PackedAsset::save(path, img.data(), 100, 60);
+    ILI9341_PackedAsset asset;
+    bool opened = saved && asset.open(path);
+    unlink(path);
+    CHECK(opened);
+    CHECK((asset.width() == 100) && (asset.height() == 60));
+    ILI9341_SimTransport sim;
+    Adafruit_ILI9341 tft(&sim);
+    CHECK(tft.begin());
+    CHECK(tft.drawAsset(5, 7, asset));
+    for (int16_t y=0; y<60; y++) {
+        for (int16_t x=0; x<100; x++) {
+            CHECK(sim.displayPixel(5 + x, 7 + y) == img[y * 100 + x]);
+        }
+    }
+    return true;
+}
+
+static const struct {
+    const char *name;
+    bool      (*run)(void);
+} tests[] = {
+    { "sim_transport",   simTransport   },
+    { "framebuffer",     framebuffer    },
+    { "init_sequence",   initSequence   },
+    { "window_cache",    windowCache    },
+    { "async_flush",     asyncFlush     },
+    { "counters",        counters       },
+    { "convert_kernels", convertKernels },
+    { "scroll_regions",  scrollRegions  },
+    { "tile_diff",       tileDiff       },
+    { "glyph_cache",     glyphCache     },
+    { "assets",          assets         },
+    { "clock_calibrate", clockCalibration },
+    { "readback",        readback       },
+    { "parallel_flush",  parallelFlush  },
+    { "command_queue",   commandQueue   },
+    { "display_list",    displayList    },
+    { "primitives",      primitives     },
+    { "blend_kernels",   blendKernels   },
+    { "compositor",      compositor     },
+    { "frame_server",    frameServer    },
+    { "buffer_pool",     bufferPool     },
+    { "packed_assets",   packedAssets   },
+};
+
+int main(void)
+{
+    int failed = 0;
+    printf("kernels: convert %s, blend %s\n", ILI9341_convertImpl(), ILI9341_blendImpl());
+    for (size_t t=0; t<sizeof(tests)/sizeof(tests[0]); t++) {
+        srand(t + 1); // Same data on every run
+        bool ok = tests[t].run();
+        printf("%-16s %s\n", tests[t].name, ok ? "ok" : "FAILED");
+        if (!ok) failed++;
+    }
+    return failed ? 1 : 0;
+}
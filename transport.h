@@ -0,0 +1,105 @@
+/*!
+* @file transport.h
+*
+* Bus transport interface used by the ILI9341 driver.
+*
+* The driver never touches the SPI peripheral or the control GPIOs directly;
+* it goes through an ILI9341_Transport. This lets the same drawing code run
+* against the bcm2835 library, the Linux spidev interface, or the in-memory
+* panel model in transport_sim.h.
+*
+* Several panels may share one SPI controller, each with its own chip
+* select. Their transports then share an ILI9341_BusLock so that a panel
+* owns the controller from CS low to CS high and transactions of different
+* panels never interleave. A thread must not open a transaction on one
+* panel while it holds another on the same controller.
+*
+*/
+
+#ifndef _ILI9341_TRANSPORT_H_
+#define _ILI9341_TRANSPORT_H_
+
+#include <stdint.h>			//uint_t
+
+#include <mutex>
+
+
+/// Ownership of a shared SPI controller, held while a panel is selected
+class ILI9341_BusLock {
+    public:
+        ILI9341_BusLock() : _mutex(NULL), _held(false) {}
+
+        /// Share the controller guarded by m; NULL for a controller of our own
+        void    attach(std::mutex *m)   { _mutex = m; }
+        /// True while this transport owns the controller
+        bool    held(void) const        { return _held; }
+
+        /// Take the controller before CS goes low. Returns true if it was not held yet.
+        bool    acquire(void) {
+            if (_held) return false;
+            if (_mutex) _mutex->lock();
+            _held = true;
+            return true;
+        }
+        /// Hand the controller back after CS went high
+        void    release(void) {
+            if (!_held) return;
+            _held = false;
+            if (_mutex) _mutex->unlock();
+        }
+
+    private:
+        std::mutex *_mutex; ///< Shared with the other transports on the controller
+        bool        _held;
+};
+
+/// Abstract SPI + control line transport for an ILI9341 panel
+class ILI9341_Transport {
+    public:
+        virtual ~ILI9341_Transport() {}
+
+        /// Acquire the bus and configure the control lines. Returns false on failure.
+        virtual bool    begin(void) = 0;
+        /// Release the bus
+        virtual void    end(void) = 0;
+
+        /// Drive chip select (true = deselected / high)
+        virtual void    setCS(bool high) = 0;
+        /// Drive the data/command line (true = data, false = command)
+        virtual void    setDC(bool data) = 0;
+        /// Drive the reset line (true = released / high)
+        virtual void    setReset(bool high) = 0;
+
+        /// Write a single byte
+        virtual void    write(uint8_t b) = 0;
+        /// Write a buffer of bytes in as few bus transfers as possible
+        virtual void    write(const uint8_t *buf, uint32_t len) = 0;
+        /// Clock out a zero byte and return the byte read back
+        virtual uint8_t read(void) = 0;
+        /// Clock out len zero bytes, storing the bytes read back
+        virtual void    read(uint8_t *buf, uint32_t len) {
+            for (uint32_t i=0; i<len; i++) {
+                buf[i] = read();
+            }
+        }
+
+        /// Change the SPI clock. Returns false if the transport can't.
+        virtual bool    setClock(uint32_t /*hz*/) { return false; }
+        /// SPI clock actually in use in Hz, 0 if unknown
+        virtual uint32_t clock(void) const { return 0; }
+        /// Largest write sent as one bus transfer in bytes, 0 if there is no limit.
+        /// Valid after begin().
+        virtual uint32_t maxTransfer(void) const { return 0; }
+
+        /// Block for the given number of milliseconds
+        virtual void    delay(uint32_t ms) = 0;
+
+        /// Send a command byte with DC low, leaving DC high for parameters
+        virtual void    writeCommand(uint8_t cmd) {
+            setDC(false);
+            write(cmd);
+            setDC(true);
+        }
+};
+
+#endif
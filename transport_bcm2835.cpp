@@ -0,0 +1,173 @@
+/*!
+* @file transport_bcm2835.cpp
+*
+* bcm2835 library implementation of ILI9341_Transport.
+*
+*/
+
+#include <stdio.h>  		//printf
+#include <string.h>			//memset
+
+#include "transport_bcm2835.h"
+
+
+static std::mutex spiLock;          //Turns on SPI0, held from CS low to CS high
+static std::mutex initLock;         //Guards the two below
+static int        users;            //Transports between begin() and end()
+static uint16_t   spiDivider;       //Divider last written to the controller
+
+/**************************************************************************/
+/*!
+    @brief   Set up a GPIO as an output, initially high
+    @param   pin  GPIO, ignored if BCM2835_NO_PIN
+*/
+/**************************************************************************/
+static void gpioOutput(uint8_t pin) {
+    if (pin == BCM2835_NO_PIN) return;
+	bcm2835_gpio_fsel(pin,BCM2835_GPIO_FSEL_OUTP);
+	bcm2835_gpio_write(pin,HIGH);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Initialize the bcm2835 library and SPI0 if no other panel has,
+             then the control pins of this panel
+    @return  True on success
+*/
+/**************************************************************************/
+bool ILI9341_BCM2835Transport::begin(void) {
+    std::lock_guard<std::mutex> guard(initLock);
+    if (_started) return true;
+
+    if (users == 0) {
+        //Initialize the bcm2835 library
+        if (!bcm2835_init())
+        {
+          printf("bcm2835_init failed. Are you running as root??\n");
+          return false;
+        }
+
+        //Initialize the SPI module
+        if (!bcm2835_spi_begin())
+        {
+          printf("bcm2835_spi_begin failed. Are you running as root??\n");
+          bcm2835_close();
+          return false;
+        }
+        bcm2835_spi_setBitOrder(BCM2835_SPI_BIT_ORDER_MSBFIRST);      // The default
+        bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);                   // The default
+        bcm2835_spi_chipSelect(BCM2835_SPI_CS0);                      // The default
+        bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);      // the default
+        spiDivider = 0;
+    }
+    users++;
+    _started = true;
+    _lock.attach(&spiLock);
+    setClock(_hz);
+
+	//Initialize the control signals
+	gpioOutput(_reset);
+	gpioOutput(_dc);
+	gpioOutput(_cs);
+
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Release this panel; the last one closes SPI0 and the library
+*/
+/**************************************************************************/
+void ILI9341_BCM2835Transport::end(void) {
+    std::lock_guard<std::mutex> guard(initLock);
+    if (!_started) return;
+    setCS(true);
+    _started = false;
+    if (--users == 0) {
+        bcm2835_spi_end();
+        bcm2835_close();
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief   Select or deselect the panel. Selecting waits for SPI0 and
+             switches it to this panel's clock; deselecting hands it back.
+    @param   high  True to deselect
+*/
+/**************************************************************************/
+void ILI9341_BCM2835Transport::setCS(bool high) {
+    if (!high && _lock.acquire()) {
+        if (spiDivider != _divider) {
+            bcm2835_spi_setClockDivider(_divider);
+            spiDivider = _divider;
+        }
+    }
+    if (_cs != BCM2835_NO_PIN) {
+        bcm2835_gpio_write(_cs, high ? HIGH : LOW);
+    }
+    if (high) {
+        _lock.release();
+    }
+}
+
+void ILI9341_BCM2835Transport::setDC(bool data) {
+    if (_dc != BCM2835_NO_PIN) {
+        bcm2835_gpio_write(_dc, data ? HIGH : LOW);
+    }
+}
+
+void ILI9341_BCM2835Transport::setReset(bool high) {
+    if (_reset != BCM2835_NO_PIN) {
+        bcm2835_gpio_write(_reset, high ? HIGH : LOW);
+    }
+}
+
+void ILI9341_BCM2835Transport::write(uint8_t b) {
+    bcm2835_spi_transfer(b);
+}
+
+void ILI9341_BCM2835Transport::write(const uint8_t *buf, uint32_t len) {
+    bcm2835_spi_writenb((char*)buf, len);
+}
+
+uint8_t ILI9341_BCM2835Transport::read(void) {
+    return bcm2835_spi_transfer(0);
+}
+
+void ILI9341_BCM2835Transport::read(uint8_t *buf, uint32_t len) {
+    memset(buf, 0, len);
+    bcm2835_spi_transfern((char*)buf, len); //Received bytes replace the sent ones
+}
+
+/**************************************************************************/
+/*!
+    @brief   Set the SPI clock to the fastest rate the core clock divider
+             allows without exceeding hz. The controller picks it up the
+             next time this panel is selected.
+    @param   hz  Requested clock in Hz
+    @return  True
+*/
+/**************************************************************************/
+bool ILI9341_BCM2835Transport::setClock(uint32_t hz) {
+    //The divider must be even; 2 is the fastest, 65536 (written as 0) the slowest
+    uint32_t div = hz ? (BCM2835_CORE_CLK_HZ + hz - 1) / hz : 65536;
+    div = (div + 1) & ~1u;
+    if (div < 2) div = 2;
+    if (div > 65536) div = 65536;
+    _hz = hz;
+    _divider = (uint16_t)div;
+    if (_lock.held()) { //Selected already, switch right away
+        bcm2835_spi_setClockDivider(_divider);
+        spiDivider = _divider;
+    }
+    return true;
+}
+
+uint32_t ILI9341_BCM2835Transport::clock(void) const {
+    return BCM2835_CORE_CLK_HZ / (_divider ? _divider : 65536);
+}
+
+void ILI9341_BCM2835Transport::delay(uint32_t ms) {
+    bcm2835_delay(ms);
+}
@@ -0,0 +1,60 @@
+/*!
+* @file transport_bcm2835.h
+*
+* ILI9341 transport built on the bcm2835 library (Raspberry Pi SPI0 with
+* chip select, data/command and reset driven as GPIOs).
+*
+* Any number of panels can hang off SPI0, each transport with its own pins.
+* The library is initialized by the first begin() and closed by the last
+* end(), and the transports take turns on the controller, each with its own
+* clock.
+*
+*/
+
+#ifndef _ILI9341_TRANSPORT_BCM2835_H_
+#define _ILI9341_TRANSPORT_BCM2835_H_
+
+#include <bcm2835.h>
+
+#include "transport.h"
+
+//Default pins
+#define BCM2835_PIN_CS 		RPI_GPIO_P1_11
+#define BCM2835_PIN_DC 		RPI_GPIO_P1_15
+#define BCM2835_PIN_RESET 	RPI_GPIO_P1_22
+#define BCM2835_NO_PIN		0xFF		//Pin not connected, e.g. a reset line driven by another panel
+
+#define BCM2835_DEFAULT_HZ	10000000	//ILI9341 serial write cycle is 100ns minimum
+
+
+/// bcm2835 library transport
+class ILI9341_BCM2835Transport : public ILI9341_Transport {
+    public:
+        ILI9341_BCM2835Transport(uint8_t csPin = BCM2835_PIN_CS,
+                                 uint8_t dcPin = BCM2835_PIN_DC,
+                                 uint8_t resetPin = BCM2835_PIN_RESET,
+                                 uint32_t hz = BCM2835_DEFAULT_HZ) :
+            _cs(csPin), _dc(dcPin), _reset(resetPin), _hz(hz), _divider(0), _started(false) {}
+
+        bool    begin(void);
+        void    end(void);
+        void    setCS(bool high);
+        void    setDC(bool data);
+        void    setReset(bool high);
+        void    write(uint8_t b);
+        void    write(const uint8_t *buf, uint32_t len);
+        uint8_t read(void);
+        void    read(uint8_t *buf, uint32_t len);
+        void    delay(uint32_t ms);
+        bool    setClock(uint32_t hz);
+        uint32_t clock(void) const;
+
+    private:
+        uint8_t  _cs, _dc, _reset;  ///< GPIOs, BCM2835_NO_PIN if unused
+        uint32_t _hz;       ///< Requested SPI clock
+        uint16_t _divider;  ///< Core clock divider for this panel, 0 before begin()
+        bool     _started;  ///< begin() succeeded and holds a library reference
+        ILI9341_BusLock _lock;  ///< Turn on SPI0
+};
+
+#endif
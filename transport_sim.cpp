@@ -0,0 +1,329 @@
+/*!
+* @file transport_sim.cpp
+*
+* In-memory ILI9341 model.
+*
+* GRAM is stored in panel memory order (240 columns by 320 rows). MADCTL is
+* applied to the write pointer as row/column exchange (MV) followed by
+* column (MX) and row (MY) mirroring. The panel glass is mounted mirrored,
+* so displayPixel() flips columns back and applies the vertical scroll
+* definition and offset to give the image a viewer would see.
+*
+*/
+
+#include <string.h>				//memset
+
+#include "transport_sim.h"
+
+#define MADCTL_MY  0x80     ///< Bottom to top
+#define MADCTL_MX  0x40     ///< Right to left
+#define MADCTL_MV  0x20     ///< Reverse Mode
+
+
+ILI9341_SimTransport::ILI9341_SimTransport() {
+    reset();
+    _dc = true;
+    _cs = true;
+    _resetLine = true;
+    _open = false;
+    _bytes = _commands = _pixels = _delayMs = 0;
+    _clock = _maxClock = 0;
+    _glitchCount = 0;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Put the model into its power-on state. GRAM is cleared to black.
+*/
+/**************************************************************************/
+void ILI9341_SimTransport::reset(void) {
+    memset(_gram, 0, sizeof(_gram));
+    _cmd       = ILI9341_NOP;
+    _nparams   = 0;
+    _havePixHi = false;
+    _xs = 0; _xe = ILI9341_TFTWIDTH - 1;
+    _ys = 0; _ye = ILI9341_TFTHEIGHT - 1;
+    _col = 0; _row = 0;
+    _readDummy = false;
+    _readComp  = 0;
+    _readPix   = 0;
+    _madctl    = 0;
+    _scroll    = 0;
+    _tfa       = 0;
+    _vsa       = ILI9341_TFTHEIGHT;
+    _sleep     = true;
+    _displayOn = false;
+    _inverted  = false;
+}
+
+bool ILI9341_SimTransport::begin(void) {
+    _open = true;
+    return true;
+}
+
+void ILI9341_SimTransport::end(void) {
+    _open = false;
+}
+
+void ILI9341_SimTransport::setCS(bool high) {
+    _cs = high;
+}
+
+void ILI9341_SimTransport::setDC(bool data) {
+    _dc = data;
+}
+
+void ILI9341_SimTransport::setReset(bool high) {
+    if (_resetLine && !high) { // Falling edge resets the controller
+        reset();
+    }
+    _resetLine = high;
+}
+
+void ILI9341_SimTransport::write(uint8_t b) {
+    if (!_open) return;             // Closed, like writing to a closed fd
+    if (_cs || !_resetLine) return; // Not selected, byte is ignored
+    _bytes++;
+    if (_dc) {
+        data(glitch(b));
+    } else {
+        command(b);
+    }
+}
+
+void ILI9341_SimTransport::write(const uint8_t *buf, uint32_t len) {
+    for (uint32_t i=0; i<len; i++) {
+        write(buf[i]);
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief   Clock in one byte. After RAMRD the first byte is a dummy, then
+             each pixel comes back as three bytes of 6-bit R, G and B in the
+             top bits, like the panel's 18-bit read format.
+    @return  Byte read, 0 outside of RAMRD
+*/
+/**************************************************************************/
+uint8_t ILI9341_SimTransport::read(void) {
+    if (_cs || !_resetLine) return 0;
+    _bytes++;
+    if (!_dc || (_cmd != ILI9341_RAMRD)) return 0;
+    if (_readDummy) {
+        _readDummy = false;
+        return 0;
+    }
+    if (_readComp == 0) {
+        int32_t i = gramIndex();
+        _readPix = (i >= 0) ? _gram[i] : 0;
+        advance();
+    }
+    uint8_t r5 = _readPix >> 11, g6 = (_readPix >> 5) & 0x3F, b5 = _readPix & 0x1F;
+    uint8_t v;
+    switch (_readComp) {
+        case 0:  v = ((r5 << 1) | (r5 >> 4)) << 2; break; // 5 bit colors expand MSB first
+        case 1:  v = g6 << 2;                      break;
+        default: v = ((b5 << 1) | (b5 >> 4)) << 2; break;
+    }
+    _readComp = (_readComp + 1) % 3;
+    return glitch(v);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Corrupt the occasional byte while the clock is above the limit
+             set with setMaxClock()
+    @param   b  Byte on the wire
+    @return  Byte as the other end sees it
+*/
+/**************************************************************************/
+uint8_t ILI9341_SimTransport::glitch(uint8_t b) {
+    if (_maxClock && (_clock > _maxClock) && ((++_glitchCount % 97) == 0)) {
+        return b ^ 0x10;
+    }
+    return b;
+}
+
+void ILI9341_SimTransport::delay(uint32_t ms) {
+    _delayMs += ms; // Recorded, not slept, so the model runs at full speed
+}
+
+/**************************************************************************/
+/*!
+    @brief   Start decoding a new command
+    @param   cmd  Command byte received with DC low
+*/
+/**************************************************************************/
+void ILI9341_SimTransport::command(uint8_t cmd) {
+    _commands++;
+    _cmd       = cmd;
+    _nparams   = 0;
+    _havePixHi = false;
+    switch (cmd) {
+        case ILI9341_SWRESET:
+            reset();
+            break;
+        case ILI9341_SLPIN:
+            _sleep = true;
+            break;
+        case ILI9341_SLPOUT:
+            _sleep = false;
+            break;
+        case ILI9341_INVOFF:
+            _inverted = false;
+            break;
+        case ILI9341_INVON:
+            _inverted = true;
+            break;
+        case ILI9341_DISPOFF:
+            _displayOn = false;
+            break;
+        case ILI9341_DISPON:
+            _displayOn = true;
+            break;
+        case ILI9341_RAMWR:
+            _col = _xs;
+            _row = _ys;
+            break;
+        case ILI9341_RAMRD:
+            _col = _xs;
+            _row = _ys;
+            _readDummy = true;
+            _readComp  = 0;
+            break;
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief   Consume one parameter / pixel byte for the current command
+    @param   b  Byte received with DC high
+*/
+/**************************************************************************/
+void ILI9341_SimTransport::data(uint8_t b) {
+    if (_cmd == ILI9341_RAMWR) {
+        if (!_havePixHi) {
+            _pixHi = b;
+            _havePixHi = true;
+        } else {
+            storePixel(((uint16_t)_pixHi << 8) | b);
+            _havePixHi = false;
+        }
+        return;
+    }
+
+    if (_nparams < sizeof(_params)) {
+        _params[_nparams] = b;
+    }
+    _nparams++;
+
+    switch (_cmd) {
+        case ILI9341_CASET:
+            if (_nparams == 4) {
+                _xs = ((uint16_t)_params[0] << 8) | _params[1];
+                _xe = ((uint16_t)_params[2] << 8) | _params[3];
+            }
+            break;
+        case ILI9341_PASET:
+            if (_nparams == 4) {
+                _ys = ((uint16_t)_params[0] << 8) | _params[1];
+                _ye = ((uint16_t)_params[2] << 8) | _params[3];
+            }
+            break;
+        case ILI9341_MADCTL:
+            if (_nparams == 1) {
+                _madctl = b;
+            }
+            break;
+        case ILI9341_VSCRDEF:
+            if (_nparams == 6) {
+                _tfa = ((uint16_t)_params[0] << 8) | _params[1];
+                _vsa = ((uint16_t)_params[2] << 8) | _params[3];
+            }
+            break;
+        case ILI9341_VSCRSADD:
+            if (_nparams == 2) {
+                _scroll = ((uint16_t)_params[0] << 8) | _params[1];
+            }
+            break;
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief   Store a pixel at the memory write pointer and advance it
+    @param   color  16-bit 5-6-5 color as received on the wire
+*/
+/**************************************************************************/
+void ILI9341_SimTransport::storePixel(uint16_t color) {
+    int32_t i = gramIndex();
+    if (i >= 0) {
+        _gram[i] = color;
+    }
+    _pixels++;
+    advance();
+}
+
+/**************************************************************************/
+/*!
+    @brief   GRAM offset of the memory pointer after MADCTL mapping
+    @return  Index into _gram, or -1 when the pointer is off the panel
+*/
+/**************************************************************************/
+int32_t ILI9341_SimTransport::gramIndex(void) const {
+    uint16_t gx = _col, gy = _row;
+    if (_madctl & MADCTL_MV) {
+        gx = _row;
+        gy = _col;
+    }
+    if (_madctl & MADCTL_MX) gx = (ILI9341_TFTWIDTH  - 1) - gx;
+    if (_madctl & MADCTL_MY) gy = (ILI9341_TFTHEIGHT - 1) - gy;
+    if (gx < ILI9341_TFTWIDTH && gy < ILI9341_TFTHEIGHT) {
+        return (int32_t)gy * ILI9341_TFTWIDTH + gx;
+    }
+    return -1;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Step the memory pointer through the address window
+*/
+/**************************************************************************/
+void ILI9341_SimTransport::advance(void) {
+    if (_col < _xe) {
+        _col++;
+    } else {
+        _col = _xs;
+        _row = (_row < _ye) ? _row + 1 : _ys;
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief   Read a pixel straight from GRAM
+    @param   col  GRAM column, 0-239
+    @param   row  GRAM row, 0-319
+    @return  16-bit 5-6-5 color, 0 when out of range
+*/
+/**************************************************************************/
+uint16_t ILI9341_SimTransport::gramPixel(uint16_t col, uint16_t row) const {
+    if (col >= ILI9341_TFTWIDTH || row >= ILI9341_TFTHEIGHT) return 0;
+    return _gram[(uint32_t)row * ILI9341_TFTWIDTH + col];
+}
+
+/**************************************************************************/
+/*!
+    @brief   Read the pixel a viewer sees in portrait orientation
+    @param   x  Screen column, 0-239
+    @param   y  Screen row, 0-319
+    @return  16-bit 5-6-5 color, 0 when out of range
+*/
+/**************************************************************************/
+uint16_t ILI9341_SimTransport::displayPixel(uint16_t x, uint16_t y) const {
+    if (x >= ILI9341_TFTWIDTH || y >= ILI9341_TFTHEIGHT) return 0;
+    uint16_t row = y;
+    if ((y >= _tfa) && (y < _tfa + _vsa) && (_vsa != 0)) { // Inside the scroll area
+        row = _tfa + (_scroll - _tfa + y - _tfa + _vsa) % _vsa;
+    }
+    return gramPixel((ILI9341_TFTWIDTH - 1) - x, row);
+}
@@ -0,0 +1,93 @@
+/*!
+* @file transport_sim.h
+*
+* In-memory ILI9341 model implementing ILI9341_Transport.
+*
+* The model decodes the command stream (CASET, PASET, RAMWR, RAMRD, MADCTL,
+* VSCRSADD, ...) into a 240x320 GRAM array, so every draw path can be run,
+* timed and checked on a plain Linux box without a Pi or a panel.
+*
+* setMaxClock() makes the model corrupt bytes whenever the SPI clock is set
+* above a limit, standing in for a board with poor signal integrity.
+*
+*/
+
+#ifndef _ILI9341_TRANSPORT_SIM_H_
+#define _ILI9341_TRANSPORT_SIM_H_
+
+#include "Adafruit_ILI9341.h"
+#include "transport.h"
+
+
+/// Software model of an ILI9341 panel
+class ILI9341_SimTransport : public ILI9341_Transport {
+    public:
+        ILI9341_SimTransport();
+
+        bool    begin(void);
+        void    end(void);
+        void    setCS(bool high);
+        void    setDC(bool data);
+        void    setReset(bool high);
+        void    write(uint8_t b);
+        void    write(const uint8_t *buf, uint32_t len);
+        uint8_t read(void);
+        void    delay(uint32_t ms);
+        bool    setClock(uint32_t hz) { _clock = hz; return true; }
+        uint32_t clock(void) const     { return _clock; }
+        void    setMaxClock(uint32_t hz) { _maxClock = hz; }
+
+        void      reset(void);
+        uint16_t  gramPixel(uint16_t col, uint16_t row) const;
+        uint16_t  displayPixel(uint16_t x, uint16_t y) const;
+        const uint16_t *gram(void) const { return _gram; }
+
+        uint8_t   madctl(void) const     { return _madctl; }
+        uint16_t  scroll(void) const     { return _scroll; }
+        uint16_t  scrollTop(void) const  { return _tfa; }
+        uint16_t  scrollHeight(void) const { return _vsa; }
+        bool      sleeping(void) const   { return _sleep; }
+        bool      displayOn(void) const  { return _displayOn; }
+        bool      inverted(void) const   { return _inverted; }
+
+        uint64_t  bytes(void) const      { return _bytes; }
+        uint64_t  commands(void) const   { return _commands; }
+        uint64_t  pixels(void) const     { return _pixels; }
+        uint64_t  delayMs(void) const    { return _delayMs; }
+
+    private:
+        void      command(uint8_t cmd);
+        void      data(uint8_t b);
+        void      storePixel(uint16_t color);
+        int32_t   gramIndex(void) const;
+        void      advance(void);
+        uint8_t   glitch(uint8_t b);
+
+        uint16_t  _gram[ILI9341_TFTWIDTH * ILI9341_TFTHEIGHT];
+
+        bool      _open;        ///< Between begin() and end(), writes are lost otherwise
+        bool      _dc;          ///< Current DC line level (true = data)
+        bool      _cs;          ///< Current CS line level (true = deselected)
+        bool      _resetLine;   ///< Current RESET line level
+        uint8_t   _cmd;         ///< Command the incoming data belongs to
+        uint8_t   _params[16];  ///< Parameter bytes received for _cmd
+        uint32_t  _nparams;
+        uint8_t   _pixHi;       ///< First byte of a half-received pixel
+        bool      _havePixHi;
+
+        uint16_t  _xs, _xe, _ys, _ye;   ///< Column / page address window
+        uint16_t  _col, _row;           ///< Memory write / read pointer
+        bool      _readDummy;           ///< Next RAMRD byte is the dummy read
+        uint8_t   _readComp;            ///< RAMRD component (R, G, B) returned next
+        uint16_t  _readPix;             ///< Pixel being returned by RAMRD
+        uint32_t  _clock, _maxClock;    ///< SPI clock and the highest one that works, 0 = no limit
+        uint32_t  _glitchCount;
+        uint8_t   _madctl;
+        uint16_t  _scroll;
+        uint16_t  _tfa, _vsa;           ///< VSCRDEF top fixed and scroll area heights
+        bool      _sleep, _displayOn, _inverted;
+
+        uint64_t  _bytes, _commands, _pixels, _delayMs;
+};
+
+#endif
@@ -0,0 +1,237 @@
+/*!
+* @file transport_spidev.cpp
+*
+* spidev implementation of ILI9341_Transport.
+*
+*/
+
+#include <stdio.h>  		//printf
+#include <time.h>			//nanosleep
+
+#include <map>
+#include <string>
+
+#include "transport_spidev.h"
+
+enum { PIN_CS, PIN_DC, PIN_RESET };
+
+/**************************************************************************/
+/*!
+    @brief   Write a string to a sysfs file
+    @param   path  File to write
+    @param   value String to write
+    @return  True on success
+*/
+/**************************************************************************/
+static bool sysfsWrite(const char *path, const char *value) {
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t n = ::write(fd, value, strlen(value));
+    close(fd);
+    return n == (ssize_t)strlen(value);
+}
+
+/**************************************************************************/
+/*!
+    @brief   Export a GPIO through sysfs, make it an output and open its value file
+    @param   pin  sysfs GPIO number
+    @return  File descriptor of the value file, or -1 on failure
+*/
+/**************************************************************************/
+static int gpioOpen(int pin) {
+    char path[64];
+    char num[16];
+
+    snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/value", pin);
+    if (access(path, F_OK) != 0) {
+        snprintf(num, sizeof(num), "%d", pin);
+        sysfsWrite("/sys/class/gpio/export", num); //Fails harmlessly if already exported
+    }
+    snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/direction", pin);
+    if (!sysfsWrite(path, "high")) { //Output, initially high
+        perror("GPIO Init Error: can't set direction");
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/value", pin);
+    return open(path, O_WRONLY);
+}
+
+static void gpioWrite(int fd, bool high) {
+    if (fd >= 0) {
+        if (::write(fd, high ? "1" : "0", 1) != 1) {
+            perror("GPIO Error: failed to write value");
+        }
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief   Find the lock shared by all transports on a controller
+    @param   device  spidev device path
+    @return  Lock for the controller, keyed by bus number for /dev/spidevB.C
+             names and by the path otherwise
+*/
+/**************************************************************************/
+static std::mutex *controllerLock(const char *device) {
+    static std::mutex registryLock;
+    static std::map<std::string, std::mutex> locks;
+
+    std::string key = device;
+    int bus, cs;
+    if (sscanf(device, "/dev/spidev%d.%d", &bus, &cs) == 2) {
+        key = "spidev" + std::to_string(bus);
+    }
+    std::lock_guard<std::mutex> guard(registryLock);
+    return &locks[key];
+}
+
+ILI9341_SpidevTransport::ILI9341_SpidevTransport(const char *device,
+        int csPin, int dcPin, int resetPin, uint32_t hz) : _spi(device, hz), _stageLen(0) {
+    _pins[PIN_CS]    = csPin;
+    _pins[PIN_DC]    = dcPin;
+    _pins[PIN_RESET] = resetPin;
+    for (int i=0; i<3; i++) {
+        _fds[i] = -1;
+    }
+    _lock.attach(controllerLock(device));
+}
+
+/**************************************************************************/
+/*!
+    @brief   Open the spidev device and the control GPIOs
+    @return  True on success
+*/
+/**************************************************************************/
+bool ILI9341_SpidevTransport::begin(void) {
+    if (!_spi.begin()) {
+        return false;
+    }
+    for (int i=0; i<3; i++) {
+        if (_pins[i] < 0) continue;
+        _fds[i] = gpioOpen(_pins[i]);
+        if (_fds[i] < 0) {
+            printf("GPIO %d init failed. Are you running as root??\n", _pins[i]);
+            end();
+            return false;
+        }
+    }
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Close the control GPIOs and the spidev device
+*/
+/**************************************************************************/
+void ILI9341_SpidevTransport::end(void) {
+    if (_lock.held()) {
+        setCS(true);
+    }
+    flush();
+    for (int i=0; i<3; i++) {
+        if (_fds[i] >= 0) {
+            close(_fds[i]);
+            _fds[i] = -1;
+        }
+    }
+    _spi.end();
+}
+
+/**************************************************************************/
+/*!
+    @brief   Submit any batched writes as a single ioctl
+*/
+/**************************************************************************/
+void ILI9341_SpidevTransport::flush(void) {
+    if (_stageLen) {
+        _spi.queue(_stage, NULL, _stageLen);
+        _stageLen = 0;
+    }
+    _spi.submit();
+}
+
+/**************************************************************************/
+/*!
+    @brief   Select or deselect the panel, taking the controller from other
+             panels on it for the time the panel is selected
+    @param   high  True to deselect
+*/
+/**************************************************************************/
+void ILI9341_SpidevTransport::setCS(bool high) {
+    flush();
+    if (!high) {
+        _lock.acquire();
+    }
+    gpioWrite(_fds[PIN_CS], high);
+    if (high) {
+        _lock.release();
+    }
+}
+
+void ILI9341_SpidevTransport::setDC(bool data) {
+    flush();
+    gpioWrite(_fds[PIN_DC], data);
+}
+
+void ILI9341_SpidevTransport::setReset(bool high) {
+    flush();
+    gpioWrite(_fds[PIN_RESET], high);
+}
+
+void ILI9341_SpidevTransport::write(uint8_t b) {
+    if (_stageLen == sizeof(_stage)) {
+        flush();
+    }
+    _stage[_stageLen++] = b;
+}
+
+/**************************************************************************/
+/*!
+    @brief   Write a buffer. Small buffers are copied into the batch, large
+             ones are queued in place behind it and submitted right away
+             since the caller may reuse them once this returns.
+    @param   buf  Bytes to send
+    @param   len  Number of bytes
+*/
+/**************************************************************************/
+void ILI9341_SpidevTransport::write(const uint8_t *buf, uint32_t len) {
+    if (len <= SPIDEV_COPY_LIMIT) {
+        if (_stageLen + len > sizeof(_stage)) {
+            flush();
+        }
+        memcpy(_stage + _stageLen, buf, len);
+        _stageLen += len;
+        return;
+    }
+    if (_stageLen) {
+        _spi.queue(_stage, NULL, _stageLen);
+        _stageLen = 0;
+    }
+    _spi.queue(buf, NULL, len);
+    _spi.submit();
+}
+
+uint8_t ILI9341_SpidevTransport::read(void) {
+    flush();
+    return _spi.read();
+}
+
+void ILI9341_SpidevTransport::read(uint8_t *buf, uint32_t len) {
+    flush();
+    _spi.read(buf, len);
+}
+
+bool ILI9341_SpidevTransport::setClock(uint32_t hz) {
+    flush();
+    return _spi.setSpeed(hz);
+}
+
+void ILI9341_SpidevTransport::delay(uint32_t ms) {
+    flush();
+    struct timespec ts;
+    ts.tv_sec  = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
@@ -0,0 +1,66 @@
+/*!
+* @file transport_spidev.h
+*
+* ILI9341 transport built on the Linux spidev SPI class (spi.h). Chip
+* select, data/command and reset are driven through sysfs GPIOs since the
+* SPI class runs the controller with SPI_NO_CS.
+*
+* Transports on the same controller (/dev/spidevB.* with the same B) take
+* turns through a shared ILI9341_BusLock; panels on different controllers
+* run fully in parallel.
+*
+*/
+
+#ifndef _ILI9341_TRANSPORT_SPIDEV_H_
+#define _ILI9341_TRANSPORT_SPIDEV_H_
+
+#include "spi.h"
+#include "transport.h"
+
+#define SPIDEV_STAGE_SIZE	SPI_BUFSIZ	//Bytes of small writes batched per ioctl
+#define SPIDEV_COPY_LIMIT	64			//Writes up to this size are copied and batched
+
+//Default sysfs GPIO numbers, matching the bcm2835 pin definitions
+#define SPIDEV_GPIO_CS		17		//P1_11
+#define SPIDEV_GPIO_DC		22		//P1_15
+#define SPIDEV_GPIO_RESET	25		//P1_22
+
+#define SPIDEV_DEFAULT_HZ	10000000	//ILI9341 serial write cycle is 100ns minimum
+
+
+/// spidev transport
+class ILI9341_SpidevTransport : public ILI9341_Transport {
+    public:
+        ILI9341_SpidevTransport(const char *device = "/dev/spidev0.0",
+                                int csPin = SPIDEV_GPIO_CS,
+                                int dcPin = SPIDEV_GPIO_DC,
+                                int resetPin = SPIDEV_GPIO_RESET,
+                                uint32_t hz = SPIDEV_DEFAULT_HZ);
+
+        bool    begin(void);
+        void    end(void);
+        void    setCS(bool high);
+        void    setDC(bool data);
+        void    setReset(bool high);
+        void    write(uint8_t b);
+        void    write(const uint8_t *buf, uint32_t len);
+        uint8_t read(void);
+        void    read(uint8_t *buf, uint32_t len);
+        void    delay(uint32_t ms);
+        bool    setClock(uint32_t hz);
+        uint32_t clock(void) const { return _spi.getSpeed(); }
+        uint32_t maxTransfer(void) const { return _spi.bufsiz(); }
+
+        void    flush(void);
+        SPI    &spi(void) { return _spi; }
+
+    private:
+        SPI     _spi;
+        int     _pins[3];   ///< CS, DC, RESET sysfs GPIO numbers (-1 = unused)
+        int     _fds[3];    ///< Open sysfs value files for _pins
+        uint8_t  _stage[SPIDEV_STAGE_SIZE]; ///< Small writes waiting to be submitted
+        uint32_t _stageLen;
+        ILI9341_BusLock _lock;  ///< Turn on the controller
+};
+
+#endif